@@ -0,0 +1,1322 @@
+#include "rtree.h"
+#include "node_scan.h"
+#include "parallel_sort.h"
+#include "thread_pool.h"
+#include "concurrent_tree.h"
+#include "tree_store.h"
+#include "compact_tree.h"
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+// Benchmark driver for the R-tree.
+// Build with the same settings as the library, e.g.
+//   gcc -O2 -DMAX_ENTRIES=16 -o bench bench.c rtree.c priority_queue.c parallel_sort.c node_scan.c thread_pool.c concurrent_tree.c paged_file.c tree_store.c compact_tree.c -lm -lpthread
+// Usage: ./bench [entries] [queries]
+//        ./bench scale [entries] [queries] [max_threads]   (throughput per thread count)
+//        ./bench mixed [entries] [queries] [readers]       (read latency under writes)
+//        ./bench store [entries] [max_changes]             (checkpoint cost per change count)
+//        ./bench load [entries] [threads]                   (load time from a warm and cold cache)
+//        ./bench move [entries] [moves]                     (moving entries: update vs delete and insert)
+//        ./bench join [points] [rects] [threads]             (spatial join against range searches)
+//        ./bench repack [entries] [queries]                 (tree quality: inserts, repack, rebuild)
+//        ./bench compact [entries] [queries]                (memory and latency of 16- and 8-bit compact trees)
+//        ./bench cursor [entries] [queries]                 (nearest-neighbor cursor against knn)
+//        ./bench approx [entries] [queries]                 (approximate nearest neighbor: latency against error)
+//        ./bench ingest [entries] [queries]                 (insert_batch against looped insert)
+//        ./bench suite [max_entries] [queries] [json] [dataset]  (JSON report, 1K.. entries, all datasets)
+
+// Side length of the square (cube, ...) the data is spread over
+#define WORLD_SIZE 10000.0
+// Upper bound on worker threads in the scaling benchmark
+#define BENCH_MAX_WORKERS 64
+// Queries handed to a worker at a time in the scaling benchmark
+#define BENCH_CHUNK 256
+// Number of clusters in the gaussian dataset
+#define GAUSSIAN_CLUSTERS 32
+// Standard deviation of each gaussian cluster
+#define GAUSSIAN_SIGMA (WORLD_SIZE / 100.0)
+// Cells per axis of the grid the zipf dataset distributes entries over
+#define ZIPF_GRID 16
+// Exponent of the zipf distribution: the cell of rank r gets a share of the
+// entries proportional to 1 / r^ZIPF_EXPONENT
+#define ZIPF_EXPONENT 1.0
+// Largest side of an entry's rectangle; entries are points when the library
+// is built to store points
+#ifdef RTREE_POINTS
+#define ENTRY_SIDE 0.0
+#else
+#define ENTRY_SIDE 1.0
+#endif
+
+// State of the pseudo-random generator, fixed so runs are comparable
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+// Number of entries reported by the range query callback
+static long range_hits = 0;
+
+// Returns a pseudo-random number in [0, 1) (xorshift64*)
+double next_random(void) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (double)((rng_state * 0x2545F4914F6CDD1Dull) >> 11) / 9007199254740992.0;
+}
+
+// Returns the current time in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Counts one result of a range query
+void count_hit(Entry *entry) {
+    (void)entry;
+    range_hits++;
+}
+
+// Counts one result of a batched range query
+void count_batch_hit(int query, Entry *entry) {
+    (void)query;
+    (void)entry;
+    range_hits++;
+}
+
+// Per-worker hit counter, padded to its own cache line
+typedef struct WorkerHits {
+    long hits;
+    char pad[64 - sizeof(long)];
+} WorkerHits;
+static WorkerHits worker_hits[BENCH_MAX_WORKERS];
+
+// Queries shared by the tasks of the scaling benchmark
+typedef struct ScaleJob {
+    RTree *tree;
+    Rect *rects;
+    coord_t (*points)[RTREE_DIMS];
+    int queries;
+    // One query context per worker
+    QueryContext *contexts[BENCH_MAX_WORKERS];
+} ScaleJob;
+
+// Counts one result of a parallel query on the worker that found it
+void count_worker_hit(int worker, Entry *entry) {
+    (void)entry;
+    worker_hits[worker].hits++;
+}
+
+// Counts one pair found by a spatial join
+void count_pair(Entry *a, Entry *b) {
+    (void)a;
+    (void)b;
+    range_hits++;
+}
+
+// Counts one pair found by a parallel spatial join on the worker that found it
+void count_worker_pair(int worker, Entry *a, Entry *b) {
+    (void)a;
+    (void)b;
+    worker_hits[worker].hits++;
+}
+
+// Counts one result of a range query on the worker running it
+void count_range_hit(Entry *entry) {
+    (void)entry;
+    worker_hits[thread_pool_worker_id()].hits++;
+}
+
+// Runs one chunk of range queries on a pool worker
+void range_chunk_task(ThreadPool *pool, void *arg, void *item) {
+    (void)pool;
+    ScaleJob *job = (ScaleJob *)arg;
+    int first = (int)(intptr_t)item;
+    int last = first + BENCH_CHUNK < job->queries ? first + BENCH_CHUNK : job->queries;
+    for (int q = first; q < last; q++) search(job->tree->root, &job->rects[q], count_range_hit);
+}
+
+// Runs one chunk of nearest-neighbor queries on a pool worker
+void nn_chunk_task(ThreadPool *pool, void *arg, void *item) {
+    (void)pool;
+    ScaleJob *job = (ScaleJob *)arg;
+    int first = (int)(intptr_t)item;
+    int last = first + BENCH_CHUNK < job->queries ? first + BENCH_CHUNK : job->queries;
+    QueryContext *ctx = job->contexts[thread_pool_worker_id()];
+    for (int q = first; q < last; q++) nearest_neighbor_ctx(ctx, job->tree, job->points[q]);
+}
+
+// Fills count entries with small rectangles spread uniformly over the world
+Entry* make_uniform_entries(int count) {
+    Entry *entries = (Entry *)malloc(sizeof(Entry) * count);
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double lo = next_random() * WORLD_SIZE;
+            entries[i].rect.min[j] = (coord_t)lo;
+            entries[i].rect.max[j] = (coord_t)(lo + next_random() * ENTRY_SIDE);
+        }
+        entries[i].data = NULL;
+    }
+    return entries;
+}
+
+// Gives an entry a small rectangle at a point, kept inside the world
+// entry: pointer to the entry
+// point: lower corner of the rectangle
+void place_entry(Entry *entry, double point[RTREE_DIMS]) {
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        double lo = point[j];
+        if (lo < 0) lo = 0;
+        if (lo > WORLD_SIZE - 1) lo = WORLD_SIZE - 1;
+        entry->rect.min[j] = (coord_t)lo;
+        entry->rect.max[j] = (coord_t)(lo + next_random() * ENTRY_SIDE);
+    }
+    entry->data = NULL;
+}
+
+// Fills count entries with small rectangles around GAUSSIAN_CLUSTERS centers,
+// normally distributed around each
+Entry* make_gaussian_entries(int count) {
+    double centers[GAUSSIAN_CLUSTERS][RTREE_DIMS];
+    for (int c = 0; c < GAUSSIAN_CLUSTERS; c++) {
+        for (int j = 0; j < RTREE_DIMS; j++) centers[c][j] = next_random() * WORLD_SIZE;
+    }
+    Entry *entries = (Entry *)malloc(sizeof(Entry) * count);
+    for (int i = 0; i < count; i++) {
+        int c = (int)(next_random() * GAUSSIAN_CLUSTERS);
+        double point[RTREE_DIMS];
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            // Box-Muller transform; 1 - u keeps the logarithm finite
+            double u = 1.0 - next_random(), v = next_random();
+            point[j] = centers[c][j] + GAUSSIAN_SIGMA * sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+        }
+        place_entry(&entries[i], point);
+    }
+    return entries;
+}
+
+// Fills count entries with small rectangles spread over a grid of cells whose
+// popularity follows a zipf distribution; popular cells are scattered at random
+Entry* make_zipf_entries(int count) {
+    int cells = 1;
+    for (int j = 0; j < RTREE_DIMS; j++) cells *= ZIPF_GRID;
+    // Cumulative share of the cells by rank, and the cell holding each rank
+    double *cumulative = (double *)malloc(sizeof(double) * cells);
+    int *cell_of_rank = (int *)malloc(sizeof(int) * cells);
+    double total = 0;
+    for (int r = 0; r < cells; r++) {
+        total += 1.0 / pow(r + 1, ZIPF_EXPONENT);
+        cumulative[r] = total;
+        cell_of_rank[r] = r;
+    }
+    for (int r = cells - 1; r > 0; r--) {
+        int k = (int)(next_random() * (r + 1));
+        int swap = cell_of_rank[r];
+        cell_of_rank[r] = cell_of_rank[k];
+        cell_of_rank[k] = swap;
+    }
+
+    double cell_size = WORLD_SIZE / ZIPF_GRID;
+    Entry *entries = (Entry *)malloc(sizeof(Entry) * count);
+    for (int i = 0; i < count; i++) {
+        // Find the first rank whose cumulative share exceeds a random share
+        double share = next_random() * total;
+        int lo = 0, hi = cells - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (cumulative[mid] > share) hi = mid;
+            else lo = mid + 1;
+        }
+        int cell = cell_of_rank[lo];
+        double point[RTREE_DIMS];
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            point[j] = (cell % ZIPF_GRID + next_random()) * cell_size;
+            cell /= ZIPF_GRID;
+        }
+        place_entry(&entries[i], point);
+    }
+    free(cumulative);
+    free(cell_of_rank);
+    return entries;
+}
+
+// Fills count entries from a named dataset: "uniform", "gaussian" or "zipf"
+// Returns NULL for an unknown name
+Entry* make_dataset_entries(const char *dataset, int count) {
+    if (strcmp(dataset, "uniform") == 0) return make_uniform_entries(count);
+    if (strcmp(dataset, "gaussian") == 0) return make_gaussian_entries(count);
+    if (strcmp(dataset, "zipf") == 0) return make_zipf_entries(count);
+    return NULL;
+}
+
+// Sums and clears the per-worker hit counters
+long take_worker_hits(void) {
+    long total = 0;
+    for (int w = 0; w < BENCH_MAX_WORKERS; w++) {
+        total += worker_hits[w].hits;
+        worker_hits[w].hits = 0;
+    }
+    return total;
+}
+
+// Measures how query throughput scales with the number of threads, on one
+// bulk-loaded tree shared read-only by every worker
+// max_threads: largest thread count tried, or 0 for one per processor
+void run_scaling(int count, int queries, int max_threads) {
+    Entry *entries = make_uniform_entries(count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) pointers[i] = &entries[i];
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    tree->read_only = true;
+
+    ScaleJob job;
+    job.tree = tree;
+    job.queries = queries;
+    job.rects = (Rect *)malloc(sizeof(Rect) * queries);
+    job.points = malloc(sizeof(coord_t[RTREE_DIMS]) * queries);
+    double side = WORLD_SIZE / 100.0;
+    for (int q = 0; q < queries; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double lo = next_random() * (WORLD_SIZE - side);
+            job.rects[q].min[j] = (coord_t)lo;
+            job.rects[q].max[j] = (coord_t)(lo + side);
+            job.points[q][j] = (coord_t)(next_random() * WORLD_SIZE);
+        }
+    }
+    for (int w = 0; w < BENCH_MAX_WORKERS; w++) job.contexts[w] = create_query_context();
+
+    // One large range query covering a quarter of the world
+    Rect big;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        big.min[j] = (coord_t)(WORLD_SIZE / 4);
+        big.max[j] = (coord_t)(WORLD_SIZE * 3 / 4);
+    }
+
+    if (max_threads <= 0) max_threads = parallel_thread_count();
+    if (max_threads > BENCH_MAX_WORKERS) max_threads = BENCH_MAX_WORKERS;
+    double base_range = 0, base_nn = 0, base_big = 0;
+    for (int threads = 1; ; threads = threads * 2 < max_threads ? threads * 2 : max_threads) {
+        ThreadPool *pool = create_thread_pool(threads);
+
+        // Independent range queries, a chunk per task
+        double start = now_seconds();
+        for (int q = 0; q < queries; q += BENCH_CHUNK) thread_pool_submit(pool, range_chunk_task, &job, (void *)(intptr_t)q);
+        thread_pool_wait(pool);
+        double range_seconds = now_seconds() - start;
+        long hits = take_worker_hits();
+
+        // Independent nearest-neighbor queries, a chunk per task
+        start = now_seconds();
+        for (int q = 0; q < queries; q += BENCH_CHUNK) thread_pool_submit(pool, nn_chunk_task, &job, (void *)(intptr_t)q);
+        thread_pool_wait(pool);
+        double nn_seconds = now_seconds() - start;
+
+        // The large range query split across the workers
+        start = now_seconds();
+        parallel_search(tree, pool, &big, count_worker_hit);
+        double big_seconds = now_seconds() - start;
+        long big_hits = take_worker_hits();
+
+        free_thread_pool(pool);
+        if (threads == 1) {
+            base_range = range_seconds;
+            base_nn = nn_seconds;
+            base_big = big_seconds;
+        }
+        printf("threads=%d range_qps=%.0f nn_qps=%.0f big_search_ms=%.2f "
+               "range_speedup=%.2f nn_speedup=%.2f big_speedup=%.2f hits=%ld big_hits=%ld\n",
+               threads, queries / range_seconds, queries / nn_seconds, big_seconds * 1e3,
+               base_range / range_seconds, base_nn / nn_seconds, base_big / big_seconds, hits, big_hits);
+        if (threads == max_threads) break;
+    }
+
+    for (int w = 0; w < BENCH_MAX_WORKERS; w++) free_query_context(job.contexts[w]);
+    free(job.points);
+    free(job.rects);
+    free_tree(tree);
+    free(pointers);
+    free(entries);
+}
+
+// State shared by the threads of the mixed read/write benchmark
+typedef struct MixedJob {
+    ConcurrentRTree *ctree;
+    // Query points, one run of queries per reader
+    coord_t (*points)[RTREE_DIMS];
+    int queries;
+    // Latency of each query in seconds, one run per reader
+    double *latencies;
+    // Entries the writer cycles through, and how many of them
+    Entry *extra;
+    int num_extra;
+    // Set once every reader has finished
+    atomic_int readers_done;
+    int num_readers;
+    // Writes done by the writer
+    long writes;
+} MixedJob;
+
+// Arguments of one reader thread
+typedef struct MixedReader {
+    MixedJob *job;
+    int index;
+} MixedReader;
+
+// Compares two latencies for qsort
+int compare_latencies(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Runs a reader's nearest-neighbor queries, timing each one
+void *mixed_reader_main(void *arg) {
+    MixedReader *reader = (MixedReader *)arg;
+    MixedJob *job = reader->job;
+    QueryContext *ctx = create_query_context();
+    int first = reader->index * job->queries;
+    for (int q = first; q < first + job->queries; q++) {
+        double start = now_seconds();
+        ReadToken token;
+        RTree *tree = concurrent_read_begin(job->ctree, &token);
+        nearest_neighbor_ctx(ctx, tree, job->points[q]);
+        concurrent_read_end(job->ctree, &token);
+        job->latencies[q] = now_seconds() - start;
+    }
+    free_query_context(ctx);
+    atomic_fetch_add(&job->readers_done, 1);
+    return NULL;
+}
+
+// Inserts and deletes entries until the readers finish, keeping a sliding
+// window of inserted entries so the tree size stays constant
+void *mixed_writer_main(void *arg) {
+    MixedJob *job = (MixedJob *)arg;
+    int window = job->num_extra / 2;
+    long op = 0;
+    while (atomic_load(&job->readers_done) < job->num_readers) {
+        concurrent_insert(job->ctree, &job->extra[op % job->num_extra]);
+        if (op >= window) concurrent_delete(job->ctree, &job->extra[(op - window) % job->num_extra]);
+        op++;
+    }
+    job->writes = op;
+    return NULL;
+}
+
+// Runs the readers once, optionally with a writer, and prints latency percentiles
+void run_mixed_round(MixedJob *job, bool with_writer) {
+    pthread_t writer;
+    pthread_t *threads = (pthread_t *)malloc(sizeof(pthread_t) * job->num_readers);
+    MixedReader *readers = (MixedReader *)malloc(sizeof(MixedReader) * job->num_readers);
+    atomic_store(&job->readers_done, 0);
+    job->writes = 0;
+    double start = now_seconds();
+    if (with_writer) pthread_create(&writer, NULL, mixed_writer_main, job);
+    for (int r = 0; r < job->num_readers; r++) {
+        readers[r].job = job;
+        readers[r].index = r;
+        pthread_create(&threads[r], NULL, mixed_reader_main, &readers[r]);
+    }
+    for (int r = 0; r < job->num_readers; r++) pthread_join(threads[r], NULL);
+    if (with_writer) pthread_join(writer, NULL);
+    double seconds = now_seconds() - start;
+
+    long total = (long)job->queries * job->num_readers;
+    qsort(job->latencies, (size_t)total, sizeof(double), compare_latencies);
+    printf("writer=%s readers=%d read_p50_us=%.2f read_p99_us=%.2f read_p999_us=%.2f read_max_us=%.2f "
+           "reads_per_s=%.0f writes_per_s=%.0f\n",
+           with_writer ? "on" : "off", job->num_readers,
+           job->latencies[total / 2] * 1e6, job->latencies[total * 99 / 100] * 1e6,
+           job->latencies[total * 999 / 1000] * 1e6, job->latencies[total - 1] * 1e6,
+           total / seconds, job->writes / seconds);
+    free(readers);
+    free(threads);
+}
+
+// Measures nearest-neighbor latency on a concurrent tree with and without a
+// writer inserting and deleting at full speed
+void run_mixed(int count, int queries, int num_readers) {
+    Entry *entries = make_uniform_entries(count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) pointers[i] = &entries[i];
+
+    MixedJob job;
+    job.ctree = create_concurrent_tree(pointers, count);
+    job.queries = queries;
+    job.num_readers = num_readers;
+    job.num_extra = 20000;
+    job.extra = make_uniform_entries(job.num_extra);
+    job.points = malloc(sizeof(coord_t[RTREE_DIMS]) * queries * num_readers);
+    job.latencies = (double *)malloc(sizeof(double) * queries * num_readers);
+    for (int q = 0; q < queries * num_readers; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) job.points[q][j] = (coord_t)(next_random() * WORLD_SIZE);
+    }
+
+    run_mixed_round(&job, false);
+    run_mixed_round(&job, true);
+
+    free_concurrent_tree(job.ctree);
+    free(job.latencies);
+    free(job.points);
+    free(job.extra);
+    free(pointers);
+    free(entries);
+}
+
+// Writes a file's cached pages to disk and drops them from the page cache,
+// so the next read comes from the device as after a restart
+void drop_file_cache(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Times loading a saved tree on the calling thread and on a pool, with the
+// file cached and after dropping it from the cache
+void run_load(int count, int num_threads) {
+    const char *path = "bench_load.rt";
+    Entry *entries = make_uniform_entries(count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) pointers[i] = &entries[i];
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    save_tree(tree, path);
+    free_tree(tree);
+    free(pointers);
+    free(entries);
+
+    ThreadPool *pool = create_thread_pool(num_threads);
+    printf("entries=%d threads=%d\n", count, thread_pool_size(pool));
+    for (int cold = 0; cold < 2; cold++) {
+        for (int parallel = 0; parallel < 2; parallel++) {
+            if (cold) drop_file_cache(path);
+            double start = now_seconds();
+            RTree *loaded = parallel ? load_tree_parallel(path, pool) : load_tree(path);
+            double seconds = now_seconds() - start;
+            printf("%s %s load_ms=%.1f\n", cold ? "cold" : "warm", parallel ? "parallel" : "serial  ", seconds * 1e3);
+            free_tree(loaded);
+        }
+    }
+    free_thread_pool(pool);
+    remove(path);
+}
+
+// Compares a full save_tree with incremental checkpoints after 10, 100, ...
+// changes, each change moving one entry (a delete and an insert)
+void run_store(int count, int max_changes) {
+    const char *path = "bench_store.rt";
+    Entry *entries = make_uniform_entries(count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) {
+        entries[i].data = (void *)(uintptr_t)(i + 1);
+        pointers[i] = &entries[i];
+    }
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    double start = now_seconds();
+    save_tree(tree, path);
+    double save_seconds = now_seconds() - start;
+    free_tree(tree);
+
+    TreeStore *store = open_tree_store(path);
+    // Sync the file save_tree left in the page cache before timing checkpoints
+    store_checkpoint(store);
+    printf("entries=%d save_tree_ms=%.1f pages=%lu\n", count, save_seconds * 1e3, (unsigned long)store->page_count);
+    for (int changes = 10; changes <= max_changes; changes *= 10) {
+        for (int c = 0; c < changes; c++) {
+            Entry *entry = &entries[(int)(next_random() * count)];
+            store_delete(store, &entry->rect, entry->data);
+            for (int j = 0; j < RTREE_DIMS; j++) {
+                double lo = next_random() * WORLD_SIZE;
+                entry->rect.min[j] = (coord_t)lo;
+                entry->rect.max[j] = (coord_t)(lo + next_random() * ENTRY_SIDE);
+            }
+            store_insert(store, &entry->rect, entry->data);
+        }
+        start = now_seconds();
+        store_checkpoint(store);
+        double checkpoint_seconds = now_seconds() - start;
+        printf("changes=%d checkpoint_ms=%.2f pages_written=%ld\n", changes, checkpoint_seconds * 1e3, store->last_checkpoint_pages);
+    }
+    close_tree_store(store);
+    remove(path);
+    remove("bench_store.rt.wal");
+    free(pointers);
+    free(entries);
+}
+
+// Moves every entry of a copy of the entries by the given offsets, one at a
+// time, either with update_entry or with delete_entry and insert
+// tree: tree over entries
+// entries: entries of the tree
+// targets: entry index of each move
+// steps: offset of each move, RTREE_DIMS values per move
+// moves: number of moves
+// use_update: whether to move entries with update_entry
+// Returns the time taken in seconds
+double time_moves(RTree *tree, Entry *entries, int *targets, double *steps, int moves, bool use_update) {
+    double start = now_seconds();
+    for (int m = 0; m < moves; m++) {
+        Entry *entry = &entries[targets[m]];
+        Rect rect = entry->rect;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            rect.min[j] = (coord_t)(rect.min[j] + steps[m * RTREE_DIMS + j]);
+            rect.max[j] = (coord_t)(rect.max[j] + steps[m * RTREE_DIMS + j]);
+        }
+        if (use_update) {
+            update_entry(tree, entry, &rect);
+        } else {
+            delete_entry(tree, entry);
+            entry->rect = rect;
+            insert(tree, entry);
+        }
+    }
+    return now_seconds() - start;
+}
+
+// Compares moving entries with update_entry against a delete and an insert,
+// and deleting a tenth of the entries one by one against one delete_batch
+void run_moves(int count, int moves) {
+    Entry *entries[2];
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    RTree *trees[2];
+    entries[0] = make_uniform_entries(count);
+    entries[1] = (Entry *)malloc(sizeof(Entry) * count);
+    memcpy(entries[1], entries[0], sizeof(Entry) * count);
+    for (int t = 0; t < 2; t++) {
+        for (int i = 0; i < count; i++) pointers[i] = &entries[t][i];
+        trees[t] = bulk_load(pointers, count, BULK_LOAD_STR);
+    }
+
+    // Small steps, as from vehicles reporting their position often, with an
+    // occasional jump across the world
+    int *targets = (int *)malloc(sizeof(int) * moves);
+    double *steps = (double *)malloc(sizeof(double) * moves * RTREE_DIMS);
+    for (int m = 0; m < moves; m++) {
+        targets[m] = (int)(next_random() * count);
+        double scale = next_random() < 0.01 ? WORLD_SIZE / 2 : 2.0;
+        for (int j = 0; j < RTREE_DIMS; j++) steps[m * RTREE_DIMS + j] = (next_random() * 2 - 1) * scale;
+    }
+    printf("entries=%d moves=%d\n", count, moves);
+    double reinsert_seconds = time_moves(trees[0], entries[0], targets, steps, moves, false);
+    double update_seconds = time_moves(trees[1], entries[1], targets, steps, moves, true);
+    printf("delete+insert ns/move=%.0f\n", reinsert_seconds * 1e9 / moves);
+    printf("update_entry  ns/move=%.0f\n", update_seconds * 1e9 / moves);
+
+    // Delete the same tenth of the entries from both trees
+    int doomed = count / 10;
+    for (int i = 0; i < doomed; i++) pointers[i] = &entries[0][i * 10];
+    double start = now_seconds();
+    for (int i = 0; i < doomed; i++) delete_entry(trees[0], pointers[i]);
+    double single_seconds = now_seconds() - start;
+    for (int i = 0; i < doomed; i++) pointers[i] = &entries[1][i * 10];
+    start = now_seconds();
+    delete_batch(trees[1], pointers, doomed);
+    double batch_seconds = now_seconds() - start;
+    printf("delete_entry  ns/delete=%.0f\n", single_seconds * 1e9 / doomed);
+    printf("delete_batch  ns/delete=%.0f\n", batch_seconds * 1e9 / doomed);
+
+    for (int t = 0; t < 2; t++) {
+        free_tree(trees[t]);
+        free(entries[t]);
+    }
+    free(targets);
+    free(steps);
+    free(pointers);
+}
+
+// Joins a tree of points of interest with a tree of larger rectangles (like
+// polygon bounding boxes), comparing one range search per rectangle with a
+// synchronized traversal, serial and on a thread pool
+void run_join(int count, int num_rects, int num_threads) {
+#ifdef RTREE_POINTS
+    printf("join needs a tree of rectangles; build without RTREE_POINTS\n");
+    return;
+#endif
+    Entry *points = make_uniform_entries(count);
+    Entry *rects = make_uniform_entries(num_rects);
+    double side = WORLD_SIZE / 100.0;
+    for (int i = 0; i < num_rects; i++) {
+        for (int j = 0; j < RTREE_DIMS; j++) rects[i].rect.max[j] = (coord_t)(rects[i].rect.min[j] + next_random() * side);
+    }
+    int most = count > num_rects ? count : num_rects;
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * most);
+    for (int i = 0; i < count; i++) pointers[i] = &points[i];
+    RTree *point_tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    for (int i = 0; i < num_rects; i++) pointers[i] = &rects[i];
+    RTree *rect_tree = bulk_load(pointers, num_rects, BULK_LOAD_STR);
+    ThreadPool *pool = create_thread_pool(num_threads);
+    printf("points=%d rects=%d threads=%d\n", count, num_rects, thread_pool_size(pool));
+
+    range_hits = 0;
+    double start = now_seconds();
+    for (int i = 0; i < num_rects; i++) search(point_tree->root, &rects[i].rect, count_hit);
+    double search_seconds = now_seconds() - start;
+    printf("range searches  s=%.3f pairs=%ld\n", search_seconds, range_hits);
+
+    range_hits = 0;
+    start = now_seconds();
+    join(point_tree, rect_tree, count_pair);
+    double join_seconds = now_seconds() - start;
+    printf("join            s=%.3f pairs=%ld speedup=%.1fx\n", join_seconds, range_hits, search_seconds / join_seconds);
+
+    take_worker_hits();
+    start = now_seconds();
+    parallel_join(point_tree, rect_tree, pool, count_worker_pair);
+    double parallel_seconds = now_seconds() - start;
+    printf("parallel_join   s=%.3f pairs=%ld speedup=%.1fx\n", parallel_seconds, take_worker_hits(), search_seconds / parallel_seconds);
+
+    free_thread_pool(pool);
+    free_tree(point_tree);
+    free_tree(rect_tree);
+    free(pointers);
+    free(points);
+    free(rects);
+}
+
+// Prints the quality of a tree and the mean latency of range and
+// nearest-neighbor queries centered on random entries
+// label: name of the tree's state
+// tree: pointer to the R-tree
+// entries: entries in the tree
+// count: number of entries
+// queries: number of range and of nearest-neighbor queries
+void report_quality(const char *label, RTree *tree, Entry *entries, int count, int queries) {
+    TreeQuality quality = analyze_tree(tree);
+    double side = WORLD_SIZE / 100.0;
+    range_hits = 0;
+    double start = now_seconds();
+    for (int q = 0; q < queries; q++) {
+        Entry *center = &entries[(int)(next_random() * count)];
+        Rect rect;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            rect.min[j] = (coord_t)(center->rect.min[j] - side / 2);
+            rect.max[j] = (coord_t)(center->rect.min[j] + side / 2);
+        }
+        search(tree->root, &rect, count_hit);
+    }
+    double range_seconds = now_seconds() - start;
+    QueryContext *ctx = create_query_context();
+    start = now_seconds();
+    for (int q = 0; q < queries; q++) {
+        Entry *center = &entries[(int)(next_random() * count)];
+        coord_t point[RTREE_DIMS];
+        for (int j = 0; j < RTREE_DIMS; j++) point[j] = (coord_t)(center->rect.min[j] + (next_random() - 0.5) * side);
+        nearest_neighbor_ctx(ctx, tree, point);
+    }
+    double nn_seconds = now_seconds() - start;
+    free_query_context(ctx);
+    printf("%-9s height=%d leaf_fill=%.2f overlap=%.3g dead_space=%.3g range_us=%.2f nn_us=%.2f\n",
+           label, quality.height, quality.levels[0].fill, quality.overlap, quality.dead_space,
+           range_seconds * 1e6 / queries, nn_seconds * 1e6 / queries);
+}
+
+// Builds a tree by inserts with the midpoint split, the kind that degrades
+// over time, then repacks the worst tenth of the subtrees at each height and
+// finally rebuilds the whole tree, reporting quality and query latency
+void run_repack(int count, int queries) {
+    Entry *entries = make_uniform_entries(count);
+    RTree *tree = init_tree();
+    tree->split_policy = SPLIT_MIDPOINT;
+    for (int i = 0; i < count; i++) insert(tree, &entries[i]);
+    printf("entries=%d queries=%d\n", count, queries);
+    report_quality("inserted", tree, entries, count, queries);
+
+    TreeQuality quality = analyze_tree(tree);
+    double start = now_seconds();
+    int repacked = 0;
+    for (int h = 1; h < quality.height; h++) {
+        long nodes = quality.levels[h].nodes;
+        repacked += repack_subtrees(tree, h, (int)(nodes / 10 > 0 ? nodes / 10 : 1));
+    }
+    printf("repack_subtrees: %d subtrees in %.3f s\n", repacked, now_seconds() - start);
+    report_quality("repacked", tree, entries, count, queries);
+
+    start = now_seconds();
+    rebuild_tree(tree);
+    printf("rebuild_tree: %.3f s\n", now_seconds() - start);
+    report_quality("rebuilt", tree, entries, count, queries);
+    free_tree(tree);
+    free(entries);
+}
+
+// Returns the bytes of node (and tree-owned entry) slabs a tree allocated
+size_t tree_memory_bytes(RTree *tree) {
+    size_t bytes = sizeof(RTree);
+    for (NodeSlab *slab = tree->pool.slabs; slab; slab = slab->next) {
+        bytes += sizeof(NodeSlab) + slab->node_size * (size_t)slab->capacity;
+    }
+    for (NodeSlab *slab = tree->pool.leaf_slabs; slab; slab = slab->next) {
+        bytes += sizeof(NodeSlab) + slab->node_size * (size_t)slab->capacity;
+    }
+    for (EntrySlab *slab = tree->pool.entry_slabs; slab; slab = slab->next) {
+        bytes += sizeof(EntrySlab) + sizeof(Entry) * (size_t)slab->capacity;
+    }
+    return bytes;
+}
+
+// Returns the size of a file in bytes, or 0 if it can't be opened
+long file_bytes(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return 0;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+// Runs range and nearest-neighbor queries on a tree or, when ct is set, on a
+// compact tree, and prints the memory per entry and the mean latencies
+// label: name of the encoding
+// tree: pointer to the R-tree, used when ct is NULL
+// ct: pointer to the compact tree, or NULL
+// bytes: memory the encoding takes
+// count: number of entries
+// rects: range queries
+// points: nearest-neighbor query points
+// queries: number of range and of nearest-neighbor queries
+void report_compact(const char *label, RTree *tree, CompactTree *ct, size_t bytes, int count, Rect *rects, coord_t (*points)[RTREE_DIMS], int queries) {
+    range_hits = 0;
+    double start = now_seconds();
+    for (int q = 0; q < queries; q++) {
+        if (ct) compact_search(ct, &rects[q], count_hit);
+        else search(tree->root, &rects[q], count_hit);
+    }
+    double range_seconds = now_seconds() - start;
+    start = now_seconds();
+    for (int q = 0; q < queries; q++) {
+        if (ct) compact_nearest_neighbor(ct, points[q]);
+        else nearest_neighbor(tree, points[q]);
+    }
+    double nn_seconds = now_seconds() - start;
+    printf("%-10s bytes_per_entry=%.1f range_us=%.2f nn_us=%.2f hits=%ld\n", label, (double)bytes / count,
+           range_seconds * 1e6 / queries, nn_seconds * 1e6 / queries, range_hits);
+}
+
+// Compares the memory, file size and query latency of trees built by inserts
+// and by bulk loading with compact copies of the bulk-loaded tree using 16-
+// and 8-bit codes. Memory excludes the entries, which the caller owns in
+// every case except the loaded compact tree.
+void run_compact(int count, int queries) {
+    Entry *entries = make_uniform_entries(count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) pointers[i] = &entries[i];
+    double side = WORLD_SIZE / 100.0;
+    Rect *rects = (Rect *)malloc(sizeof(Rect) * queries);
+    coord_t (*points)[RTREE_DIMS] = malloc(sizeof(coord_t[RTREE_DIMS]) * queries);
+    for (int q = 0; q < queries; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double lo = next_random() * (WORLD_SIZE - side);
+            rects[q].min[j] = (coord_t)lo;
+            rects[q].max[j] = (coord_t)(lo + side);
+            points[q][j] = (coord_t)(next_random() * WORLD_SIZE);
+        }
+    }
+    printf("entries=%d queries=%d fanout=%d\n", count, queries, MAX_ENTRIES);
+
+    RTree *inserted = init_tree();
+    for (int i = 0; i < count; i++) insert(inserted, &entries[i]);
+    report_compact("inserted", inserted, NULL, tree_memory_bytes(inserted), count, rects, points, queries);
+    free_tree(inserted);
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    report_compact("bulk_load", tree, NULL, tree_memory_bytes(tree), count, rects, points, queries);
+    save_tree(tree, "bench_compact.rt");
+    printf("save_tree file_bytes_per_entry=%.1f\n", (double)file_bytes("bench_compact.rt") / count);
+
+    for (int bits = 16; bits >= 8; bits -= 8) {
+        char label[32];
+        double start = now_seconds();
+        CompactTree *ct = compact_tree(tree, bits);
+        double build_seconds = now_seconds() - start;
+        snprintf(label, sizeof(label), "compact%d", bits);
+        report_compact(label, NULL, ct, compact_tree_bytes(ct), count, rects, points, queries);
+        save_compact_tree(ct, "bench_compact.rtc");
+        start = now_seconds();
+        CompactTree *loaded = load_compact_tree("bench_compact.rtc");
+        double load_seconds = now_seconds() - start;
+        printf("compact_tree_s=%.3f load_s=%.3f file_bytes_per_entry=%.1f\n", build_seconds, load_seconds,
+               (double)file_bytes("bench_compact.rtc") / count);
+        snprintf(label, sizeof(label), "loaded%d", bits);
+        report_compact(label, NULL, loaded, compact_tree_bytes(loaded), count, rects, points, queries);
+        free_compact_tree(loaded);
+        free_compact_tree(ct);
+    }
+    remove("bench_compact.rt");
+    remove("bench_compact.rtc");
+    free_tree(tree);
+    free(points);
+    free(rects);
+    free(pointers);
+    free(entries);
+}
+
+// Compares taking the m nearest entries from a nearest-neighbor cursor with
+// knn(k = m), then finding the nearest entry that passes a filter (every
+// FILTER_EVERY-th entry): the cursor stops at the first match, knn has to guess
+// k and double it until a match turns up.
+#define FILTER_EVERY 100
+void run_cursor(int count, int queries) {
+    Entry *entries = make_uniform_entries(count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) pointers[i] = &entries[i];
+    coord_t (*points)[RTREE_DIMS] = malloc(sizeof(coord_t[RTREE_DIMS]) * queries);
+    for (int q = 0; q < queries; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) points[q][j] = (coord_t)(next_random() * WORLD_SIZE);
+    }
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    QueryContext *ctx = create_query_context();
+    NearestCursor *cursor = create_nearest_cursor(tree, points[0]);
+    int max_k = 1000 < count ? 1000 : count;
+    Entry **out = (Entry **)malloc(sizeof(Entry *) * count);
+    printf("entries=%d queries=%d fanout=%d\n", count, queries, MAX_ENTRIES);
+
+    for (int m = 1; m <= max_k; m *= 10) {
+        long checksum = 0;
+        double start = now_seconds();
+        for (int q = 0; q < queries; q++) {
+            nearest_cursor_restart(cursor, tree, points[q]);
+            for (int i = 0; i < m; i++) checksum += nearest_cursor_next(cursor, NULL) - entries;
+        }
+        double cursor_seconds = now_seconds() - start;
+        start = now_seconds();
+        for (int q = 0; q < queries; q++) {
+            int found = knn_ctx(ctx, tree, points[q], m, out);
+            for (int i = 0; i < found; i++) checksum -= out[i] - entries;
+        }
+        double knn_seconds = now_seconds() - start;
+        printf("m=%-5d cursor_us=%.2f knn_us=%.2f%s\n", m, cursor_seconds * 1e6 / queries,
+               knn_seconds * 1e6 / queries, checksum == 0 ? "" : " MISMATCH");
+    }
+
+    long cursor_taken = 0, knn_taken = 0;
+    double start = now_seconds();
+    for (int q = 0; q < queries; q++) {
+        nearest_cursor_restart(cursor, tree, points[q]);
+        Entry *entry;
+        while ((entry = nearest_cursor_next(cursor, NULL)) != NULL) {
+            cursor_taken++;
+            if ((entry - entries) % FILTER_EVERY == 0) break;
+        }
+    }
+    double cursor_seconds = now_seconds() - start;
+    start = now_seconds();
+    for (int q = 0; q < queries; q++) {
+        bool matched = false;
+        for (int k = 8; !matched; k *= 2) {
+            if (k > count) k = count;
+            int found = knn_ctx(ctx, tree, points[q], k, out);
+            knn_taken += found;
+            for (int i = 0; i < found && !matched; i++) matched = (out[i] - entries) % FILTER_EVERY == 0;
+            if (k == count) break;
+        }
+    }
+    double knn_seconds = now_seconds() - start;
+    printf("filter 1/%d cursor_us=%.2f entries_per_query=%.1f knn_doubling_us=%.2f entries_per_query=%.1f\n",
+           FILTER_EVERY, cursor_seconds * 1e6 / queries, (double)cursor_taken / queries,
+           knn_seconds * 1e6 / queries, (double)knn_taken / queries);
+
+    free(out);
+    free_nearest_cursor(cursor);
+    free_query_context(ctx);
+    free_tree(tree);
+    free(points);
+    free(pointers);
+    free(entries);
+}
+
+// Returns the distance from a point to an entry's rectangle
+double entry_distance(Entry *entry, coord_t point[RTREE_DIMS]) {
+    double sum = 0;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        double gap = 0;
+        if (point[j] < entry->rect.min[j]) gap = entry->rect.min[j] - point[j];
+        else if (point[j] > entry->rect.max[j]) gap = point[j] - entry->rect.max[j];
+        sum += gap * gap;
+    }
+    return sqrt(sum);
+}
+
+// Measures approximate nearest-neighbor queries on clustered (gaussian) data
+// against the allowed error and the node budget: p50 and p99 latency, the
+// share of answers reported exact, and the mean and worst ratio of the
+// distance found to the true nearest distance. Query points are spread over
+// the whole world, so most fall between clusters where exact search is slowest.
+void run_approx(int count, int queries) {
+    static const double epsilons[] = {0, 0.1, 0.25, 0.5, 1.0, 2.0};
+    static const long budgets[] = {0, 64, 16};
+    Entry *entries = make_gaussian_entries(count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) pointers[i] = &entries[i];
+    coord_t (*points)[RTREE_DIMS] = malloc(sizeof(coord_t[RTREE_DIMS]) * queries);
+    for (int q = 0; q < queries; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) points[q][j] = (coord_t)(next_random() * WORLD_SIZE);
+    }
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    QueryContext *ctx = create_query_context();
+    double *truth = (double *)malloc(sizeof(double) * queries);
+    for (int q = 0; q < queries; q++) truth[q] = entry_distance(nearest_neighbor_ctx(ctx, tree, points[q]), points[q]);
+    double *latencies = (double *)malloc(sizeof(double) * queries);
+    printf("entries=%d queries=%d fanout=%d dataset=gaussian\n", count, queries, MAX_ENTRIES);
+
+    for (int b = 0; b < (int)(sizeof(budgets) / sizeof(budgets[0])); b++) {
+        for (int e = 0; e < (int)(sizeof(epsilons) / sizeof(epsilons[0])); e++) {
+            NearestOptions options = {epsilons[e], budgets[b]};
+            int exact_count = 0;
+            double ratio_sum = 0, worst_ratio = 1;
+            for (int q = 0; q < queries; q++) {
+                bool exact;
+                double start = now_seconds();
+                Entry *found = nearest_neighbor_approx_ctx(ctx, tree, points[q], &options, &exact);
+                latencies[q] = now_seconds() - start;
+                exact_count += exact;
+                double ratio = truth[q] > 0 ? entry_distance(found, points[q]) / truth[q] : 1;
+                ratio_sum += ratio;
+                if (ratio > worst_ratio) worst_ratio = ratio;
+            }
+            qsort(latencies, (size_t)queries, sizeof(double), compare_latencies);
+            printf("eps=%-4.2f max_nodes=%-3ld p50_us=%.2f p99_us=%.2f exact=%.3f mean_ratio=%.4f worst_ratio=%.3f\n",
+                   epsilons[e], budgets[b], latencies[queries / 2] * 1e6, latencies[(long)queries * 99 / 100] * 1e6,
+                   (double)exact_count / queries, ratio_sum / queries, worst_ratio);
+        }
+    }
+
+    free(latencies);
+    free(truth);
+    free_query_context(ctx);
+    free_tree(tree);
+    free(points);
+    free(pointers);
+    free(entries);
+}
+
+// Times range queries of about 100 hits on a tree
+// Returns the mean query time in microseconds
+double time_range_queries(RTree *tree, int queries) {
+    double side = WORLD_SIZE / 100.0;
+    range_hits = 0;
+    double start = now_seconds();
+    for (int q = 0; q < queries; q++) {
+        Rect rect;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double lo = next_random() * (WORLD_SIZE - side);
+            rect.min[j] = (coord_t)lo;
+            rect.max[j] = (coord_t)(lo + side);
+        }
+        search(tree->root, &rect, count_hit);
+    }
+    return (now_seconds() - start) * 1e6 / queries;
+}
+
+// Compares ingesting entries with insert_batch, in batches of several sizes,
+// against looped insert: into an empty tree, and into a tree that already
+// holds as many entries. Range query time on the result shows the quality of
+// the tree each way builds.
+void run_ingest(int count, int queries) {
+    static const int batch_sizes[] = {1000, 10000, 100000, 0};
+    Entry *base = make_uniform_entries(count);
+    Entry *entries = make_uniform_entries(count);
+    Entry **base_pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) {
+        base_pointers[i] = &base[i];
+        pointers[i] = &entries[i];
+    }
+    printf("entries=%d queries=%d fanout=%d\n", count, queries, MAX_ENTRIES);
+
+    for (int filled = 0; filled <= 1; filled++) {
+        const char *into = filled ? "full" : "empty";
+        RTree *tree = filled ? bulk_load(base_pointers, count, BULK_LOAD_STR) : init_tree();
+        double start = now_seconds();
+        for (int i = 0; i < count; i++) insert(tree, &entries[i]);
+        double seconds = now_seconds() - start;
+        printf("into=%-5s insert       Mentries_s=%.2f range_us=%.2f\n", into, count / seconds / 1e6,
+               time_range_queries(tree, queries));
+        free_tree(tree);
+
+        for (int b = 0; b < (int)(sizeof(batch_sizes) / sizeof(batch_sizes[0])); b++) {
+            int batch = batch_sizes[b] > 0 && batch_sizes[b] < count ? batch_sizes[b] : count;
+            tree = filled ? bulk_load(base_pointers, count, BULK_LOAD_STR) : init_tree();
+            start = now_seconds();
+            for (int i = 0; i < count; i += batch) {
+                insert_batch(tree, pointers + i, count - i < batch ? count - i : batch);
+            }
+            seconds = now_seconds() - start;
+            printf("into=%-5s batch=%-7d Mentries_s=%.2f range_us=%.2f\n", into, batch, count / seconds / 1e6,
+                   time_range_queries(tree, queries));
+            free_tree(tree);
+        }
+    }
+
+    free(pointers);
+    free(base_pointers);
+    free(entries);
+    free(base);
+}
+
+// Writes the p50, p99 and p999 of latencies as a JSON member, in microseconds
+// out: stream to write to
+// name: name of the member
+// latencies: latencies in seconds; sorted in place
+// count: number of latencies
+void write_percentiles(FILE *out, const char *name, double *latencies, int count) {
+    qsort(latencies, (size_t)count, sizeof(double), compare_latencies);
+    fprintf(out, "\"%s\": {\"p50\": %.3f, \"p99\": %.3f, \"p999\": %.3f}", name,
+            latencies[count / 2] * 1e6, latencies[(long)count * 99 / 100] * 1e6,
+            latencies[(long)count * 999 / 1000] * 1e6);
+}
+
+// Measures one dataset at one size and writes the results as a JSON object:
+// insert throughput, bulk load time, range and nearest-neighbor latency
+// percentiles, memory per entry, and save and load time
+// out: stream to write to
+// dataset: name of the dataset
+// count: number of entries
+// queries: number of range and of nearest-neighbor queries
+void run_suite_case(FILE *out, const char *dataset, int count, int queries) {
+    const char *path = "bench_suite.rt";
+    Entry *entries = make_dataset_entries(dataset, count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) pointers[i] = &entries[i];
+
+    double start = now_seconds();
+    RTree *inserted = init_tree();
+    for (int i = 0; i < count; i++) insert(inserted, &entries[i]);
+    double insert_seconds = now_seconds() - start;
+    size_t insert_bytes = tree_memory_bytes(inserted);
+    free_tree(inserted);
+
+    start = now_seconds();
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    double bulk_seconds = now_seconds() - start;
+    size_t bulk_bytes = tree_memory_bytes(tree);
+
+    // Queries follow the data: each is centered on a random entry, and range
+    // queries cover about 0.01% of the world
+    double side = WORLD_SIZE / 100.0;
+    double *latencies = (double *)malloc(sizeof(double) * queries);
+    range_hits = 0;
+    for (int q = 0; q < queries; q++) {
+        Entry *center = &entries[(int)(next_random() * count)];
+        Rect rect;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            rect.min[j] = (coord_t)(center->rect.min[j] - side / 2);
+            rect.max[j] = (coord_t)(center->rect.min[j] + side / 2);
+        }
+        double query_start = now_seconds();
+        search(tree->root, &rect, count_hit);
+        latencies[q] = now_seconds() - query_start;
+    }
+    fprintf(out, "    {\"dataset\": \"%s\", \"entries\": %d, \"insert_per_s\": %.0f, \"bulk_load_s\": %.6f, ",
+            dataset, count, count / insert_seconds, bulk_seconds);
+    write_percentiles(out, "range_us", latencies, queries);
+    fprintf(out, ", \"range_hits_per_query\": %.1f, ", (double)range_hits / queries);
+
+    QueryContext *ctx = create_query_context();
+    for (int q = 0; q < queries; q++) {
+        Entry *center = &entries[(int)(next_random() * count)];
+        coord_t point[RTREE_DIMS];
+        for (int j = 0; j < RTREE_DIMS; j++) point[j] = (coord_t)(center->rect.min[j] + (next_random() - 0.5) * side);
+        double query_start = now_seconds();
+        nearest_neighbor_ctx(ctx, tree, point);
+        latencies[q] = now_seconds() - query_start;
+    }
+    free_query_context(ctx);
+    write_percentiles(out, "nn_us", latencies, queries);
+
+    start = now_seconds();
+    save_tree(tree, path);
+    double save_seconds = now_seconds() - start;
+    free_tree(tree);
+    start = now_seconds();
+    RTree *loaded = load_tree(path);
+    double load_seconds = now_seconds() - start;
+    free_tree(loaded);
+
+    // Entries belong to the caller here, so they are counted apart from nodes
+    fprintf(out, ", \"node_bytes_per_entry\": {\"insert\": %.1f, \"bulk_load\": %.1f}, \"entry_bytes\": %d, "
+            "\"save_s\": %.6f, \"load_s\": %.6f, \"file_bytes_per_entry\": %.1f}",
+            (double)insert_bytes / count, (double)bulk_bytes / count, (int)sizeof(Entry),
+            save_seconds, load_seconds, (double)file_bytes(path) / count);
+    remove(path);
+    free(latencies);
+    free(pointers);
+    free(entries);
+}
+
+// Runs every dataset (or one) at 1K, 10K, ... entries up to max_count and
+// writes one JSON document for regression tracking
+// max_count: largest number of entries, run even if not a power of ten
+// queries: number of range and of nearest-neighbor queries per case
+// json_path: file to write the JSON document to
+// only: name of the single dataset to run, or NULL for all
+void run_suite(int max_count, int queries, const char *json_path, const char *only) {
+    const char *datasets[] = {"uniform", "gaussian", "zipf"};
+    int num_datasets = sizeof(datasets) / sizeof(datasets[0]);
+    bool known = only == NULL;
+    for (int d = 0; d < num_datasets; d++) {
+        if (only != NULL && strcmp(only, datasets[d]) == 0) known = true;
+    }
+    if (!known) {
+        printf("Unknown dataset %s (uniform, gaussian or zipf)\n", only);
+        return;
+    }
+    FILE *out = fopen(json_path, "w");
+    if (!out) {
+        printf("Error opening file %s for writing\n", json_path);
+        return;
+    }
+
+    fprintf(out, "{\n  \"config\": {\"fanout\": %d, \"dims\": %d, \"coord_bytes\": %d, \"kernel\": \"%s\", "
+            "\"node_bytes\": %d, \"queries\": %d},\n  \"results\": [\n",
+            MAX_ENTRIES, RTREE_DIMS, (int)sizeof(coord_t), node_scan_kernel_name(), (int)sizeof(RTreeNode), queries);
+    bool first = true;
+    for (int d = 0; d < num_datasets; d++) {
+        if (only != NULL && strcmp(only, datasets[d]) != 0) continue;
+        for (long size = 1000; ; size *= 10) {
+            int count = size < max_count ? (int)size : max_count;
+            printf("dataset=%s entries=%d\n", datasets[d], count);
+            if (!first) fprintf(out, ",\n");
+            first = false;
+            run_suite_case(out, datasets[d], count, queries);
+            fflush(out);
+            if (count == max_count) break;
+        }
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+    printf("Results written to %s\n", json_path);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "scale") == 0) {
+        run_scaling(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 100000, argc > 4 ? atoi(argv[4]) : 0);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "mixed") == 0) {
+        run_mixed(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 100000, argc > 4 ? atoi(argv[4]) : 2);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "load") == 0) {
+        run_load(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 0);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "store") == 0) {
+        run_store(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 100000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "suite") == 0) {
+        run_suite(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 10000,
+                  argc > 4 ? argv[4] : "bench_suite.json", argc > 5 ? argv[5] : NULL);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "move") == 0) {
+        run_moves(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 1000000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "join") == 0) {
+        run_join(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 100000, argc > 4 ? atoi(argv[4]) : 0);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "repack") == 0) {
+        run_repack(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 10000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "compact") == 0) {
+        run_compact(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 10000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "ingest") == 0) {
+        run_ingest(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 10000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "approx") == 0) {
+        run_approx(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 10000);
+        return 0;
+    }
+    if (argc > 1 && strcmp(argv[1], "cursor") == 0) {
+        run_cursor(argc > 2 ? atoi(argv[2]) : 1000000, argc > 3 ? atoi(argv[3]) : 10000);
+        return 0;
+    }
+    int count = argc > 1 ? atoi(argv[1]) : 1000000;
+    int queries = argc > 2 ? atoi(argv[2]) : 10000;
+
+    Entry *entries = make_uniform_entries(count);
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * count);
+    for (int i = 0; i < count; i++) pointers[i] = &entries[i];
+
+    // Build by repeated insertion
+    double start = now_seconds();
+    RTree *inserted = init_tree();
+    for (int i = 0; i < count; i++) insert(inserted, &entries[i]);
+    double insert_seconds = now_seconds() - start;
+    free_tree(inserted);
+
+    // Build by bulk loading
+    start = now_seconds();
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    double bulk_seconds = now_seconds() - start;
+
+    // Range queries covering about 0.01% of the world each, and points for
+    // nearest-neighbor queries
+    double side = WORLD_SIZE / 100.0;
+    Rect *rects = (Rect *)malloc(sizeof(Rect) * queries);
+    coord_t (*points)[RTREE_DIMS] = malloc(sizeof(coord_t[RTREE_DIMS]) * queries);
+    for (int q = 0; q < queries; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double lo = next_random() * (WORLD_SIZE - side);
+            rects[q].min[j] = (coord_t)lo;
+            rects[q].max[j] = (coord_t)(lo + side);
+            points[q][j] = (coord_t)(next_random() * WORLD_SIZE);
+        }
+    }
+
+    // One range query at a time
+    start = now_seconds();
+    for (int q = 0; q < queries; q++) search(tree->root, &rects[q], count_hit);
+    double range_seconds = now_seconds() - start;
+
+    // All range queries as one batch
+    long loop_hits = range_hits;
+    range_hits = 0;
+    start = now_seconds();
+    search_batch(tree, rects, queries, count_batch_hit);
+    double range_batch_seconds = now_seconds() - start;
+    if (range_hits != loop_hits) fprintf(stderr, "batch search found %ld hits, expected %ld\n", range_hits, loop_hits);
+
+    // Nearest-neighbor queries one at a time, reusing one query context
+    QueryContext *ctx = create_query_context();
+    start = now_seconds();
+    for (int q = 0; q < queries; q++) nearest_neighbor_ctx(ctx, tree, points[q]);
+    double nn_seconds = now_seconds() - start;
+#if RTREE_STATS_ENABLED
+    printf("nn per query: nodes_visited=%.1f entries_tested=%.1f subtrees_pruned=%.1f max_queue_size=%ld\n",
+           (double)ctx->stats.nodes_visited / queries, (double)ctx->stats.entries_tested / queries,
+           (double)ctx->stats.subtrees_pruned / queries, ctx->stats.max_queue_size);
+#endif
+    free_query_context(ctx);
+
+    // All nearest-neighbor queries as one batch
+    Entry **nearest = (Entry **)malloc(sizeof(Entry *) * queries);
+    start = now_seconds();
+    nearest_neighbor_batch(tree, points, queries, nearest);
+    double nn_batch_seconds = now_seconds() - start;
+
+    printf("fanout=%d dims=%d coord_bytes=%d kernel=%s entries=%d node_bytes=%d leaf_bytes=%d "
+           "insert_s=%.3f bulk_load_s=%.3f range_us=%.2f range_batch_us=%.2f nn_us=%.2f nn_batch_us=%.2f hits=%ld\n",
+           MAX_ENTRIES, RTREE_DIMS, (int)sizeof(coord_t), node_scan_kernel_name(), count, (int)sizeof(RTreeNode), (int)LEAF_NODE_SIZE,
+           insert_seconds, bulk_seconds, range_seconds * 1e6 / queries, range_batch_seconds * 1e6 / queries,
+           nn_seconds * 1e6 / queries, nn_batch_seconds * 1e6 / queries, range_hits);
+
+    free_tree(tree);
+    free(nearest);
+    free(points);
+    free(rects);
+    free(pointers);
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,674 @@
+#include "compact_tree.h"
+#include "paged_file.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Entries written or read per call when saving and loading compact files
+#define COMPACT_FILE_CHUNK 4096
+// Units in the last place by which coded boxes are widened beyond rounding
+#define COMPACT_SLACK 64
+
+// Function declarations
+double decode_code(double lo, double hi, int levels, int code);
+int code_floor(double lo, double hi, int levels, double x);
+int code_ceil(double lo, double hi, int levels, double x);
+int load_code(CompactTree *ct, void *codes, size_t index);
+void store_code(CompactTree *ct, void *codes, size_t index, int code);
+void encode_box(CompactTree *ct, void *codes, uint32_t item, double *lo, double *hi, Rect *rect, double *item_lo, double *item_hi);
+void grid_steps(CompactTree *ct, double *lo, double *hi, double *step);
+void decode_box(CompactTree *ct, void *codes, uint32_t item, double *lo, double *hi, double *step, double *item_lo, double *item_hi);
+Entry* compact_entry(CompactTree *ct, uint32_t i);
+void count_compact_nodes(RTreeNode *node, uint32_t *nodes, uint64_t *entries);
+CompactTree* alloc_compact_tree(int bits, uint32_t node_count, uint32_t entry_count);
+int coded_overlaps(CompactTree *ct, void *codes, uint32_t first, int count, int *query_lo, int *query_hi, int *hits);
+bool coded_inside(CompactTree *ct, uint32_t entry, int *query_lo, int *query_hi);
+void compact_search_node(CompactTree *ct, uint32_t n, double *lo, double *hi, Rect *rect, void (*callback)(Entry *));
+double box_distance2(double *lo, double *hi, coord_t point[RTREE_DIMS]);
+void coded_distances(CompactTree *ct, void *codes, uint32_t first, int count, double *lo, double *hi, double *step, coord_t point[RTREE_DIMS], double *distances);
+void compact_nearest_node(CompactTree *ct, uint32_t n, double *lo, double *hi, coord_t point[RTREE_DIMS], Entry **nearest, double *nearest_distance);
+bool write_section(FILE *file, const void *data, size_t size);
+bool read_section(FILE *file, void *data, size_t size, uint32_t checksum);
+
+// Decodes a grid code into a coordinate; the largest code decodes to hi exactly
+// lo: lower end of the grid
+// hi: upper end of the grid
+// levels: largest code
+// code: code to decode
+// Returns the coordinate of the grid line
+double decode_code(double lo, double hi, int levels, int code) {
+    if (code >= levels) return hi;
+    return lo + code * ((hi - lo) / levels);
+}
+
+// Rounds a coordinate down to the grid. The estimate is corrected against
+// decode_code, so rounding in the division can never make a box shrink.
+// lo: lower end of the grid
+// hi: upper end of the grid
+// levels: largest code
+// x: coordinate
+// Returns the largest code that decodes to at most x, or -1 if x < lo
+int code_floor(double lo, double hi, int levels, double x) {
+    if (x >= hi) return levels;
+    if (x < lo) return -1;
+    int code = (int)floor((x - lo) / (hi - lo) * levels);
+    if (code < 0) code = 0;
+    if (code > levels) code = levels;
+    while (code < levels && decode_code(lo, hi, levels, code + 1) <= x) code++;
+    while (code > 0 && decode_code(lo, hi, levels, code) > x) code--;
+    return code;
+}
+
+// Rounds a coordinate up to the grid
+// lo: lower end of the grid
+// hi: upper end of the grid
+// levels: largest code
+// x: coordinate
+// Returns the smallest code that decodes to at least x, or levels + 1 if x > hi
+int code_ceil(double lo, double hi, int levels, double x) {
+    if (x <= lo) return 0;
+    if (x > hi) return levels + 1;
+    int code = (int)ceil((x - lo) / (hi - lo) * levels);
+    if (code < 0) code = 0;
+    if (code > levels) code = levels;
+    while (code > 0 && decode_code(lo, hi, levels, code - 1) >= x) code--;
+    while (code < levels && decode_code(lo, hi, levels, code) < x) code++;
+    return code;
+}
+
+// Reads one code of a code array
+// ct: pointer to the compact tree, which gives the code width
+// codes: node or entry codes
+// index: index of the code
+// Returns the code
+int load_code(CompactTree *ct, void *codes, size_t index) {
+    return ct->bits == 8 ? ((uint8_t *)codes)[index] : ((uint16_t *)codes)[index];
+}
+
+// Writes one code of a code array
+// ct: pointer to the compact tree, which gives the code width
+// codes: node or entry codes
+// index: index of the code
+// code: code to store
+void store_code(CompactTree *ct, void *codes, size_t index, int code) {
+    if (ct->bits == 8) ((uint8_t *)codes)[index] = (uint8_t)code;
+    else ((uint16_t *)codes)[index] = (uint16_t)code;
+}
+
+// Codes a rectangle on the grid of its parent's box, rounding outwards
+// ct: pointer to the compact tree
+// codes: node or entry codes
+// item: index of the node or entry
+// lo, hi: box of the parent
+// rect: rectangle to code; must lie inside the parent's box
+// item_lo, item_hi: receive the decoded box, or NULL
+void encode_box(CompactTree *ct, void *codes, uint32_t item, double *lo, double *hi, Rect *rect, double *item_lo, double *item_hi) {
+    int levels = COMPACT_LEVELS(ct->bits);
+    size_t base = (size_t)item * 2 * RTREE_DIMS;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        // Round a little further out than needed: the compiler may fuse the
+        // multiply and add of one decoding and not another, and the few units
+        // in the last place that can change must not make a box shrink
+        double slack = COMPACT_SLACK * DBL_EPSILON * (fabs(lo[j]) + fabs(hi[j]));
+        int code_lo = code_floor(lo[j], hi[j], levels, (double)rect->min[j] - slack);
+        int code_hi = code_ceil(lo[j], hi[j], levels, (double)rect->max[j] + slack);
+        if (code_lo < 0) code_lo = 0;
+        if (code_hi > levels) code_hi = levels;
+        store_code(ct, codes, base + j, code_lo);
+        store_code(ct, codes, base + RTREE_DIMS + j, code_hi);
+        if (item_lo) {
+            item_lo[j] = decode_code(lo[j], hi[j], levels, code_lo);
+            item_hi[j] = decode_code(lo[j], hi[j], levels, code_hi);
+        }
+    }
+}
+
+// Works out the grid step of each dimension of a box, as decode_code does
+// ct: pointer to the compact tree
+// lo, hi: the box
+// step: receives the steps
+void grid_steps(CompactTree *ct, double *lo, double *hi, double *step) {
+    for (int j = 0; j < RTREE_DIMS; j++) step[j] = (hi[j] - lo[j]) / COMPACT_LEVELS(ct->bits);
+}
+
+// Decodes the box of a node or entry from the grid of its parent's box
+// ct: pointer to the compact tree
+// codes: node or entry codes
+// item: index of the node or entry
+// lo, hi: box of the parent
+// step: grid steps of the parent's box, from grid_steps
+// item_lo, item_hi: receive the decoded box
+void decode_box(CompactTree *ct, void *codes, uint32_t item, double *lo, double *hi, double *step, double *item_lo, double *item_hi) {
+    int levels = COMPACT_LEVELS(ct->bits);
+    size_t base = (size_t)item * 2 * RTREE_DIMS;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        int code_lo = load_code(ct, codes, base + j);
+        int code_hi = load_code(ct, codes, base + RTREE_DIMS + j);
+        item_lo[j] = code_lo >= levels ? hi[j] : lo[j] + code_lo * step[j];
+        item_hi[j] = code_hi >= levels ? hi[j] : lo[j] + code_hi * step[j];
+    }
+}
+
+// Returns entry i of a compact tree in leaf order
+Entry* compact_entry(CompactTree *ct, uint32_t i) {
+    return ct->owned ? &ct->owned[i] : ct->entries[i];
+}
+
+// Counts the nodes and entries of a subtree
+// node: root of the subtree
+// nodes: incremented by the number of nodes
+// entries: incremented by the number of entries
+void count_compact_nodes(RTreeNode *node, uint32_t *nodes, uint64_t *entries) {
+    (*nodes)++;
+    if (node->is_leaf) {
+        *entries += node->num_entries;
+        return;
+    }
+    for (int i = 0; i < node->num_entries; i++) count_compact_nodes(node->child[i].node, nodes, entries);
+}
+
+// Allocates an empty compact tree with room for the given nodes and entries
+// bits: width of the codes
+// node_count: number of nodes
+// entry_count: number of entries
+// Returns a pointer to the compact tree; entries and owned are left NULL
+CompactTree* alloc_compact_tree(int bits, uint32_t node_count, uint32_t entry_count) {
+    CompactTree *ct = (CompactTree *)calloc(1, sizeof(CompactTree));
+    size_t code_size = (size_t)bits / 8 * 2 * RTREE_DIMS;
+    ct->bits = bits;
+    ct->node_count = node_count;
+    ct->entry_count = entry_count;
+    ct->nodes = (CompactNode *)malloc(sizeof(CompactNode) * node_count);
+    ct->node_codes = calloc(node_count, code_size);
+    // Keep the allocation non-empty for an empty tree
+    ct->entry_codes = calloc(entry_count > 0 ? entry_count : 1, code_size);
+    return ct;
+}
+
+// Copies a tree into the compact encoding. The copy references the tree's
+// entries, which must stay alive and unchanged while it is used; the tree
+// itself may be freed unless it owns its entries, as loaded trees do.
+// tree: pointer to the R-tree
+// bits: width of the codes, 8 or 16; 8 bits take half the memory but decode
+//       to looser boxes, so queries test more entries
+// Returns a pointer to the compact tree, or NULL on failure
+CompactTree* compact_tree(RTree *tree, int bits) {
+    if (bits != 8 && bits != 16) {
+        fprintf(stderr, "Compact trees use 8- or 16-bit codes, not %d\n", bits);
+        return NULL;
+    }
+    uint32_t node_count = 0;
+    uint64_t entry_count = 0;
+    count_compact_nodes(tree->root, &node_count, &entry_count);
+    if (entry_count > UINT32_MAX) {
+        fprintf(stderr, "Tree is too large for a compact tree\n");
+        return NULL;
+    }
+    CompactTree *ct = alloc_compact_tree(bits, node_count, (uint32_t)entry_count);
+    ct->entries = (Entry **)malloc(sizeof(Entry *) * (entry_count > 0 ? entry_count : 1));
+
+    // Breadth-first copy: the children of node n are appended as n is coded,
+    // so they end up consecutive, and each carries its decoded box down
+    RTreeNode **source = (RTreeNode **)malloc(sizeof(RTreeNode *) * node_count);
+    double (*boxes)[2][RTREE_DIMS] = malloc(sizeof(double[2][RTREE_DIMS]) * node_count);
+    RTreeNode *root = tree->root;
+    coord_t (*root_max)[MAX_ENTRIES + 1] = NODE_MAX_ARRAYS(root);
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        boxes[0][0][j] = root->num_entries > 0 ? (double)COORD_MAX : 0;
+        boxes[0][1][j] = root->num_entries > 0 ? -(double)COORD_MAX : 0;
+        for (int i = 0; i < root->num_entries; i++) {
+            if (root->min[j][i] < boxes[0][0][j]) boxes[0][0][j] = root->min[j][i];
+            if (root_max[j][i] > boxes[0][1][j]) boxes[0][1][j] = root_max[j][i];
+        }
+        // Give the root the same slack around its entries that coded boxes get
+        double slack = COMPACT_SLACK * DBL_EPSILON * (fabs(boxes[0][0][j]) + fabs(boxes[0][1][j]));
+        boxes[0][0][j] -= slack;
+        boxes[0][1][j] += slack;
+        ct->root_min[j] = boxes[0][0][j];
+        ct->root_max[j] = boxes[0][1][j];
+    }
+    source[0] = root;
+    uint32_t next_node = 1, next_entry = 0;
+    for (uint32_t n = 0; n < node_count; n++) {
+        RTreeNode *node = source[n];
+        CompactNode *cn = &ct->nodes[n];
+        cn->num_entries = (uint16_t)node->num_entries;
+        cn->is_leaf = node->is_leaf;
+        cn->first = node->is_leaf ? next_entry : next_node;
+        coord_t (*max)[MAX_ENTRIES + 1] = NODE_MAX_ARRAYS(node);
+        for (int i = 0; i < node->num_entries; i++) {
+            Rect rect;
+            for (int j = 0; j < RTREE_DIMS; j++) {
+                rect.min[j] = node->min[j][i];
+                rect.max[j] = max[j][i];
+            }
+            if (node->is_leaf) {
+                encode_box(ct, ct->entry_codes, next_entry, boxes[n][0], boxes[n][1], &rect, NULL, NULL);
+                ct->entries[next_entry++] = node->child[i].entry;
+            } else {
+                encode_box(ct, ct->node_codes, next_node, boxes[n][0], boxes[n][1], &rect, boxes[next_node][0], boxes[next_node][1]);
+                source[next_node++] = node->child[i].node;
+            }
+        }
+    }
+    ct->height = 0;
+    for (RTreeNode *node = root; !node->is_leaf; node = node->child[0].node) ct->height++;
+    free(source);
+    free(boxes);
+    return ct;
+}
+
+// Frees a compact tree; entries the caller owns are left alone
+// ct: pointer to the compact tree
+void free_compact_tree(CompactTree *ct) {
+    free(ct->nodes);
+    free(ct->node_codes);
+    free(ct->entry_codes);
+    free(ct->entries);
+    free(ct->owned);
+    free(ct);
+}
+
+// Returns the bytes a compact tree allocated, including entries it owns
+size_t compact_tree_bytes(CompactTree *ct) {
+    size_t code_size = (size_t)ct->bits / 8 * 2 * RTREE_DIMS;
+    size_t bytes = sizeof(CompactTree);
+    bytes += (sizeof(CompactNode) + code_size) * ct->node_count;
+    bytes += code_size * ct->entry_count;
+    if (ct->entries) bytes += sizeof(Entry *) * ct->entry_count;
+    if (ct->owned) bytes += sizeof(Entry) * ct->entry_count;
+    return bytes;
+}
+
+// Finds the children of a node whose coded boxes overlap a query given in
+// codes of the node's grid, comparing codes without decoding them
+// ct: pointer to the compact tree
+// codes: node or entry codes of the children
+// first: index of the first child
+// count: number of children
+// query_lo: per dimension, the smallest code at or above the query's lower corner
+// query_hi: per dimension, the largest code at or below the query's upper corner
+// hits: receives the positions of the overlapping children
+// Returns the number of overlapping children
+int coded_overlaps(CompactTree *ct, void *codes, uint32_t first, int count, int *query_lo, int *query_hi, int *hits) {
+    int num_hits = 0;
+    if (ct->bits == 8) {
+        uint8_t *box = (uint8_t *)codes + (size_t)first * 2 * RTREE_DIMS;
+        for (int i = 0; i < count; i++, box += 2 * RTREE_DIMS) {
+            bool hit = true;
+            for (int j = 0; j < RTREE_DIMS; j++) {
+                if (box[RTREE_DIMS + j] < query_lo[j] || box[j] > query_hi[j]) hit = false;
+            }
+            if (hit) hits[num_hits++] = i;
+        }
+    } else {
+        uint16_t *box = (uint16_t *)codes + (size_t)first * 2 * RTREE_DIMS;
+        for (int i = 0; i < count; i++, box += 2 * RTREE_DIMS) {
+            bool hit = true;
+            for (int j = 0; j < RTREE_DIMS; j++) {
+                if (box[RTREE_DIMS + j] < query_lo[j] || box[j] > query_hi[j]) hit = false;
+            }
+            if (hit) hits[num_hits++] = i;
+        }
+    }
+    return num_hits;
+}
+
+// Checks if the coded box of an entry lies inside a query given in codes of
+// its leaf's grid, which means the entry's exact rectangle does too
+// ct: pointer to the compact tree
+// entry: index of the entry
+// query_lo, query_hi: the query, as for coded_overlaps
+// Returns true if the coded box is inside the query
+bool coded_inside(CompactTree *ct, uint32_t entry, int *query_lo, int *query_hi) {
+    size_t base = (size_t)entry * 2 * RTREE_DIMS;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        if (load_code(ct, ct->entry_codes, base + j) < query_lo[j]) return false;
+        if (load_code(ct, ct->entry_codes, base + RTREE_DIMS + j) > query_hi[j]) return false;
+    }
+    return true;
+}
+
+// Searches the subtree of a compact node for entries overlapping a rectangle
+// ct: pointer to the compact tree
+// n: index of the node
+// lo, hi: decoded box of the node
+// rect: pointer to the rectangle to search for
+// callback: function to call with each overlapping entry
+void compact_search_node(CompactTree *ct, uint32_t n, double *lo, double *hi, Rect *rect, void (*callback)(Entry *)) {
+    CompactNode *node = &ct->nodes[n];
+    int levels = COMPACT_LEVELS(ct->bits);
+    // Round the query outwards onto the node's grid once, so the children
+    // are compared code against code
+    int query_lo[RTREE_DIMS], query_hi[RTREE_DIMS];
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        query_lo[j] = code_ceil(lo[j], hi[j], levels, (double)rect->min[j]);
+        query_hi[j] = code_floor(lo[j], hi[j], levels, (double)rect->max[j]);
+    }
+    int hits[MAX_ENTRIES + 1];
+    void *codes = node->is_leaf ? ct->entry_codes : ct->node_codes;
+    double step[RTREE_DIMS];
+    grid_steps(ct, lo, hi, step);
+    int num_hits = coded_overlaps(ct, codes, node->first, node->num_entries, query_lo, query_hi, hits);
+    for (int h = 0; h < num_hits; h++) {
+        uint32_t child = node->first + hits[h];
+        if (node->is_leaf) {
+            // Coded boxes only narrow the candidates; an entry whose coded box
+            // lies inside the query overlaps it for certain, any other is
+            // tested against its exact rectangle
+            Entry *entry = compact_entry(ct, child);
+            bool hit = true;
+            if (!coded_inside(ct, child, query_lo, query_hi)) {
+                for (int j = 0; j < RTREE_DIMS; j++) {
+                    if (entry->rect.max[j] < rect->min[j] || entry->rect.min[j] > rect->max[j]) hit = false;
+                }
+            }
+            if (hit) callback(entry);
+        } else {
+            double child_lo[RTREE_DIMS], child_hi[RTREE_DIMS];
+            decode_box(ct, ct->node_codes, child, lo, hi, step, child_lo, child_hi);
+            compact_search_node(ct, child, child_lo, child_hi, rect, callback);
+        }
+    }
+}
+
+// Searches a compact tree for entries overlapping a rectangle; reports the
+// same entries as search on the tree it was made from
+// ct: pointer to the compact tree
+// rect: pointer to the rectangle to search for
+// callback: function to call with each overlapping entry
+void compact_search(CompactTree *ct, Rect *rect, void (*callback)(Entry *)) {
+    if (ct->nodes[0].num_entries == 0) return;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        if (rect->max[j] < ct->root_min[j] || rect->min[j] > ct->root_max[j]) return;
+    }
+    compact_search_node(ct, 0, ct->root_min, ct->root_max, rect, callback);
+}
+
+// Computes the squared distance from a point to a decoded box
+// lo, hi: corners of the box
+// point: the point
+// Returns the squared distance, 0 if the point is inside
+double box_distance2(double *lo, double *hi, coord_t point[RTREE_DIMS]) {
+    double distance = 0;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        double d = 0;
+        if (point[j] < lo[j]) d = lo[j] - point[j];
+        else if (point[j] > hi[j]) d = point[j] - hi[j];
+        distance += d * d;
+    }
+    return distance;
+}
+
+// Computes a lower bound on the squared distance from a point to the coded
+// box of each child of a node. The point is moved onto the node's grid once,
+// so the boxes are measured in grid steps without decoding them; the slack
+// that coded boxes have around the exact ones absorbs the rounding.
+// ct: pointer to the compact tree
+// codes: node or entry codes of the children
+// first: index of the first child
+// count: number of children
+// lo, hi: decoded box of the node
+// step: grid steps of the node's box, from grid_steps
+// point: query point
+// distances: receives the bound for each child
+void coded_distances(CompactTree *ct, void *codes, uint32_t first, int count, double *lo, double *hi, double *step, coord_t point[RTREE_DIMS], double *distances) {
+    double grid_point[RTREE_DIMS], step2[RTREE_DIMS];
+    // A dimension whose box is flat has no grid; every child lies on it
+    double flat = 0;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        grid_point[j] = step[j] > 0 ? (point[j] - lo[j]) / step[j] : 0;
+        step2[j] = step[j] * step[j];
+        if (step[j] == 0) {
+            double d = point[j] < lo[j] ? lo[j] - point[j] : (point[j] > hi[j] ? point[j] - hi[j] : 0);
+            flat += d * d;
+        }
+    }
+    // Widen the codes of the children to doubles first, one loop per code width
+    double boxes[MAX_ENTRIES + 1][2 * RTREE_DIMS];
+    if (ct->bits == 8) {
+        uint8_t *box = (uint8_t *)codes + (size_t)first * 2 * RTREE_DIMS;
+        for (int i = 0; i < count; i++) {
+            for (int k = 0; k < 2 * RTREE_DIMS; k++) boxes[i][k] = box[i * 2 * RTREE_DIMS + k];
+        }
+    } else {
+        uint16_t *box = (uint16_t *)codes + (size_t)first * 2 * RTREE_DIMS;
+        for (int i = 0; i < count; i++) {
+            for (int k = 0; k < 2 * RTREE_DIMS; k++) boxes[i][k] = box[i * 2 * RTREE_DIMS + k];
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        double distance = flat;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double below = boxes[i][j] - grid_point[j];
+            double above = grid_point[j] - boxes[i][RTREE_DIMS + j];
+            double gap = below > 0 ? below : (above > 0 ? above : 0);
+            distance += gap * gap * step2[j];
+        }
+        distances[i] = distance;
+    }
+}
+
+// Searches the subtree of a compact node for an entry nearer than the best so
+// far, visiting children nearest first and skipping those that can't be nearer
+// ct: pointer to the compact tree
+// n: index of the node
+// lo, hi: decoded box of the node
+// point: query point
+// nearest: nearest entry so far; updated
+// nearest_distance: its squared distance; updated
+void compact_nearest_node(CompactTree *ct, uint32_t n, double *lo, double *hi, coord_t point[RTREE_DIMS], Entry **nearest, double *nearest_distance) {
+    CompactNode *node = &ct->nodes[n];
+    double step[RTREE_DIMS];
+    grid_steps(ct, lo, hi, step);
+    double distances[MAX_ENTRIES + 1];
+    coded_distances(ct, node->is_leaf ? ct->entry_codes : ct->node_codes, node->first, node->num_entries, lo, hi, step, point, distances);
+    if (node->is_leaf) {
+        // Read an entry's exact rectangle only when its coded box is nearer
+        // than the best so far
+        for (int i = 0; i < node->num_entries; i++) {
+            if (distances[i] >= *nearest_distance) continue;
+            Entry *entry = compact_entry(ct, node->first + i);
+            double exact_lo[RTREE_DIMS], exact_hi[RTREE_DIMS];
+            for (int j = 0; j < RTREE_DIMS; j++) {
+                exact_lo[j] = entry->rect.min[j];
+                exact_hi[j] = entry->rect.max[j];
+            }
+            double distance = box_distance2(exact_lo, exact_hi, point);
+            if (distance < *nearest_distance) {
+                *nearest = entry;
+                *nearest_distance = distance;
+            }
+        }
+        return;
+    }
+    // Sort the children by distance (insertion sort; nodes are small)
+    int order[MAX_ENTRIES + 1];
+    for (int i = 0; i < node->num_entries; i++) {
+        int k = i;
+        while (k > 0 && distances[order[k - 1]] > distances[i]) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+    for (int k = 0; k < node->num_entries; k++) {
+        int i = order[k];
+        // The rest are farther still
+        if (distances[i] >= *nearest_distance) break;
+        double child_lo[RTREE_DIMS], child_hi[RTREE_DIMS];
+        decode_box(ct, ct->node_codes, node->first + i, lo, hi, step, child_lo, child_hi);
+        compact_nearest_node(ct, node->first + i, child_lo, child_hi, point, nearest, nearest_distance);
+    }
+}
+
+// Finds the entry nearest to a point in a compact tree
+// ct: pointer to the compact tree
+// point: query point
+// Returns a pointer to the nearest entry, or NULL if the tree is empty
+Entry* compact_nearest_neighbor(CompactTree *ct, coord_t point[RTREE_DIMS]) {
+    Entry *nearest = NULL;
+    double nearest_distance = INFINITY;
+    compact_nearest_node(ct, 0, ct->root_min, ct->root_max, point, &nearest, &nearest_distance);
+    return nearest;
+}
+
+// Writes one section of a compact file
+// Returns true if it was written completely
+bool write_section(FILE *file, const void *data, size_t size) {
+    return size == 0 || fwrite(data, size, 1, file) == 1;
+}
+
+// Reads one section of a compact file and checks its checksum
+// Returns true if it was read completely and is intact
+bool read_section(FILE *file, void *data, size_t size, uint32_t checksum) {
+    if (size > 0 && fread(data, size, 1, file) != 1) return false;
+    return paged_checksum(data, size) == checksum;
+}
+
+// Saves a compact tree to a file; entry data pointers are stored as values,
+// as save_tree does
+// ct: pointer to the compact tree
+// filename: name of the file to write
+// Returns true if the file was written
+bool save_compact_tree(CompactTree *ct, const char *filename) {
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        fprintf(stderr, "Failed to open file %s for writing\n", filename);
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    size_t code_size = (size_t)ct->bits / 8 * 2 * RTREE_DIMS;
+
+    // The entries section is written in chunks; its checksum covers the
+    // chunk checksums, so it needs no second pass
+    CompactFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = COMPACT_FILE_MAGIC;
+    header.version = COMPACT_FILE_VERSION;
+    header.endian_tag = PAGED_FILE_ENDIAN_TAG;
+    header.dims = RTREE_DIMS;
+    header.coord_size = sizeof(coord_t);
+    header.coord_kind = PAGED_COORD_KIND;
+    header.bits = (uint32_t)ct->bits;
+    header.height = (uint32_t)ct->height;
+    header.node_count = ct->node_count;
+    header.entry_count = ct->entry_count;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        header.root_min[j] = ct->root_min[j];
+        header.root_max[j] = ct->root_max[j];
+    }
+    header.section_checksums[0] = paged_checksum(ct->nodes, sizeof(CompactNode) * ct->node_count);
+    header.section_checksums[1] = paged_checksum(ct->node_codes, code_size * ct->node_count);
+    header.section_checksums[2] = paged_checksum(ct->entry_codes, code_size * ct->entry_count);
+
+    // Reserve the header, then write the sections
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    written = written && write_section(file, ct->nodes, sizeof(CompactNode) * ct->node_count);
+    written = written && write_section(file, ct->node_codes, code_size * ct->node_count);
+    written = written && write_section(file, ct->entry_codes, code_size * ct->entry_count);
+    CompactFileEntry *chunk = (CompactFileEntry *)calloc(COMPACT_FILE_CHUNK, sizeof(CompactFileEntry));
+    uint32_t *chunk_checksums = (uint32_t *)malloc(sizeof(uint32_t) * (ct->entry_count / COMPACT_FILE_CHUNK + 1));
+    int num_chunks = 0;
+    for (uint32_t start = 0; start < ct->entry_count && written; start += COMPACT_FILE_CHUNK) {
+        uint32_t count = ct->entry_count - start < COMPACT_FILE_CHUNK ? ct->entry_count - start : COMPACT_FILE_CHUNK;
+        for (uint32_t i = 0; i < count; i++) {
+            Entry *entry = compact_entry(ct, start + i);
+            chunk[i].rect = entry->rect;
+            chunk[i].data = (uint64_t)(uintptr_t)entry->data;
+        }
+        chunk_checksums[num_chunks++] = paged_checksum(chunk, sizeof(CompactFileEntry) * count);
+        written = write_section(file, chunk, sizeof(CompactFileEntry) * count);
+    }
+    header.section_checksums[3] = paged_checksum(chunk_checksums, sizeof(uint32_t) * num_chunks);
+    free(chunk_checksums);
+    free(chunk);
+
+    // Fill in the header now that every checksum is known
+    header.header_checksum = paged_checksum(&header, sizeof(header));
+    written = written && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+    if (fclose(file) != 0 || !written) {
+        fprintf(stderr, "Failed to write file %s\n", filename);
+        return false;
+    }
+    fprintf(stderr, "Compact tree saved successfully to %s\n", filename);
+    return true;
+}
+
+// Loads a compact tree saved by save_compact_tree. The loaded tree owns its
+// entries, whose data pointers hold the values that were saved.
+// filename: name of the file to read
+// Returns a pointer to the compact tree, or NULL if the file is missing,
+// written with other settings or damaged
+CompactTree* load_compact_tree(const char *filename) {
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open file %s for reading\n", filename);
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    CompactFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != COMPACT_FILE_MAGIC) {
+        fprintf(stderr, "Not a compact R-tree file\n");
+        fclose(file);
+        return NULL;
+    }
+    uint32_t stored = header.header_checksum;
+    header.header_checksum = 0;
+    if (paged_checksum(&header, sizeof(header)) != stored || header.version != COMPACT_FILE_VERSION ||
+        header.endian_tag != PAGED_FILE_ENDIAN_TAG || (header.bits != 8 && header.bits != 16) || header.node_count == 0) {
+        fprintf(stderr, "Compact tree file %s is damaged or from an unsupported version\n", filename);
+        fclose(file);
+        return NULL;
+    }
+    if (header.dims != RTREE_DIMS || header.coord_size != sizeof(coord_t) || header.coord_kind != PAGED_COORD_KIND) {
+        fprintf(stderr, "Compact tree file %s was written with different dimensions or coordinates\n", filename);
+        fclose(file);
+        return NULL;
+    }
+
+    CompactTree *ct = alloc_compact_tree((int)header.bits, header.node_count, header.entry_count);
+    ct->height = (int)header.height;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        ct->root_min[j] = header.root_min[j];
+        ct->root_max[j] = header.root_max[j];
+    }
+    size_t code_size = (size_t)ct->bits / 8 * 2 * RTREE_DIMS;
+    bool intact = read_section(file, ct->nodes, sizeof(CompactNode) * ct->node_count, header.section_checksums[0]);
+    intact = intact && read_section(file, ct->node_codes, code_size * ct->node_count, header.section_checksums[1]);
+    intact = intact && read_section(file, ct->entry_codes, code_size * ct->entry_count, header.section_checksums[2]);
+    ct->owned = (Entry *)malloc(sizeof(Entry) * (ct->entry_count > 0 ? ct->entry_count : 1));
+    CompactFileEntry *chunk = (CompactFileEntry *)malloc(sizeof(CompactFileEntry) * COMPACT_FILE_CHUNK);
+    uint32_t *chunk_checksums = (uint32_t *)malloc(sizeof(uint32_t) * (ct->entry_count / COMPACT_FILE_CHUNK + 1));
+    int num_chunks = 0;
+    for (uint32_t start = 0; start < ct->entry_count && intact; start += COMPACT_FILE_CHUNK) {
+        uint32_t count = ct->entry_count - start < COMPACT_FILE_CHUNK ? ct->entry_count - start : COMPACT_FILE_CHUNK;
+        intact = fread(chunk, sizeof(CompactFileEntry) * count, 1, file) == 1;
+        if (!intact) break;
+        chunk_checksums[num_chunks++] = paged_checksum(chunk, sizeof(CompactFileEntry) * count);
+        for (uint32_t i = 0; i < count; i++) {
+            ct->owned[start + i].rect = chunk[i].rect;
+            ct->owned[start + i].data = (void *)(uintptr_t)chunk[i].data;
+        }
+    }
+    intact = intact && paged_checksum(chunk_checksums, sizeof(uint32_t) * num_chunks) == header.section_checksums[3];
+    free(chunk_checksums);
+    free(chunk);
+    fclose(file);
+
+    // Child indices must stay inside the arrays, or queries would read past them
+    for (uint32_t n = 0; n < ct->node_count && intact; n++) {
+        CompactNode *node = &ct->nodes[n];
+        uint64_t end = (uint64_t)node->first + node->num_entries;
+        if (node->num_entries > MAX_ENTRIES || end > (node->is_leaf ? ct->entry_count : ct->node_count)) intact = false;
+        if (!node->is_leaf && node->first <= n) intact = false;
+    }
+    if (!intact) {
+        fprintf(stderr, "Compact tree file %s is damaged\n", filename);
+        free_compact_tree(ct);
+        return NULL;
+    }
+    fprintf(stderr, "Compact tree loaded successfully from %s\n", filename);
+    return ct;
+}
@@ -0,0 +1,114 @@
+#ifndef COMPACT_TREE_H
+#define COMPACT_TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "rtree.h"
+
+// A read-only copy of a tree in a compact encoding, for trees too large to
+// keep in memory as RTreeNodes. Nodes are stored breadth first, so the
+// children of a node are consecutive and one index replaces the child
+// pointers. The box of every child is stored as 8- or 16-bit codes that
+// place its corners on a grid spanning the box of its parent:
+//
+//   corner = parent_min + (parent_max - parent_min) * code / COMPACT_LEVELS(bits)
+//
+// Lower corners are rounded down and upper corners up, with a little slack
+// beyond that, so a decoded box always covers the real one and queries never
+// miss an entry; leaf entries that pass the coded boxes are then tested
+// against their exact rectangles.
+// Build a new copy with compact_tree after the tree changes. Queries only
+// read the copy, so any number of threads may run them at once.
+//
+// Saved files hold a header followed by the nodes, the node codes, the entry
+// codes and the entries (exact rectangle and data value), each section with
+// its own checksum.
+
+// Define the largest code of a given width
+#define COMPACT_LEVELS(bits) ((1 << (bits)) - 1)
+
+// Identifies a compact tree file ("RTRECOMP" read as a little-endian integer)
+#define COMPACT_FILE_MAGIC 0x504D4F4345525452ull
+// Format version written by this code
+#define COMPACT_FILE_VERSION 1
+
+// Define a node of a compact tree
+typedef struct CompactNode {
+    // Index of the first child in the nodes (internal nodes) or in the entries (leaves)
+    uint32_t first;
+    // Number of children
+    uint16_t num_entries;
+    // Nonzero for leaves
+    uint16_t is_leaf;
+} CompactNode;
+
+// Define a tree in the compact encoding
+typedef struct CompactTree {
+    // Width of the codes: 8 or 16 bits
+    int bits;
+    // Height of the tree (0 when the root is a leaf)
+    int height;
+    // Box of the root node, the grid its children are coded on
+    double root_min[RTREE_DIMS];
+    double root_max[RTREE_DIMS];
+    // Nodes in breadth-first order; the root is node 0
+    CompactNode *nodes;
+    uint32_t node_count;
+    // Box of node i within its parent's box: lower codes of each dimension,
+    // then upper codes, at 2 * RTREE_DIMS * i (unused for the root)
+    void *node_codes;
+    // Box of entry i within its leaf's box, laid out like node_codes
+    void *entry_codes;
+    // Caller's entries in leaf order, for a copy made from a tree
+    Entry **entries;
+    // Entries read from a file, owned by the compact tree
+    Entry *owned;
+    uint32_t entry_count;
+} CompactTree;
+
+// Define the header of a compact tree file
+typedef struct CompactFileHeader {
+    // COMPACT_FILE_MAGIC
+    uint64_t magic;
+    // COMPACT_FILE_VERSION
+    uint32_t version;
+    // PAGED_FILE_ENDIAN_TAG as written by the saving host
+    uint32_t endian_tag;
+    // Compile-time settings the file was written with; they must match the reader's
+    uint32_t dims;
+    uint32_t coord_size;
+    uint32_t coord_kind;
+    // Width of the codes
+    uint32_t bits;
+    // Height of the tree
+    uint32_t height;
+    // Number of nodes and entries
+    uint32_t node_count;
+    uint32_t entry_count;
+    // Checksums of the nodes, node codes, entry codes and entries sections
+    uint32_t section_checksums[4];
+    // Checksum of this header, computed with the field itself set to zero
+    uint32_t header_checksum;
+    // Box of the root node
+    double root_min[RTREE_DIMS];
+    double root_max[RTREE_DIMS];
+} CompactFileHeader;
+
+// Define an entry as stored in a compact tree file
+typedef struct CompactFileEntry {
+    // Exact rectangle of the entry
+    Rect rect;
+    // The entry's data pointer value
+    uint64_t data;
+} CompactFileEntry;
+
+// Function declarations
+CompactTree* compact_tree(RTree *tree, int bits);
+void free_compact_tree(CompactTree *ct);
+size_t compact_tree_bytes(CompactTree *ct);
+void compact_search(CompactTree *ct, Rect *rect, void (*callback)(Entry *));
+Entry* compact_nearest_neighbor(CompactTree *ct, coord_t point[RTREE_DIMS]);
+bool save_compact_tree(CompactTree *ct, const char *filename);
+CompactTree* load_compact_tree(const char *filename);
+
+#endif // COMPACT_TREE_H
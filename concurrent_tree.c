@@ -0,0 +1,183 @@
+#include "concurrent_tree.h"
+#include <sched.h>
+#include <stdlib.h>
+
+// Stripe used by the reader counters of the current thread, or -1 until assigned
+static _Thread_local int reader_stripe = -1;
+// Next stripe handed to a thread that starts reading
+static atomic_uint next_stripe = 0;
+
+// Define the kinds of change a writer applies to both copies
+typedef enum ConcurrentOp {
+    CONCURRENT_INSERT,
+    CONCURRENT_DELETE,
+    CONCURRENT_REBUILD,
+    CONCURRENT_REPACK
+} ConcurrentOp;
+
+// Define one change applied to both copies
+typedef struct ConcurrentChange {
+    // Kind of change
+    ConcurrentOp op;
+    // Entry inserted or deleted
+    Entry *entry;
+    // Height and number of the subtrees repacked
+    int height;
+    int count;
+} ConcurrentChange;
+
+// Function declarations
+ConcurrentRTree* create_concurrent_tree(Entry **entries, int count);
+void free_concurrent_tree(ConcurrentRTree *ctree);
+RTree* concurrent_read_begin(ConcurrentRTree *ctree, ReadToken *token);
+void concurrent_read_end(ConcurrentRTree *ctree, ReadToken *token);
+void wait_for_readers(ConcurrentRTree *ctree, int version);
+int apply_change(RTree *tree, ConcurrentChange *change);
+int concurrent_write(ConcurrentRTree *ctree, ConcurrentChange *change);
+void concurrent_insert(ConcurrentRTree *ctree, Entry *entry);
+void concurrent_delete(ConcurrentRTree *ctree, Entry *entry);
+void concurrent_rebuild(ConcurrentRTree *ctree);
+int concurrent_repack(ConcurrentRTree *ctree, int height, int count);
+
+// Creates a concurrent tree holding the given entries
+// entries: array of pointers to the initial entries (may be NULL if count is 0)
+// count: number of initial entries
+// Returns a pointer to the new concurrent tree
+ConcurrentRTree* create_concurrent_tree(Entry **entries, int count) {
+    ConcurrentRTree *ctree = (ConcurrentRTree *)malloc(sizeof(ConcurrentRTree));
+    // Build both copies the same way so they start identical
+    for (int t = 0; t < 2; t++) {
+        ctree->trees[t] = count > 0 ? bulk_load(entries, count, BULK_LOAD_STR) : init_tree();
+    }
+    atomic_init(&ctree->published, 0);
+    atomic_init(&ctree->version, 0);
+    for (int v = 0; v < 2; v++) {
+        for (int s = 0; s < READ_INDICATOR_STRIPES; s++) atomic_init(&ctree->indicators[v][s].readers, 0);
+    }
+    pthread_mutex_init(&ctree->write_lock, NULL);
+    return ctree;
+}
+
+// Frees a concurrent tree and both of its copies; no reader or writer may be active
+// ctree: pointer to the concurrent tree
+void free_concurrent_tree(ConcurrentRTree *ctree) {
+    free_tree(ctree->trees[0]);
+    free_tree(ctree->trees[1]);
+    pthread_mutex_destroy(&ctree->write_lock);
+    free(ctree);
+}
+
+// Enters a read section. The returned tree stays complete and unchanged until
+// concurrent_read_end; any query function may be run on it. Never waits.
+// ctree: pointer to the concurrent tree
+// token: receives what concurrent_read_end needs
+// Returns the copy of the tree to query
+RTree* concurrent_read_begin(ConcurrentRTree *ctree, ReadToken *token) {
+    if (reader_stripe < 0) reader_stripe = (int)(atomic_fetch_add(&next_stripe, 1) % READ_INDICATOR_STRIPES);
+    // Register before reading which copy is published, so a writer that flips
+    // the copy afterwards is guaranteed to wait for this reader
+    token->version = atomic_load(&ctree->version);
+    token->stripe = reader_stripe;
+    atomic_fetch_add(&ctree->indicators[token->version][token->stripe].readers, 1);
+    return ctree->trees[atomic_load(&ctree->published)];
+}
+
+// Leaves a read section
+// ctree: pointer to the concurrent tree
+// token: token filled in by concurrent_read_begin
+void concurrent_read_end(ConcurrentRTree *ctree, ReadToken *token) {
+    atomic_fetch_sub(&ctree->indicators[token->version][token->stripe].readers, 1);
+}
+
+// Waits until no reader is registered in a version
+// ctree: pointer to the concurrent tree
+// version: version whose readers are waited for
+void wait_for_readers(ConcurrentRTree *ctree, int version) {
+    for (int s = 0; s < READ_INDICATOR_STRIPES; s++) {
+        while (atomic_load(&ctree->indicators[version][s].readers) > 0) sched_yield();
+    }
+}
+
+// Applies one change to one copy of the tree
+// tree: copy to change
+// change: pointer to the change
+// Returns the number of subtrees repacked for a repack, 0 otherwise
+int apply_change(RTree *tree, ConcurrentChange *change) {
+    switch (change->op) {
+        case CONCURRENT_INSERT:
+            insert(tree, change->entry);
+            return 0;
+        case CONCURRENT_DELETE:
+            delete_entry(tree, change->entry);
+            return 0;
+        case CONCURRENT_REBUILD:
+            rebuild_tree(tree);
+            return 0;
+        case CONCURRENT_REPACK:
+        default:
+            return repack_subtrees(tree, change->height, change->count);
+    }
+}
+
+// Applies a change to both copies without disturbing readers
+// ctree: pointer to the concurrent tree
+// change: pointer to the change
+// Returns the result of applying the change to the first copy
+int concurrent_write(ConcurrentRTree *ctree, ConcurrentChange *change) {
+    pthread_mutex_lock(&ctree->write_lock);
+    // Change the copy no reader can be using and publish it
+    int hidden = 1 - atomic_load(&ctree->published);
+    int result = apply_change(ctree->trees[hidden], change);
+    atomic_store(&ctree->published, hidden);
+
+    // Readers may still be on the old copy. Send new readers to the other
+    // version's indicators, then wait for both versions to drain: the wait on
+    // the next version first catches readers that registered there before the
+    // previous write finished its own toggle.
+    int old_version = atomic_load(&ctree->version);
+    int next_version = 1 - old_version;
+    wait_for_readers(ctree, next_version);
+    atomic_store(&ctree->version, next_version);
+    wait_for_readers(ctree, old_version);
+
+    // No reader can see the old copy any more: bring it up to date
+    apply_change(ctree->trees[1 - hidden], change);
+    pthread_mutex_unlock(&ctree->write_lock);
+    return result;
+}
+
+// Inserts an entry while readers keep querying
+// ctree: pointer to the concurrent tree
+// entry: pointer to the entry; it is shared by both copies and must stay valid
+void concurrent_insert(ConcurrentRTree *ctree, Entry *entry) {
+    ConcurrentChange change = {CONCURRENT_INSERT, entry, 0, 0};
+    concurrent_write(ctree, &change);
+}
+
+// Deletes an entry while readers keep querying
+// ctree: pointer to the concurrent tree
+// entry: pointer to the entry; the caller may free it once this returns
+void concurrent_delete(ConcurrentRTree *ctree, Entry *entry) {
+    ConcurrentChange change = {CONCURRENT_DELETE, entry, 0, 0};
+    concurrent_write(ctree, &change);
+}
+
+// Repacks the whole tree (see rebuild_tree) while readers keep querying.
+// Readers see the old tree until the repacked copy is published, and never
+// wait; other writers wait until both copies are repacked.
+// ctree: pointer to the concurrent tree
+void concurrent_rebuild(ConcurrentRTree *ctree) {
+    ConcurrentChange change = {CONCURRENT_REBUILD, NULL, 0, 0};
+    concurrent_write(ctree, &change);
+}
+
+// Repacks the subtrees that waste the most space (see repack_subtrees)
+// while readers keep querying
+// ctree: pointer to the concurrent tree
+// height: height of the subtrees above the leaves
+// count: number of subtrees to repack
+// Returns the number of subtrees repacked
+int concurrent_repack(ConcurrentRTree *ctree, int height, int count) {
+    ConcurrentChange change = {CONCURRENT_REPACK, NULL, height, count};
+    return concurrent_write(ctree, &change);
+}
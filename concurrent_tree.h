@@ -0,0 +1,54 @@
+#ifndef CONCURRENT_TREE_H
+#define CONCURRENT_TREE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "rtree.h"
+
+// Number of separate reader counters per version; readers spread over them so
+// they don't all contend on one cache line
+#define READ_INDICATOR_STRIPES 16
+
+// Define one reader counter, padded to its own cache line
+typedef struct ReadIndicator {
+    atomic_long readers;
+    char pad[64 - sizeof(atomic_long)];
+} ReadIndicator;
+
+// Define a tree that one writer at a time can modify while any number of
+// readers query it. Two copies of the tree are kept (the Left-Right scheme):
+// readers use whichever copy is published, the writer changes the other one,
+// publishes it, waits for readers still on the old copy to leave, and then
+// repeats the change there. Readers never wait and always see a complete tree.
+typedef struct ConcurrentRTree {
+    // The two copies; both reference the same caller-owned entries
+    RTree *trees[2];
+    // Index of the copy readers should use
+    atomic_int published;
+    // Selects which set of read indicators arriving readers register in
+    atomic_int version;
+    // Readers currently inside a read section, per version
+    ReadIndicator indicators[2][READ_INDICATOR_STRIPES];
+    // Serializes writers
+    pthread_mutex_t write_lock;
+} ConcurrentRTree;
+
+// Define what a reader needs to leave its read section
+typedef struct ReadToken {
+    // Version the reader registered in
+    int version;
+    // Counter the reader incremented
+    int stripe;
+} ReadToken;
+
+// Function declarations
+ConcurrentRTree* create_concurrent_tree(Entry **entries, int count);
+void free_concurrent_tree(ConcurrentRTree *ctree);
+RTree* concurrent_read_begin(ConcurrentRTree *ctree, ReadToken *token);
+void concurrent_read_end(ConcurrentRTree *ctree, ReadToken *token);
+void concurrent_insert(ConcurrentRTree *ctree, Entry *entry);
+void concurrent_delete(ConcurrentRTree *ctree, Entry *entry);
+void concurrent_rebuild(ConcurrentRTree *ctree);
+int concurrent_repack(ConcurrentRTree *ctree, int height, int count);
+
+#endif // CONCURRENT_TREE_H
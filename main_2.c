@@ -1,14 +1,366 @@
 #include "rtree.h"
+#include "paged_file.h"
+#include <ctype.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Batch mode builds a tree from a file and answers queries streamed on
+// standard input, one result line per query line, without prompts:
+//   ./code.exe batch data.csv nn < points.txt > ids.txt
+//   ./code.exe batch data.bin range < rects.txt
+//   ./code.exe batch tree.rt knn 10 < points.txt
+// Data files are text with one rectangle (min..., max...) or point per line,
+// separated by commas or spaces; lines not starting with a number, such as a
+// header, are skipped. Files ending in .bin hold raw Rect records written by a
+// program built with the same settings, and files ending in .rt are trees
+// saved by save_tree. Entries are numbered from 0 in file order (a saved
+// tree keeps its stored ids), and results are written as those numbers,
+// space separated, with an empty line when nothing is found. Standard output
+// carries only results, so messages go to standard error.
+
+// Number of query lines read and answered at a time in batch mode
+#define BATCH_BLOCK 4096
+// Bytes of results collected before they are written out
+#define BATCH_OUTPUT_SIZE (1 << 20)
+// Longest line accepted in data and query files
+#define BATCH_LINE_SIZE 4096
+
+// Define the kinds of queries answered in batch mode
+typedef enum BatchQuery {
+    // Nearest entry to a point
+    BATCH_NN,
+    // k nearest entries to a point, nearest first
+    BATCH_KNN,
+    // Entries overlapping a rectangle
+    BATCH_RANGE
+} BatchQuery;
+
+// Results waiting to be written to standard output
+static char batch_output[BATCH_OUTPUT_SIZE];
+// Number of bytes in batch_output
+static size_t batch_output_used = 0;
+
+// Prints the corners of a rectangle as [min...] - [max...]
+void print_rect(Rect *rect) {
+    for (int corner = 0; corner < 2; corner++) {
+        coord_t *coords = corner == 0 ? rect->min : rect->max;
+        printf(corner == 0 ? "[" : " - [");
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            printf(j == 0 ? "%f" : ", %f", (double)coords[j]);
+        }
+        printf("]");
+    }
+}
+
+// Reads count coordinates from standard input
+void read_coords(coord_t *coords, int count) {
+    for (int j = 0; j < count; j++) {
+        double value;
+        scanf("%lf", &value);
+        coords[j] = (coord_t)value;
+    }
+}
 
 void entry_callback(Entry *entry) {
-    printf("Found entry: [%f, %f] - [%f, %f]\n",
-           entry->rect.min[0], entry->rect.min[1],
-           entry->rect.max[0], entry->rect.max[1]);
+    printf("Found entry: ");
+    print_rect(&entry->rect);
+    printf("\n");
+}
+
+// Writes the collected results to standard output
+void flush_output(void) {
+    fwrite(batch_output, 1, batch_output_used, stdout);
+    batch_output_used = 0;
+}
+
+// Appends a character to the results
+void output_char(char c) {
+    if (batch_output_used == BATCH_OUTPUT_SIZE) flush_output();
+    batch_output[batch_output_used++] = c;
+}
+
+// Appends an entry's id to the results, after a space unless it starts the line
+// entry: pointer to the entry
+// first: whether it is the first id on the line
+void output_id(Entry *entry, bool first) {
+    // Room for a space and the digits of any 64-bit number
+    if (batch_output_used + 21 > BATCH_OUTPUT_SIZE) flush_output();
+    if (!first) batch_output[batch_output_used++] = ' ';
+    uint64_t id = (uint64_t)(uintptr_t)entry->data;
+    char digits[20];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + id % 10);
+        id /= 10;
+    } while (id > 0);
+    while (n > 0) batch_output[batch_output_used++] = digits[--n];
+}
+
+// Whether the next range result is the first on its line
+static bool range_line_empty = true;
+
+// Appends an entry found by a range query to the results
+void range_callback(Entry *entry) {
+    output_id(entry, range_line_empty);
+    range_line_empty = false;
+}
+
+// Reads a number like strtod, quickly for the plain decimals that make up
+// most data files. A decimal of at most 15 digits is exact as a double, and
+// so is any power of ten up to 1e22, so one division rounds correctly; other
+// forms (more digits, exponents, hex, inf, nan) are left to strtod.
+// p: start of the number
+// end: set to the first character after the number
+// Returns the number
+double parse_number(char *p, char **end) {
+    static const double powers_of_ten[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    char *start = p;
+    bool negative = false;
+    if (*p == '-' || *p == '+') negative = *p++ == '-';
+    uint64_t mantissa = 0;
+    int digits = 0, fraction_digits = 0;
+    while (isdigit((unsigned char)*p)) {
+        mantissa = mantissa * 10 + (uint64_t)(*p++ - '0');
+        digits++;
+    }
+    if (*p == '.') {
+        p++;
+        while (isdigit((unsigned char)*p)) {
+            mantissa = mantissa * 10 + (uint64_t)(*p++ - '0');
+            digits++;
+            fraction_digits++;
+        }
+    }
+    if (digits == 0 || digits > 15 || fraction_digits > 22 || isalpha((unsigned char)*p)) {
+        return strtod(start, end);
+    }
+    *end = p;
+    double value = (double)mantissa / powers_of_ten[fraction_digits];
+    return negative ? -value : value;
+}
+
+// Reads the numbers on a line of a data or query file
+// line: the line; numbers may be separated by commas, semicolons or spaces
+// values: array receiving the numbers
+// max: size of values
+// Returns the number of values read, or 0 for a line that doesn't start with
+// a number (blank lines, headers and comments)
+int parse_numbers(char *line, double *values, int max) {
+    char *p = line;
+    while (isspace((unsigned char)*p)) p++;
+    if (!(isdigit((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.')) return 0;
+    int count = 0;
+    while (*p && count < max) {
+        char *end;
+        double value = parse_number(p, &end);
+        if (end == p) {
+            p++;
+            continue;
+        }
+        values[count++] = value;
+        p = end;
+    }
+    return count;
+}
+
+// Turns the numbers of a line into a rectangle: 2 * RTREE_DIMS numbers give
+// the corners, RTREE_DIMS numbers give a point
+// values: the numbers
+// count: number of values
+// rect: pointer to the rectangle to fill
+// Returns false if the line holds neither
+bool values_to_rect(double *values, int count, Rect *rect) {
+    if (count < RTREE_DIMS) return false;
+    bool point = count < 2 * RTREE_DIMS;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        rect->min[j] = (coord_t)values[j];
+        rect->max[j] = (coord_t)values[point ? j : RTREE_DIMS + j];
+    }
+    return true;
 }
 
-int main() {
+// Returns the current time in seconds
+double now_seconds(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Checks whether a file name ends with a suffix
+// name: the file name
+// suffix: the suffix, e.g. ".bin"
+// Returns true if name ends with suffix
+bool has_suffix(const char *name, const char *suffix) {
+    size_t n = strlen(name), m = strlen(suffix);
+    return n >= m && strcmp(name + n - m, suffix) == 0;
+}
+
+// Builds a tree from a data file, see the batch mode description above
+// filename: name of the file
+// entries: set to the entries the tree refers to, which the caller frees
+// after the tree (NULL for a saved tree, which owns its entries)
+// Returns the tree, or NULL if the file can't be read
+RTree* build_batch_tree(const char *filename, Entry **entries) {
+    *entries = NULL;
+    if (has_suffix(filename, ".rt")) {
+        // Mapping the file loads it fastest, and quietly, unlike load_tree
+        MappedTree *mt = map_tree(filename);
+        if (!mt) return NULL;
+        RTree *tree = load_mapped_tree(mt, false, NULL);
+        unmap_tree(mt);
+        return tree;
+    }
+
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open file %s for reading\n", filename);
+        return NULL;
+    }
+    setvbuf(file, NULL, _IOFBF, BATCH_OUTPUT_SIZE);
+    int count = 0, capacity = 1024;
+    Entry *list = (Entry *)malloc(sizeof(Entry) * capacity);
+    if (has_suffix(filename, ".bin")) {
+        Rect rect;
+        while (fread(&rect, sizeof(Rect), 1, file) == 1) {
+            if (count == capacity) {
+                capacity *= 2;
+                list = (Entry *)realloc(list, sizeof(Entry) * capacity);
+            }
+            list[count].rect = rect;
+            list[count].data = (void *)(uintptr_t)count;
+            count++;
+        }
+    } else {
+        char line[BATCH_LINE_SIZE];
+        double values[2 * RTREE_DIMS];
+        while (fgets(line, sizeof(line), file)) {
+            Rect rect;
+            if (!values_to_rect(values, parse_numbers(line, values, 2 * RTREE_DIMS), &rect)) continue;
+            if (count == capacity) {
+                capacity *= 2;
+                list = (Entry *)realloc(list, sizeof(Entry) * capacity);
+            }
+            list[count].rect = rect;
+            list[count].data = (void *)(uintptr_t)count;
+            count++;
+        }
+    }
+    fclose(file);
+
+    // Bulk loading is the fastest way to build a tree from many entries
+    Entry **pointers = (Entry **)malloc(sizeof(Entry *) * (count > 0 ? count : 1));
+    for (int i = 0; i < count; i++) pointers[i] = &list[i];
+    RTree *tree = bulk_load(pointers, count, BULK_LOAD_STR);
+    free(pointers);
+    *entries = list;
+    return tree;
+}
+
+// Answers a block of query lines and appends one result line for each
+// tree: pointer to the R-tree
+// kind: kind of query
+// k: number of neighbors for BATCH_KNN
+// rects: the queries; points are taken from the min corners
+// count: number of queries
+// ctx: query context for BATCH_KNN
+// found: scratch array of at least max(count, k) entries
+void answer_block(RTree *tree, BatchQuery kind, int k, Rect *rects, int count, QueryContext *ctx, Entry **found) {
+    if (kind == BATCH_NN) {
+        // One traversal of the tree answers the whole block
+        coord_t (*points)[RTREE_DIMS] = malloc(sizeof(coord_t[RTREE_DIMS]) * count);
+        for (int q = 0; q < count; q++) {
+            for (int j = 0; j < RTREE_DIMS; j++) points[q][j] = rects[q].min[j];
+        }
+        nearest_neighbor_batch(tree, points, count, found);
+        for (int q = 0; q < count; q++) {
+            if (found[q]) output_id(found[q], true);
+            output_char('\n');
+        }
+        free(points);
+    } else if (kind == BATCH_KNN) {
+        for (int q = 0; q < count; q++) {
+            int n = knn_ctx(ctx, tree, rects[q].min, k, found);
+            for (int i = 0; i < n; i++) output_id(found[i], i == 0);
+            output_char('\n');
+        }
+    } else {
+        for (int q = 0; q < count; q++) {
+            range_line_empty = true;
+            search(tree->root, &rects[q], range_callback);
+            output_char('\n');
+        }
+    }
+}
+
+// Runs batch mode, see the description at the top of the file
+// Returns the exit status of the program
+int run_batch(int argc, char **argv) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s batch <data.csv|data.bin|tree.rt> <nn|knn k|range> < queries > results\n", argv[0]);
+        return 1;
+    }
+    BatchQuery kind;
+    int k = 1;
+    if (strcmp(argv[3], "nn") == 0) {
+        kind = BATCH_NN;
+    } else if (strcmp(argv[3], "range") == 0) {
+        kind = BATCH_RANGE;
+    } else if (strcmp(argv[3], "knn") == 0 && argc > 4 && atoi(argv[4]) > 0) {
+        kind = BATCH_KNN;
+        k = atoi(argv[4]);
+    } else {
+        fprintf(stderr, "Unknown query %s (nn, knn k or range)\n", argv[3]);
+        return 1;
+    }
+
+    double start = now_seconds();
+    Entry *entries;
+    RTree *tree = build_batch_tree(argv[2], &entries);
+    if (!tree) return 1;
+    double built = now_seconds();
+
+    setvbuf(stdin, NULL, _IOFBF, BATCH_OUTPUT_SIZE);
+    Rect *rects = (Rect *)malloc(sizeof(Rect) * BATCH_BLOCK);
+    Entry **found = (Entry **)malloc(sizeof(Entry *) * (k > BATCH_BLOCK ? k : BATCH_BLOCK));
+    QueryContext *ctx = create_query_context();
+    char line[BATCH_LINE_SIZE];
+    double values[2 * RTREE_DIMS];
+    long answered = 0;
+    int count = 0;
+    while (fgets(line, sizeof(line), stdin)) {
+        int n = parse_numbers(line, values, 2 * RTREE_DIMS);
+        // Every line with a query gets a result line; other lines are skipped
+        if (!values_to_rect(values, n, &rects[count])) continue;
+        if (++count == BATCH_BLOCK) {
+            answer_block(tree, kind, k, rects, count, ctx, found);
+            answered += count;
+            count = 0;
+        }
+    }
+    answer_block(tree, kind, k, rects, count, ctx, found);
+    answered += count;
+    flush_output();
+    fflush(stdout);
+
+    double done = now_seconds();
+    fprintf(stderr, "Built the tree in %.3f s and answered %ld queries in %.3f s\n", built - start, answered, done - built);
+    free_query_context(ctx);
+    free(found);
+    free(rects);
+    free_tree(tree);
+    free(entries);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "batch") == 0) return run_batch(argc, argv);
+
     RTree *tree = init_tree();
     int choice;
     while (1) {
@@ -24,21 +376,21 @@ int main() {
         if (choice == 1) {
             Entry *entry = (Entry *)malloc(sizeof(Entry));
             printf("Enter rectangle min x, min y, max x, max y: ");
-            scanf("%f %f %f %f", &entry->rect.min[0], &entry->rect.min[1], 
-                                  &entry->rect.max[0], &entry->rect.max[1]);
+            read_coords(entry->rect.min, RTREE_DIMS);
+            read_coords(entry->rect.max, RTREE_DIMS);
             entry->child = NULL;  // Assuming no child for this example
             insert(tree, entry);
             printf("Entry inserted.\n");
 
         } else if (choice == 2) {
-            float point[2];
+            coord_t point[RTREE_DIMS];
             printf("Enter point (x y) to find nearest neighbor: ");
-            scanf("%f %f", &point[0], &point[1]);
+            read_coords(point, RTREE_DIMS);
             Entry *nearest = nearest_neighbor(tree, point);
             if (nearest) {
-                printf("Nearest neighbor found: [%f, %f] - [%f, %f]\n",
-                       nearest->rect.min[0], nearest->rect.min[1],
-                       nearest->rect.max[0], nearest->rect.max[1]);
+                printf("Nearest neighbor found: ");
+                print_rect(&nearest->rect);
+                printf("\n");
             } else {
                 printf("No neighbor found.\n");
             }
@@ -55,13 +407,13 @@ int main() {
             scanf("%s", filename);
             RTree *loaded_tree = load_tree(filename);
             if (loaded_tree) {
-                free(tree); // Clean up the old tree
+                free_tree(tree); // Clean up the old tree
                 tree = loaded_tree; // Switch to the loaded tree
             }
 
         } else if (choice == 5) {
             // Clean up
-            free(tree);
+            free_tree(tree);
             break;
 
         } else {
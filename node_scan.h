@@ -0,0 +1,33 @@
+#ifndef NODE_SCAN_H
+#define NODE_SCAN_H
+
+#include <stdint.h>
+#include "rtree.h"
+
+// Number of 64-bit words needed for one bit per node entry
+#define NODE_MASK_WORDS ((MAX_ENTRIES + 64) / 64)
+
+// Define a set of entries of one node, one bit per entry index
+typedef struct NodeMask {
+    uint64_t bits[NODE_MASK_WORDS];
+} NodeMask;
+
+// Iterates over the set bits of a NodeMask, assigning each entry index to i.
+// The hidden loop variables are named after i, so uses can nest.
+#define NODE_MASK_FOREACH(mask, i)                                                        \
+    for (int node_mask_word_##i = 0; node_mask_word_##i < NODE_MASK_WORDS; node_mask_word_##i++) \
+        for (uint64_t node_mask_bits_##i = (mask).bits[node_mask_word_##i];              \
+             node_mask_bits_##i && ((i) = node_mask_word_##i * 64 + __builtin_ctzll(node_mask_bits_##i), 1); \
+             node_mask_bits_##i &= node_mask_bits_##i - 1)
+
+// Per-dimension arrays of entry bounds, laid out like RTreeNode's min and max
+typedef coord_t (*ScanArrays)[MAX_ENTRIES + 1];
+
+// Function declarations
+NodeMask node_overlap_mask(RTreeNode *node, Rect *rect);
+void node_min_dist2(RTreeNode *node, coord_t point[RTREE_DIMS], dist_t *out);
+NodeMask scan_overlap_mask(ScanArrays min, ScanArrays max, int count, Rect *rect);
+void scan_min_dist2(ScanArrays min, ScanArrays max, int count, coord_t point[RTREE_DIMS], dist_t *out);
+const char* node_scan_kernel_name(void);
+
+#endif // NODE_SCAN_H
@@ -0,0 +1,459 @@
+#include "paged_file.h"
+#include "node_scan.h"
+#include "priority_queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Function declarations
+uint32_t paged_checksum(const void *data, size_t size);
+uint32_t paged_page_size(void);
+void paged_init_header(PagedFileHeader *header);
+void paged_seal_header(PagedFileHeader *header);
+bool paged_write_header(FILE *file, PagedFileHeader *header);
+void paged_fill_node(DiskNode *page, uint32_t page_size, RTreeNode *node, uint64_t *refs);
+void paged_seal_node(DiskNode *node, uint32_t page_size);
+bool paged_header_intact(PagedFileHeader *header);
+bool paged_header_valid(PagedFileHeader *header);
+bool paged_node_valid(DiskNode *node, uint32_t page_size);
+bool paged_file_detect(FILE *file);
+bool paged_sync(FILE *file);
+MappedTree* map_tree(const char *filename);
+void unmap_tree(MappedTree *mt);
+void mapped_prefetch(MappedTree *mt);
+void prefault_memory(void *addr, size_t size);
+DiskNode* mapped_page(MappedTree *mt, uint64_t page);
+long mapped_tree_verify(MappedTree *mt);
+DiskNode* mapped_query_page(MappedTree *mt, uint64_t page, bool *damaged);
+void mapped_search_node(MappedTree *mt, DiskNode *node, int height, Rect *rect, void (*callback)(Entry *), bool *damaged);
+void mapped_search(MappedTree *mt, Rect *rect, void (*callback)(Entry *));
+bool mapped_nearest_neighbor(MappedTree *mt, coord_t point[RTREE_DIMS], Entry *out);
+
+// Computes a 32-bit checksum (FNV-1a over 32-bit words, then any trailing bytes)
+// data: pointer to the bytes
+// size: number of bytes
+// Returns the checksum
+uint32_t paged_checksum(const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    uint32_t hash = 2166136261u;
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4) {
+        uint32_t word;
+        memcpy(&word, bytes + i, 4);
+        hash = (hash ^ word) * 16777619u;
+    }
+    for (; i < size; i++) hash = (hash ^ bytes[i]) * 16777619u;
+    return hash;
+}
+
+// Returns the node page size for the current settings: the smallest power of
+// two that holds a DiskNode, and at least PAGED_MIN_PAGE_SIZE
+uint32_t paged_page_size(void) {
+    uint32_t size = PAGED_MIN_PAGE_SIZE;
+    while (size < sizeof(DiskNode)) size *= 2;
+    return size;
+}
+
+// Fills in the fields of a header that describe this build; the caller sets
+// the tree's root, counts and sequence
+// header: pointer to the header
+void paged_init_header(PagedFileHeader *header) {
+    memset(header, 0, sizeof(PagedFileHeader));
+    header->magic = PAGED_FILE_MAGIC;
+    header->version = PAGED_FILE_VERSION;
+    header->endian_tag = PAGED_FILE_ENDIAN_TAG;
+    header->dims = RTREE_DIMS;
+    header->coord_size = sizeof(coord_t);
+    header->coord_kind = PAGED_COORD_KIND;
+    header->max_entries = MAX_ENTRIES;
+    header->page_size = paged_page_size();
+#ifdef RTREE_POINTS
+    header->points = 1;
+#endif
+}
+
+// Stores the checksum of a header in the header
+// header: pointer to the header
+void paged_seal_header(PagedFileHeader *header) {
+    header->header_checksum = 0;
+    header->header_checksum = paged_checksum(header, sizeof(PagedFileHeader));
+}
+
+// Seals a header and writes it to its slot (chosen by its sequence)
+// file: file opened for writing
+// header: pointer to the header
+// Returns true if the header was written
+bool paged_write_header(FILE *file, PagedFileHeader *header) {
+    paged_seal_header(header);
+    if (fseek(file, (long)(header->sequence % 2) * PAGED_HEADER_SLOT_SIZE, SEEK_SET) != 0) return false;
+    return fwrite(header, sizeof(PagedFileHeader), 1, file) == 1;
+}
+
+// Fills a page with a node and seals it
+// page: page buffer of page_size bytes
+// page_size: size of the page in bytes
+// node: pointer to the node
+// refs: child page numbers (internal nodes) or data values (leaves), one per entry
+void paged_fill_node(DiskNode *page, uint32_t page_size, RTreeNode *node, uint64_t *refs) {
+    memset(page, 0, page_size);
+    page->is_leaf = node->is_leaf;
+    page->num_entries = (uint16_t)node->num_entries;
+    // The bounds are copied as whole arrays since the layouts match; point
+    // leaves store their points as both corners
+    memcpy(page->min, node->min, sizeof(page->min));
+    memcpy(page->max, NODE_MAX_ARRAYS(node), sizeof(page->max));
+    memcpy(page->ref, refs, sizeof(uint64_t) * node->num_entries);
+    paged_seal_node(page, page_size);
+}
+
+// Stores the checksum of a node page in its first field
+// node: pointer to the start of the page
+// page_size: size of the page in bytes
+void paged_seal_node(DiskNode *node, uint32_t page_size) {
+    node->checksum = paged_checksum((unsigned char *)node + sizeof(uint32_t), page_size - sizeof(uint32_t));
+}
+
+// Checks that a header slot holds a complete header, without reporting why not
+// header: pointer to the header slot
+// Returns true if the magic number, byte order and checksum are right
+bool paged_header_intact(PagedFileHeader *header) {
+    if (header->magic != PAGED_FILE_MAGIC || header->endian_tag != PAGED_FILE_ENDIAN_TAG) return false;
+    PagedFileHeader copy = *header;
+    paged_seal_header(&copy);
+    return copy.header_checksum == header->header_checksum;
+}
+
+// Checks that a header is intact and matches the settings of this build
+// header: pointer to the header
+// Returns true if the file can be read by this build; prints the reason otherwise
+bool paged_header_valid(PagedFileHeader *header) {
+    if (header->magic != PAGED_FILE_MAGIC) {
+        fprintf(stderr, "Not a paged R-tree file\n");
+        return false;
+    }
+    if (header->endian_tag != PAGED_FILE_ENDIAN_TAG) {
+        fprintf(stderr, "Tree file was written on a host with different byte order\n");
+        return false;
+    }
+    if (!paged_header_intact(header)) {
+        fprintf(stderr, "Tree file header is corrupt\n");
+        return false;
+    }
+    if (header->version != PAGED_FILE_VERSION) {
+        fprintf(stderr, "Unsupported tree file version %u\n", header->version);
+        return false;
+    }
+    if (header->dims != RTREE_DIMS || header->coord_size != sizeof(coord_t) ||
+        header->coord_kind != PAGED_COORD_KIND || header->max_entries != MAX_ENTRIES ||
+        header->page_size != paged_page_size()) {
+        fprintf(stderr, "Tree file was written with different settings (dims %u, coord bytes %u, max entries %u)\n",
+                        header->dims, header->coord_size, header->max_entries);
+        return false;
+    }
+#ifdef RTREE_POINTS
+    // A point build keeps only the lower corner of leaf entries, so the
+    // rectangles of a file from another build would shrink to points
+    if (!header->points) {
+        fprintf(stderr, "Tree file holds rectangles; it needs a build without RTREE_POINTS\n");
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Checks the checksum and entry count of a node page
+// node: pointer to the start of the page
+// page_size: size of the page in bytes
+// Returns true if the page is intact
+bool paged_node_valid(DiskNode *node, uint32_t page_size) {
+    uint32_t stored = node->checksum;
+    uint32_t actual = paged_checksum((unsigned char *)node + sizeof(uint32_t), page_size - sizeof(uint32_t));
+    return stored == actual && node->num_entries <= MAX_ENTRIES;
+}
+
+// Checks whether an open file is in the paged format
+// file: file opened for reading; its position is changed
+// Returns true if either header slot starts with the magic number
+bool paged_file_detect(FILE *file) {
+    for (int slot = 0; slot < 2; slot++) {
+        uint64_t magic = 0;
+        if (fseek(file, (long)slot * PAGED_HEADER_SLOT_SIZE, SEEK_SET) != 0) return false;
+        if (fread(&magic, sizeof(magic), 1, file) == 1 && magic == PAGED_FILE_MAGIC) return true;
+    }
+    return false;
+}
+
+// Writes buffered data of a file through to the storage device
+// file: file opened for writing
+// Returns true on success
+bool paged_sync(FILE *file) {
+    if (fflush(file) != 0) return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// Maps a paged tree file into memory. Only the header is checked, so this
+// takes the same time for any file size; pages are read by the OS on first
+// touch and shared with every other process mapping the same file.
+// filename: name of the file
+// Returns the mapped tree, or NULL if the file cannot be opened or is not valid
+MappedTree* map_tree(const char *filename) {
+    unsigned char *base = NULL;
+    size_t size = 0;
+    int is_mapped = 0;
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open file %s for reading\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size >= PAGED_HEADER_SIZE) {
+        size = (size_t)st.st_size;
+        void *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (addr != MAP_FAILED) {
+            base = (unsigned char *)addr;
+            is_mapped = 1;
+        }
+    }
+    close(fd);
+#else
+    // No mmap: read the whole file into memory instead
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        fprintf(stderr, "Failed to open file %s for reading\n", filename);
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length >= PAGED_HEADER_SIZE) {
+        size = (size_t)length;
+        base = (unsigned char *)malloc(size);
+        if (fread(base, 1, size, file) != size) {
+            free(base);
+            base = NULL;
+        }
+    }
+    fclose(file);
+#endif
+    if (base == NULL) {
+        fprintf(stderr, "Failed to map file %s\n", filename);
+        return NULL;
+    }
+
+    MappedTree *mt = (MappedTree *)malloc(sizeof(MappedTree));
+    mt->base = base;
+    mt->size = size;
+    mt->is_mapped = is_mapped;
+    // Use the newest intact header slot; if neither is intact, slot 0 reports why
+    PagedFileHeader *slots[2] = {(PagedFileHeader *)base, (PagedFileHeader *)(base + PAGED_HEADER_SLOT_SIZE)};
+    mt->header = slots[0];
+    if (paged_header_intact(slots[1]) && (!paged_header_intact(slots[0]) || slots[1]->sequence > slots[0]->sequence)) {
+        mt->header = slots[1];
+    }
+    // The header must be valid and the file long enough for every page it promises
+    if (!paged_header_valid(mt->header)) {
+        unmap_tree(mt);
+        return NULL;
+    }
+    if (mt->header->root_page < 1 || mt->header->root_page > mt->header->page_count ||
+        (size - PAGED_HEADER_SIZE) / mt->header->page_size < mt->header->page_count) {
+        fprintf(stderr, "Tree file %s is truncated\n", filename);
+        unmap_tree(mt);
+        return NULL;
+    }
+    return mt;
+}
+
+// Unmaps a tree mapped with map_tree
+// mt: pointer to the mapped tree
+void unmap_tree(MappedTree *mt) {
+#ifndef _WIN32
+    if (mt->is_mapped) munmap(mt->base, mt->size);
+    else free(mt->base);
+#else
+    free(mt->base);
+#endif
+    free(mt);
+}
+
+// Reads the whole file into memory ahead of use, for callers about to touch
+// every page: one large sequential read instead of a page fault per page
+// mt: pointer to the mapped tree
+void mapped_prefetch(MappedTree *mt) {
+#ifndef _WIN32
+    if (!mt->is_mapped) return;
+    posix_madvise(mt->base, mt->size, POSIX_MADV_WILLNEED);
+#ifdef MADV_POPULATE_READ
+    // Also map every page up front (Linux 5.14+; ignored where unsupported)
+    madvise(mt->base, mt->size, MADV_POPULATE_READ);
+#endif
+#else
+    (void)mt;
+#endif
+}
+
+// Backs a large block of freshly allocated memory with pages in one call,
+// which is much cheaper than taking a page fault on each first write
+// (Linux 5.14+; does nothing elsewhere)
+// addr: start of the block
+// size: size of the block in bytes
+void prefault_memory(void *addr, size_t size) {
+#if !defined(_WIN32) && defined(MADV_POPULATE_WRITE)
+    // madvise needs a page-aligned start; the partial first page faults normally
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)addr + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t)addr + size;
+    if (end > start) madvise((void *)start, end - start, MADV_POPULATE_WRITE);
+#else
+    (void)addr;
+    (void)size;
+#endif
+}
+
+// Returns the node stored in a page of a mapped tree
+// mt: pointer to the mapped tree
+// page: page number, from 1 to the header's page_count
+DiskNode* mapped_page(MappedTree *mt, uint64_t page) {
+    return (DiskNode *)(mt->base + PAGED_HEADER_SIZE + (size_t)(page - 1) * mt->header->page_size);
+}
+
+// Checks the checksum of every page of a mapped tree (this reads the whole file)
+// mt: pointer to the mapped tree
+// Returns the number of corrupt pages
+long mapped_tree_verify(MappedTree *mt) {
+    long bad = 0;
+    for (uint64_t page = 1; page <= mt->header->page_count; page++) {
+        if (!paged_node_valid(mapped_page(mt, page), mt->header->page_size)) bad++;
+    }
+    return bad;
+}
+
+// Returns the node of a page a query is about to scan, after the checks that
+// keep the scan inside the mapping; checksums are left to mapped_tree_verify
+// mt: pointer to the mapped tree
+// page: page number taken from the header or a parent's entry
+// damaged: set when the page can't be read
+// Returns the node, or NULL if the page number is outside the file or the
+// page holds too many entries
+DiskNode* mapped_query_page(MappedTree *mt, uint64_t page, bool *damaged) {
+    if (page < 1 || page > mt->header->page_count || mapped_page(mt, page)->num_entries > MAX_ENTRIES) {
+        *damaged = true;
+        return NULL;
+    }
+    return mapped_page(mt, page);
+}
+
+// Searches a subtree of a mapped tree for entries overlapping a rectangle
+// mt: pointer to the mapped tree
+// node: current node, or NULL for a skipped page
+// height: height of the node above the leaves, according to the header
+// rect: pointer to the rectangle to search for
+// callback: function to call for each overlapping entry
+// damaged: set when a page of the subtree can't be read and is skipped
+void mapped_search_node(MappedTree *mt, DiskNode *node, int height, Rect *rect, void (*callback)(Entry *), bool *damaged) {
+    if (node == NULL) return;
+    // A page off its level would let a damaged reference loop back up the tree
+    if ((node->is_leaf != 0) != (height == 0)) {
+        *damaged = true;
+        return;
+    }
+    NodeMask hits = scan_overlap_mask(node->min, node->max, node->num_entries, rect);
+    int i;
+    NODE_MASK_FOREACH(hits, i) {
+        if (node->is_leaf) {
+            // Leaf entries live in the page; hand the callback a copy
+            Entry entry;
+            for (int j = 0; j < RTREE_DIMS; j++) {
+                entry.rect.min[j] = node->min[j][i];
+                entry.rect.max[j] = node->max[j][i];
+            }
+            entry.data = (void *)(uintptr_t)node->ref[i];
+            callback(&entry);
+        } else {
+            mapped_search_node(mt, mapped_query_page(mt, node->ref[i], damaged), height - 1, rect, callback, damaged);
+        }
+    }
+}
+
+// Searches a mapped tree in place for entries overlapping a rectangle.
+// The Entry passed to the callback is only valid during the call.
+// mt: pointer to the mapped tree
+// rect: pointer to the rectangle to search for
+// callback: function to call for each overlapping entry
+void mapped_search(MappedTree *mt, Rect *rect, void (*callback)(Entry *)) {
+    if (mt->header->entry_count == 0) return;
+    bool damaged = false;
+    mapped_search_node(mt, mapped_query_page(mt, mt->header->root_page, &damaged), (int)mt->header->height, rect, callback, &damaged);
+    if (damaged) fprintf(stderr, "Tree file is damaged; the search skipped pages it couldn't read\n");
+}
+
+// Finds the nearest neighbor to a point in a mapped tree, in place
+// mt: pointer to the mapped tree
+// point: array representing the point, one coordinate per dimension
+// out: receives a copy of the nearest entry
+// Returns true if the tree has any entries
+bool mapped_nearest_neighbor(MappedTree *mt, coord_t point[RTREE_DIMS], Entry *out) {
+    if (mt->header->entry_count == 0) return false;
+    // The queue stores node pointers; mapped pages are passed through it as
+    // opaque pointers and only ever dereferenced as DiskNode
+    bool damaged = false;
+    DiskNode *root = mapped_query_page(mt, mt->header->root_page, &damaged);
+    if (root == NULL) {
+        fprintf(stderr, "Tree file is damaged; its root page can't be read\n");
+        return false;
+    }
+    PriorityQueue pq;
+    init_priority_queue(&pq, 64);
+    priority_queue_push(&pq, (RTreeNode *)(void *)root, 0);
+    // An intact tree pops each page at most once; more means a reference loops
+    uint64_t pops_left = mt->header->page_count;
+    DiskNode *best_leaf = NULL;
+    int best_index = 0;
+    dist_t best_distance = DIST_MAX;
+    dist_t distances[MAX_ENTRIES + 1];
+
+    while (pq.size > 0) {
+        PriorityQueueNode pq_node = priority_queue_pop(&pq);
+        if (pq_node.distance >= best_distance) break;
+        if (pops_left-- == 0) {
+            damaged = true;
+            break;
+        }
+        DiskNode *node = (DiskNode *)(void *)pq_node.node;
+        scan_min_dist2(node->min, node->max, node->num_entries, point, distances);
+        for (int i = 0; i < node->num_entries; i++) {
+            if (distances[i] >= best_distance) continue;
+            if (node->is_leaf) {
+                best_leaf = node;
+                best_index = i;
+                best_distance = distances[i];
+            } else {
+                DiskNode *child = mapped_query_page(mt, node->ref[i], &damaged);
+                if (child != NULL) priority_queue_push(&pq, (RTreeNode *)(void *)child, distances[i]);
+            }
+        }
+    }
+    free_priority_queue(&pq);
+    if (damaged) fprintf(stderr, "Tree file is damaged; the search skipped pages it couldn't read\n");
+
+    if (best_leaf == NULL) return false;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        out->rect.min[j] = best_leaf->min[j][best_index];
+        out->rect.max[j] = best_leaf->max[j][best_index];
+    }
+    out->data = (void *)(uintptr_t)best_leaf->ref[best_index];
+    return true;
+}
@@ -0,0 +1,130 @@
+#ifndef PAGED_FILE_H
+#define PAGED_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "rtree.h"
+
+// On-disk tree format written by save_tree. The file starts with one header
+// page, followed by fixed-size node pages. Page numbers start at 1 for the
+// first node page; child references are page numbers, so the file can be
+// mapped into memory and queried in place without any pointer fixups.
+//
+//   offset 0                      header slot 0
+//   offset PAGED_HEADER_SLOT_SIZE header slot 1
+//   offset PAGED_HEADER_SIZE      node page 1
+//   ... + (p - 1) * page_size     node page p
+//
+// Checkpoints (tree_store.h) write changed nodes to unused pages and then a
+// header with the next sequence number into the slot of the older header, so
+// a crash at any point leaves at least one complete tree. Readers use the
+// intact slot with the highest sequence.
+
+// Identifies a paged tree file ("RTREPAGE" read as a little-endian integer)
+#define PAGED_FILE_MAGIC 0x4547415045525452ull
+// Format version written by this code
+#define PAGED_FILE_VERSION 2
+// Written in native byte order; reads back differently on an opposite-endian host
+#define PAGED_FILE_ENDIAN_TAG 0x01020304u
+// Size of the header page; node pages start here
+#define PAGED_HEADER_SIZE 4096
+// Size of each of the two header slots in the header page
+#define PAGED_HEADER_SLOT_SIZE (PAGED_HEADER_SIZE / 2)
+// Smallest node page size (one cache line)
+#define PAGED_MIN_PAGE_SIZE 64
+
+// Identifies the coordinate type a file was written with
+#if defined(RTREE_COORD_DOUBLE)
+#define PAGED_COORD_KIND 1
+#elif defined(RTREE_COORD_INT32)
+#define PAGED_COORD_KIND 2
+#else
+#define PAGED_COORD_KIND 0
+#endif
+
+// Define the header stored at the start of a paged file
+typedef struct PagedFileHeader {
+    // PAGED_FILE_MAGIC
+    uint64_t magic;
+    // PAGED_FILE_VERSION
+    uint32_t version;
+    // PAGED_FILE_ENDIAN_TAG as written by the saving host
+    uint32_t endian_tag;
+    // Compile-time settings the file was written with; they must match the reader's
+    uint32_t dims;
+    uint32_t coord_size;
+    uint32_t coord_kind;
+    uint32_t max_entries;
+    // Size of each node page in bytes (a power of two)
+    uint32_t page_size;
+    // Height of the tree (0 when the root is a leaf)
+    uint32_t height;
+    // Page number of the root node
+    uint64_t root_page;
+    // Number of node pages
+    uint64_t page_count;
+    // Number of leaf entries
+    uint64_t entry_count;
+    // Checkpoint number; written to slot sequence % 2
+    uint64_t sequence;
+    // Last change log record included in this tree (0 if none)
+    uint64_t log_position;
+    // Checksum of this header, computed with the field itself set to zero
+    uint32_t header_checksum;
+    // Nonzero when written by a point build (RTREE_POINTS); leaf pages of
+    // any build store both corners, so point files read anywhere
+    uint32_t points;
+} PagedFileHeader;
+
+// Define a node as stored in a page. The bounds use the same layout as
+// RTreeNode, so the node scan kernels run on mapped pages directly.
+typedef struct DiskNode {
+    // Checksum of the page after this field
+    uint32_t checksum;
+    // Nonzero for leaves
+    uint16_t is_leaf;
+    // Number of entries in the node
+    uint16_t num_entries;
+    // Bounds of each entry, per dimension
+    coord_t min[RTREE_DIMS][MAX_ENTRIES + 1];
+    coord_t max[RTREE_DIMS][MAX_ENTRIES + 1];
+    // Child page number (internal nodes) or the entry's data pointer value (leaves)
+    uint64_t ref[MAX_ENTRIES + 1];
+} DiskNode;
+
+// Define a paged file mapped into memory for querying in place
+typedef struct MappedTree {
+    // Start of the file in memory
+    unsigned char *base;
+    // Size of the file in bytes
+    size_t size;
+    // Newest intact header slot of the file
+    PagedFileHeader *header;
+    // True if base came from mmap, false if it was read into a malloc'd buffer
+    int is_mapped;
+} MappedTree;
+
+// Function declarations
+uint32_t paged_checksum(const void *data, size_t size);
+uint32_t paged_page_size(void);
+void paged_init_header(PagedFileHeader *header);
+void paged_seal_header(PagedFileHeader *header);
+bool paged_write_header(FILE *file, PagedFileHeader *header);
+void paged_fill_node(DiskNode *page, uint32_t page_size, RTreeNode *node, uint64_t *refs);
+void paged_seal_node(DiskNode *node, uint32_t page_size);
+bool paged_header_intact(PagedFileHeader *header);
+bool paged_header_valid(PagedFileHeader *header);
+bool paged_node_valid(DiskNode *node, uint32_t page_size);
+bool paged_file_detect(FILE *file);
+bool paged_sync(FILE *file);
+MappedTree* map_tree(const char *filename);
+void unmap_tree(MappedTree *mt);
+void mapped_prefetch(MappedTree *mt);
+void prefault_memory(void *addr, size_t size);
+DiskNode* mapped_page(MappedTree *mt, uint64_t page);
+long mapped_tree_verify(MappedTree *mt);
+void mapped_search(MappedTree *mt, Rect *rect, void (*callback)(Entry *));
+bool mapped_nearest_neighbor(MappedTree *mt, coord_t point[RTREE_DIMS], Entry *out);
+
+#endif // PAGED_FILE_H
@@ -0,0 +1,171 @@
+#include "parallel_sort.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+// Inputs smaller than this are sorted with a single qsort call
+#define PARALLEL_SORT_THRESHOLD 65536
+// Upper bound on the number of threads used by a single sort
+#define PARALLEL_SORT_MAX_THREADS 64
+
+// Work description for one sorting or merging thread
+typedef struct SortTask {
+    // Source array for the task
+    char *src;
+    // Destination array for merges
+    char *dst;
+    // Start of the first run (in elements)
+    size_t lo;
+    // End of the first run and start of the second run
+    size_t mid;
+    // End of the second run
+    size_t hi;
+    // Size of one element in bytes
+    size_t size;
+    // Comparison function
+    int (*compare)(const void *, const void *);
+} SortTask;
+
+// Function declarations
+int parallel_thread_count(void);
+void *sort_chunk(void *arg);
+void *merge_runs(void *arg);
+void parallel_sort(void *base, size_t count, size_t size, int (*compare)(const void *, const void *));
+
+// Returns the number of worker threads to use for parallel work
+int parallel_thread_count(void) {
+#ifdef _WIN32
+    // Query the number of logical processors on Windows
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    int count = (int)info.dwNumberOfProcessors;
+#else
+    // Query the number of online processors on POSIX systems
+    int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    // Always use at least one thread
+    if (count < 1) count = 1;
+    if (count > PARALLEL_SORT_MAX_THREADS) count = PARALLEL_SORT_MAX_THREADS;
+    return count;
+}
+
+// Sorts one chunk of the array in place
+// arg: pointer to the SortTask describing the chunk [lo, hi)
+void *sort_chunk(void *arg) {
+    SortTask *task = (SortTask *)arg;
+    qsort(task->src + task->lo * task->size, task->hi - task->lo, task->size, task->compare);
+    return NULL;
+}
+
+// Merges the sorted runs [lo, mid) and [mid, hi) of src into dst
+// arg: pointer to the SortTask describing the runs
+void *merge_runs(void *arg) {
+    SortTask *task = (SortTask *)arg;
+    size_t size = task->size;
+    size_t i = task->lo, j = task->mid, k = task->lo;
+    // Take the smaller head element until one run is exhausted
+    while (i < task->mid && j < task->hi) {
+        // Ties take from the left run so the merge is stable
+        if (task->compare(task->src + j * size, task->src + i * size) < 0) {
+            memcpy(task->dst + k++ * size, task->src + j++ * size, size);
+        } else {
+            memcpy(task->dst + k++ * size, task->src + i++ * size, size);
+        }
+    }
+    // Copy whatever is left of either run
+    memcpy(task->dst + k * size, task->src + i * size, (task->mid - i) * size);
+    k += task->mid - i;
+    memcpy(task->dst + k * size, task->src + j * size, (task->hi - j) * size);
+    return NULL;
+}
+
+// Sorts an array like qsort, splitting the work across threads for large inputs
+// base: pointer to the first element
+// count: number of elements
+// size: size of each element in bytes
+// compare: qsort-style comparison function
+void parallel_sort(void *base, size_t count, size_t size, int (*compare)(const void *, const void *)) {
+    // Inputs too small to split don't need the thread count, which is costly to query
+    if (count < 2 * PARALLEL_SORT_THRESHOLD) {
+        qsort(base, count, size, compare);
+        return;
+    }
+    // Pick the number of chunks, one per thread
+    size_t chunks = (size_t)parallel_thread_count();
+    if (chunks > count / PARALLEL_SORT_THRESHOLD) chunks = count / PARALLEL_SORT_THRESHOLD;
+    // Small inputs or single-core machines fall back to qsort
+    if (chunks < 2) {
+        qsort(base, count, size, compare);
+        return;
+    }
+
+    // Allocate a scratch buffer for the merge passes
+    char *scratch = (char *)malloc(count * size);
+    if (!scratch) {
+        qsort(base, count, size, compare);
+        return;
+    }
+
+    pthread_t threads[PARALLEL_SORT_MAX_THREADS];
+    SortTask tasks[PARALLEL_SORT_MAX_THREADS];
+    size_t bounds[PARALLEL_SORT_MAX_THREADS + 1];
+
+    // Sort each chunk on its own thread
+    for (size_t c = 0; c <= chunks; c++) {
+        bounds[c] = c * count / chunks;
+    }
+    for (size_t c = 0; c < chunks; c++) {
+        tasks[c] = (SortTask){(char *)base, NULL, bounds[c], bounds[c + 1], bounds[c + 1], size, compare};
+        if (pthread_create(&threads[c], NULL, sort_chunk, &tasks[c]) != 0) {
+            // Sort the chunk inline if the thread could not be started
+            sort_chunk(&tasks[c]);
+            threads[c] = pthread_self();
+        }
+    }
+    for (size_t c = 0; c < chunks; c++) {
+        if (!pthread_equal(threads[c], pthread_self())) pthread_join(threads[c], NULL);
+    }
+
+    // Merge neighbouring runs pairwise until a single run remains
+    char *src = (char *)base;
+    char *dst = scratch;
+    size_t runs = chunks;
+    while (runs > 1) {
+        size_t merges = 0;
+        for (size_t r = 0; r < runs; r += 2) {
+            size_t lo = bounds[r];
+            size_t mid = bounds[r + 1];
+            size_t hi = (r + 2 <= runs) ? bounds[r + 2] : mid;
+            tasks[merges] = (SortTask){src, dst, lo, mid, hi, size, compare};
+            if (pthread_create(&threads[merges], NULL, merge_runs, &tasks[merges]) != 0) {
+                merge_runs(&tasks[merges]);
+                threads[merges] = pthread_self();
+            }
+            merges++;
+        }
+        for (size_t m = 0; m < merges; m++) {
+            if (!pthread_equal(threads[m], pthread_self())) pthread_join(threads[m], NULL);
+        }
+        // Keep only the boundaries of the merged runs
+        for (size_t m = 0; m < merges; m++) {
+            bounds[m] = bounds[2 * m];
+        }
+        bounds[merges] = count;
+        runs = merges;
+        // Swap the roles of the two buffers
+        char *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    // Copy the result back if it ended up in the scratch buffer
+    if (src != (char *)base) {
+        memcpy(base, src, count * size);
+    }
+    free(scratch);
+}
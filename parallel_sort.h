@@ -0,0 +1,12 @@
+#ifndef PARALLEL_SORT_H
+#define PARALLEL_SORT_H
+
+#include <stddef.h>
+
+// Returns the number of worker threads to use for parallel work
+int parallel_thread_count(void);
+
+// Sorts an array like qsort, splitting the work across threads for large inputs
+void parallel_sort(void *base, size_t count, size_t size, int (*compare)(const void *, const void *));
+
+#endif // PARALLEL_SORT_H
@@ -1,77 +1,90 @@
 #include "priority_queue.h"
 
 // Function declarations
-void swap(PriorityQueueNode *a, PriorityQueueNode *b);
 void heapify_up(PriorityQueue *pq, int index);
 void heapify_down(PriorityQueue *pq, int index);
 PriorityQueue* create_priority_queue(int capacity);
-void priority_queue_push(PriorityQueue *pq, RTreeNode *node, float distance);
+void init_priority_queue(PriorityQueue *pq, int capacity);
+void free_priority_queue(PriorityQueue *pq);
+void priority_queue_push(PriorityQueue *pq, RTreeNode *node, dist_t distance);
+void priority_queue_push_entry(PriorityQueue *pq, Entry *entry, dist_t distance);
 PriorityQueueNode priority_queue_pop(PriorityQueue *pq);
+void result_heap_sift_down(ResultHeap *heap, int index);
+ResultHeap* create_result_heap(int capacity);
+void init_result_heap(ResultHeap *heap, int capacity);
+void free_result_heap(ResultHeap *heap);
+void result_heap_reset(ResultHeap *heap, int capacity);
+void result_heap_offer(ResultHeap *heap, Entry *entry, dist_t distance);
+dist_t result_heap_bound(ResultHeap *heap);
+ResultHeapNode result_heap_pop(ResultHeap *heap);
 
 // Function definitions
 
-// Swap two nodes in the priority queue
-void swap(PriorityQueueNode *a, PriorityQueueNode *b) {
-    // Temporary storage for swapping
-    PriorityQueueNode temp = *a;
-    *a = *b;
-    *b = temp;
-}
-
 // Heapify up to maintain the heap property
 void heapify_up(PriorityQueue *pq, int index) {
-    // While the current node is not the root and its distance is less than its parent's distance
-    while (index > 0 && pq->nodes[index].distance < pq->nodes[(index - 1) / 2].distance) {
-        // Swap the current node with its parent
-        swap(&pq->nodes[index], &pq->nodes[(index - 1) / 2]);
-        // Move to the parent's index
-        index = (index - 1) / 2;
+    // Lift the new node out and move parents down into the hole until its place is found
+    PriorityQueueNode moving = pq->nodes[index];
+    while (index > 0) {
+        int parent = (index - 1) / PQ_ARITY;
+        // Stop once the parent is not farther than the moving node
+        if (pq->nodes[parent].distance <= moving.distance) break;
+        pq->nodes[index] = pq->nodes[parent];
+        index = parent;
     }
+    pq->nodes[index] = moving;
 }
 
 // Heapify down to maintain the heap property
 void heapify_down(PriorityQueue *pq, int index) {
-    // Initialize the smallest index as the current index
-    int smallest = index;
-    // Calculate the left and right child indices
-    int left = 2 * index + 1;
-    int right = 2 * index + 2;
-
-    // If the left child exists and its distance is less than the smallest distance
-    if (left < pq->size && pq->nodes[left].distance < pq->nodes[smallest].distance) {
-        // Update the smallest index to the left child
-        smallest = left;
-    }
-    // If the right child exists and its distance is less than the smallest distance
-    if (right < pq->size && pq->nodes[right].distance < pq->nodes[smallest].distance) {
-        // Update the smallest index to the right child
-        smallest = right;
-    }
-    // If the smallest index is not the current index
-    if (smallest != index) {
-        // Swap the current node with the smallest node
-        swap(&pq->nodes[index], &pq->nodes[smallest]);
-        // Recursively heapify down the smallest node
-        heapify_down(pq, smallest);
+    // Lift the node out and move the closest child up into the hole until its place is found
+    PriorityQueueNode moving = pq->nodes[index];
+    while (1) {
+        int first = PQ_ARITY * index + 1;
+        if (first >= pq->size) break;
+        int last = first + PQ_ARITY < pq->size ? first + PQ_ARITY : pq->size;
+        // Find the closest of the (up to PQ_ARITY) children
+        int smallest = first;
+        for (int child = first + 1; child < last; child++) {
+            if (pq->nodes[child].distance < pq->nodes[smallest].distance) smallest = child;
+        }
+        // Stop once no child is closer than the moving node
+        if (pq->nodes[smallest].distance >= moving.distance) break;
+        pq->nodes[index] = pq->nodes[smallest];
+        index = smallest;
     }
+    pq->nodes[index] = moving;
 }
 
 // Create a priority queue with a given capacity
 PriorityQueue* create_priority_queue(int capacity) {
     // Allocate memory for the priority queue
     PriorityQueue *pq = (PriorityQueue *)malloc(sizeof(PriorityQueue));
+    init_priority_queue(pq, capacity);
+    // Return the created priority queue
+    return pq;
+}
+
+// Initialize a priority queue embedded in another structure
+void init_priority_queue(PriorityQueue *pq, int capacity) {
+    if (capacity < 1) capacity = 1;
     // Allocate memory for the nodes in the priority queue
     pq->nodes = (PriorityQueueNode *)malloc(sizeof(PriorityQueueNode) * capacity);
     // Set the capacity of the priority queue
     pq->capacity = capacity;
     // Initialize the size of the priority queue to 0
     pq->size = 0;
-    // Return the created priority queue
-    return pq;
+}
+
+// Free the nodes of a priority queue (not the queue structure itself)
+void free_priority_queue(PriorityQueue *pq) {
+    free(pq->nodes);
+    pq->nodes = NULL;
+    pq->capacity = 0;
+    pq->size = 0;
 }
 
 // Push a node with a given distance into the priority queue
-void priority_queue_push(PriorityQueue *pq, RTreeNode *node, float distance) {
+void priority_queue_push(PriorityQueue *pq, RTreeNode *node, dist_t distance) {
     // If the priority queue is full
     if (pq->size == pq->capacity) {
         // Double the capacity of the priority queue
@@ -88,6 +101,18 @@ void priority_queue_push(PriorityQueue *pq, RTreeNode *node, float distance) {
     pq->size++;
 }
 
+// Push an entry with a given distance into a priority queue of entries
+void priority_queue_push_entry(PriorityQueue *pq, Entry *entry, dist_t distance) {
+    if (pq->size == pq->capacity) {
+        pq->capacity *= 2;
+        pq->nodes = (PriorityQueueNode *)realloc(pq->nodes, sizeof(PriorityQueueNode) * pq->capacity);
+    }
+    pq->nodes[pq->size].entry = entry;
+    pq->nodes[pq->size].distance = distance;
+    heapify_up(pq, pq->size);
+    pq->size++;
+}
+
 // Pop the node with the smallest distance from the priority queue
 PriorityQueueNode priority_queue_pop(PriorityQueue *pq) {
     // Store the root node
@@ -97,7 +122,91 @@ PriorityQueueNode priority_queue_pop(PriorityQueue *pq) {
     // Decrement the size of the priority queue
     pq->size--;
     // Heapify down to maintain the heap property
-    heapify_down(pq, 0);
+    if (pq->size > 0) heapify_down(pq, 0);
     // Return the root node
     return root;
-}
\ No newline at end of file
+}
+
+// Sift a result down until no child is farther than it
+void result_heap_sift_down(ResultHeap *heap, int index) {
+    ResultHeapNode moving = heap->nodes[index];
+    while (1) {
+        // Find the farther of the two children
+        int child = 2 * index + 1;
+        if (child >= heap->size) break;
+        if (child + 1 < heap->size && heap->nodes[child + 1].distance > heap->nodes[child].distance) child++;
+        // Stop once the moving result is at least as far as both children
+        if (heap->nodes[child].distance <= moving.distance) break;
+        heap->nodes[index] = heap->nodes[child];
+        index = child;
+    }
+    heap->nodes[index] = moving;
+}
+
+// Create a result heap keeping at most capacity results
+ResultHeap* create_result_heap(int capacity) {
+    // Allocate memory for the heap and its results
+    ResultHeap *heap = (ResultHeap *)malloc(sizeof(ResultHeap));
+    init_result_heap(heap, capacity);
+    return heap;
+}
+
+// Initialize a result heap embedded in another structure
+void init_result_heap(ResultHeap *heap, int capacity) {
+    heap->allocated = capacity > 0 ? capacity : 1;
+    heap->nodes = (ResultHeapNode *)malloc(sizeof(ResultHeapNode) * heap->allocated);
+    heap->capacity = capacity;
+    heap->size = 0;
+}
+
+// Free the results of a result heap (not the heap structure itself)
+void free_result_heap(ResultHeap *heap) {
+    free(heap->nodes);
+    heap->nodes = NULL;
+    heap->allocated = 0;
+    heap->capacity = 0;
+    heap->size = 0;
+}
+
+// Empty a result heap and set how many results it keeps, growing it only if needed
+void result_heap_reset(ResultHeap *heap, int capacity) {
+    if (capacity > heap->allocated) {
+        heap->allocated = capacity;
+        heap->nodes = (ResultHeapNode *)realloc(heap->nodes, sizeof(ResultHeapNode) * capacity);
+    }
+    heap->capacity = capacity;
+    heap->size = 0;
+}
+
+// Offer a result to the heap; it is kept if it is among the closest seen so far
+void result_heap_offer(ResultHeap *heap, Entry *entry, dist_t distance) {
+    if (heap->size < heap->capacity) {
+        // Not full yet: add the result and sift it up past closer parents
+        int index = heap->size++;
+        while (index > 0 && heap->nodes[(index - 1) / 2].distance < distance) {
+            heap->nodes[index] = heap->nodes[(index - 1) / 2];
+            index = (index - 1) / 2;
+        }
+        heap->nodes[index].entry = entry;
+        heap->nodes[index].distance = distance;
+    } else if (heap->capacity > 0 && distance < heap->nodes[0].distance) {
+        // Full: replace the farthest result
+        heap->nodes[0].entry = entry;
+        heap->nodes[0].distance = distance;
+        result_heap_sift_down(heap, 0);
+    }
+}
+
+// Get the distance a new result must beat to enter the heap
+dist_t result_heap_bound(ResultHeap *heap) {
+    // Until the heap is full any result is accepted
+    return heap->size < heap->capacity ? DIST_MAX : heap->nodes[0].distance;
+}
+
+// Pop the farthest result from the heap
+ResultHeapNode result_heap_pop(ResultHeap *heap) {
+    ResultHeapNode root = heap->nodes[0];
+    heap->nodes[0] = heap->nodes[--heap->size];
+    if (heap->size > 0) result_heap_sift_down(heap, 0);
+    return root;
+}
@@ -2,16 +2,25 @@
 #define PRIORITY_QUEUE_H
 
 #include <stdlib.h>
+#include "rtree_config.h"
 
-// Forward declaration of RTreeNode
+// Number of children per node of the priority queue heap; a 4-ary heap is
+// shallower than a binary one and compares siblings that share a cache line
+#define PQ_ARITY 4
+
+// Forward declarations of RTreeNode and Entry
 typedef struct RTreeNode RTreeNode;
+typedef struct Entry Entry;
 
 // Structure for a priority queue node
 typedef struct PriorityQueueNode {
-    // Pointer to the R-tree node
-    RTreeNode *node;
+    // Pointer to the R-tree node, or to an entry in a queue of entries
+    union {
+        RTreeNode *node;
+        Entry *entry;
+    };
     // Distance value for the priority queue
-    float distance;
+    dist_t distance;
 } PriorityQueueNode;
 
 // Structure for the priority queue
@@ -24,9 +33,39 @@ typedef struct PriorityQueue {
     int size;
 } PriorityQueue;
 
+// Structure for one result held by a result heap
+typedef struct ResultHeapNode {
+    // Pointer to the entry found
+    Entry *entry;
+    // Distance from the query point to the entry
+    dist_t distance;
+} ResultHeapNode;
+
+// Structure for a bounded max-heap keeping the closest results seen so far
+typedef struct ResultHeap {
+    // Array of results, farthest at the root
+    ResultHeapNode *nodes;
+    // Maximum number of results kept
+    int capacity;
+    // Number of results the array has room for
+    int allocated;
+    // Current number of results
+    int size;
+} ResultHeap;
+
 // Function declarations
 PriorityQueue* create_priority_queue(int capacity);
-void priority_queue_push(PriorityQueue *pq, RTreeNode *node, float distance);
+void init_priority_queue(PriorityQueue *pq, int capacity);
+void free_priority_queue(PriorityQueue *pq);
+void priority_queue_push(PriorityQueue *pq, RTreeNode *node, dist_t distance);
+void priority_queue_push_entry(PriorityQueue *pq, Entry *entry, dist_t distance);
 PriorityQueueNode priority_queue_pop(PriorityQueue *pq);
+ResultHeap* create_result_heap(int capacity);
+void init_result_heap(ResultHeap *heap, int capacity);
+void free_result_heap(ResultHeap *heap);
+void result_heap_reset(ResultHeap *heap, int capacity);
+void result_heap_offer(ResultHeap *heap, Entry *entry, dist_t distance);
+dist_t result_heap_bound(ResultHeap *heap);
+ResultHeapNode result_heap_pop(ResultHeap *heap);
 
 #endif // PRIORITY_QUEUE_H
\ No newline at end of file
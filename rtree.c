@@ -1,112 +1,932 @@
 #include "rtree.h"
 #include "priority_queue.h"
+#include "parallel_sort.h"
+#include "node_scan.h"
+#include "thread_pool.h"
+#include "paged_file.h"
 #include <float.h>
+#include <limits.h>
 #include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+// Number of nodes in the first slab of a pool
+#define FIRST_SLAB_NODES 64
+// Largest number of nodes allocated in a single slab
+#define MAX_SLAB_NODES 16384
+// Number of problems validate_tree prints before it only counts them
+#define VALIDATE_MAX_REPORTS 10
+// Batches smaller than this passing through a node of insert_batch collect
+// the node's new children on the stack rather than the heap
+#define BATCH_LOCAL_SIBLINGS 32
+
+// Add to a counter, or keep the larger value, when built with RTREE_STATS;
+// otherwise they compile to nothing and their arguments are never evaluated
+#ifdef RTREE_STATS
+#define STATS_ADD(counter, value) ((counter) += (value))
+#define STATS_MAX(counter, value) ((counter) = (value) > (counter) ? (value) : (counter))
+#else
+#define STATS_ADD(counter, value) ((void)0)
+#define STATS_MAX(counter, value) ((void)0)
+#endif
+
+#ifdef RTREE_STATS
+// Counters that search adds to on the calling thread, set by search_ctx
+static _Thread_local QueryStats *search_stats = NULL;
+#endif
+
+// An entry taken out of its node, used while redistributing entries
+typedef struct NodeSlot {
+    // Rectangle of the entry
+    Rect rect;
+    // Child node or user entry
+    NodeChild child;
+} NodeSlot;
+
+// Slot paired with the key it is ordered by during bulk loading and batch insertion
+typedef struct PackItem {
+    // Sort key (a center coordinate or a Hilbert index)
+    double key;
+    // Entry or child node to be packed into a node
+    NodeSlot slot;
+} PackItem;
+
+// Subtree considered by repack_subtrees, with the space it wastes
+typedef struct RepackCandidate {
+    // Overlap and dead space summed over the subtree's nodes
+    double waste;
+    // Root of the subtree
+    RTreeNode *node;
+} RepackCandidate;
+
+// Pair of subtrees, one from each tree of a join, left for one task of a
+// parallel join
+typedef struct JoinPair {
+    // Subtree of the first tree and its height above the leaves
+    RTreeNode *a;
+    int height_a;
+    // Subtree of the second tree and its height above the leaves
+    RTreeNode *b;
+    int height_b;
+    // Intersection of the two subtrees' rectangles
+    Rect window;
+} JoinPair;
+
+// Define the shared state of one spatial join
+typedef struct JoinJob {
+    // Function to call with each overlapping pair (join)
+    void (*callback)(Entry *, Entry *);
+    // Function to call with the worker index and each pair (parallel_join)
+    void (*worker_callback)(int, Entry *, Entry *);
+    // While collecting pairs for a parallel join, pairs of subtrees no
+    // taller than this are kept in pairs instead of being joined; -1 joins
+    // everything
+    int split_height;
+    // Collected pairs
+    JoinPair *pairs;
+    int num_pairs;
+    int pair_capacity;
+} JoinJob;
+
+// Define the shared state of loading a mapped paged file
+typedef struct PagedLoad {
+    // File being loaded
+    MappedTree *mt;
+    // One node per page, indexed by page number - 1, so every page's node
+    // is known without any allocation or coordination between threads
+    RTreeNode *nodes;
+    // One flag per page, set once its node is decoded; a damaged file that
+    // references a page twice is caught instead of decoding it twice
+    atomic_uchar *claimed;
+    // Entries for the leaves, handed out in runs of one leaf each
+    Entry *entries;
+    // Number of entries handed out so far
+    atomic_long next_entry;
+    // Whether the nodes remember their pages (see load_mapped_tree)
+    bool keep_pages;
+    // Pool decoding subtrees, or NULL to decode on the calling thread
+    ThreadPool *pool;
+    // Height of the subtrees decoded by one task each
+    int task_height;
+    // Set when a page does not fit the tree described by the header
+    atomic_bool corrupt;
+} PagedLoad;
+
 // Initializes a new R-tree node
-RTreeNode* init_node(bool is_leaf);
+RTreeNode* init_node(RTree *tree, bool is_leaf);
+
+// Returns a node to the tree's pool for reuse
+void release_node(RTree *tree, RTreeNode *node);
+
+// Allocates an entry owned by the tree
+Entry* alloc_entry(RTree *tree);
+
+// Returns a tree-owned entry to the tree for reuse
+void release_entry(RTree *tree, Entry *entry);
+
+// Appends a page number to a page list
+void page_list_push(PageList *list, uint64_t page);
+
+// Marks a node and its ancestors as changed since the last checkpoint
+void mark_dirty(RTreeNode *node);
 
 // Initializes a new R-tree
 RTree* init_tree();
 
+// Frees a tree together with all of its nodes
+void free_tree(RTree *tree);
+
+// Packs items into nodes bottom-up, one level at a time
+int pack_levels(RTree *tree, PackItem *items, int count, BulkLoadMethod method, int levels, int limit, NodeSlot *parents);
+
+// Builds a tree bottom-up from an array of entries
+RTree* bulk_load(Entry **entries, int count, BulkLoadMethod method);
+
+// Reads the rectangle of an entry of a node
+Rect entry_rect(RTreeNode *node, int i);
+
+// Writes the rectangle of an entry of a node
+void set_entry_rect(RTreeNode *node, int i, Rect *rect);
+
+// Appends a slot to a node
+void add_slot(RTreeNode *node, NodeSlot *slot);
+
 // Adds an entry to a node
 void add_entry(RTreeNode *node, Entry *entry);
 
+// Adds a child node to an internal node
+void add_child(RTreeNode *node, RTreeNode *child, Rect *rect);
+
+// Copies an entry of a node into a slot
+NodeSlot take_slot(RTreeNode *node, int i);
+
+// Removes an entry from a node, keeping the order of the others
+void remove_slot(RTreeNode *node, int i);
+
 // Computes the bounding box for a set of rectangles
 Rect bounding_box(Rect *rects, int count);
 
+// Computes the bounding box of all entries in a node
+Rect node_bounding_box(RTreeNode *node);
+
 // Computes the enlargement needed to include a new rectangle
-float enlargement(Rect *r1, Rect *r2);
+dist_t enlargement(Rect *r1, Rect *r2);
+
+// Computes the area of a rectangle
+dist_t rect_area(Rect *rect);
+
+// Computes the margin (half perimeter) of a rectangle
+dist_t rect_margin(Rect *rect);
+
+// Computes the area of the intersection of two rectangles
+dist_t overlap_area(Rect *r1, Rect *r2);
+
+// Computes the height of a node above the leaf level
+int node_height(RTreeNode *node);
+
+// Picks the entry of an internal node whose child best fits a new rectangle
+int choose_child_slot(RTreeNode *node, Rect *rect);
+
+// Picks the child of an internal node that best fits a new rectangle
+RTreeNode* choose_child(RTreeNode *node, Rect *rect);
 
 // Chooses the appropriate leaf node for insertion
 RTreeNode* choose_leaf(RTreeNode *node, Entry *entry);
 
+// Chooses the node at a given height that should receive a rectangle
+RTreeNode* choose_node(RTree *tree, Rect *rect, int height);
+
 // Splits a node into two nodes
 RTreeNode* split_node(RTree *tree, RTreeNode *node);
 
+// Finds the position of a node in its parent
+int child_index(RTreeNode *node);
+
+// Reinserts the entries farthest from the center of an overflowing node
+void reinsert_entries(RTree *tree, RTreeNode *node, int height);
+
 // Adjusts the tree after insertion
 void adjust_tree(RTree *tree, RTreeNode *node);
 
 // Checks if two rectangles overlap
 bool overlap(Rect *r1, Rect *r2);
 
+// Checks if a rectangle is a single point
+bool is_point(Rect *rect);
+
+// Checks if an entry of a node overlaps a rectangle
+bool entry_overlaps(RTreeNode *node, int i, Rect *rect);
+
 // Searches the tree for entries that overlap with a given rectangle
 void search(RTreeNode *node, Rect *rect, void (*callback)(Entry *));
 
+// Searches the tree for entries that overlap a rectangle, counting the work
+void search_ctx(QueryContext *ctx, RTree *tree, Rect *rect, void (*callback)(Entry *));
+
 // Finds the leaf node containing a specific entry
 RTreeNode* find_leaf(RTreeNode *node, Entry *entry);
 
+// Enlarges the rectangles of a node's ancestors to cover a new rectangle
+void enlarge_ancestors(RTreeNode *node, Rect *rect);
+
+// Refreshes the rectangles above a node after its entries changed
+void refresh_ancestors(RTreeNode *node);
+
+// Inserts a slot into a node at a given height above the leaves
+void insert_at_height(RTree *tree, NodeSlot *slot, int height);
+
 // Inserts an entry into the tree
 void insert(RTree *tree, Entry *entry);
 
-// Condenses the tree after deletion
-void condense_tree(RTree *tree, RTreeNode *node);
+// Moves the item that belongs at an index under a sort by key to that index
+void select_pack_items(PackItem *items, int count, int k);
+
+// Fills one node per group of items, grouping them by recursive halving
+void pack_groups(RTree *tree, PackItem *items, int total, int groups, int first_group, int end_group,
+                 RTreeNode *first, bool is_leaf, PackItem *out, int *num_out);
+
+// Adds items to a node, spreading them over new siblings if it overflows
+int settle_node(RTree *tree, RTreeNode *node, PackItem *extra, int num_extra, PackItem *out);
+
+// Inserts a batch of items into a subtree, one visit per node
+int insert_batch_node(RTree *tree, RTreeNode *node, PackItem *items, int count, PackItem *scratch, int *which, PackItem *out);
+
+// Inserts many entries at once, sharing the descent and the splits
+int insert_batch(RTree *tree, Entry **entries, int count);
+
+// Compares two node pointers by address, for sorting
+int compare_node_pointers(const void *a, const void *b);
+
+// Reinserts every leaf entry of a subtree and releases its nodes
+void reinsert_subtree_entries(RTree *tree, RTreeNode *node);
+
+// Condenses the tree after entries were removed from some nodes of one level
+void condense_tree(RTree *tree, RTreeNode **touched, int count, int height);
+
+// Removes an entry from its leaf without condensing the tree
+RTreeNode* remove_entry(RTree *tree, Entry *entry);
 
 // Deletes an entry from the tree
 void delete_entry(RTree *tree, Entry *entry);
 
+// Deletes several entries, condensing the tree once for the whole batch
+int delete_batch(RTree *tree, Entry **entries, int count);
+
+// Checks whether a rectangle lies within the rectangle of a node's slot
+bool entry_covers(RTreeNode *node, int i, Rect *rect);
+
+// Moves an entry to a new rectangle
+bool update_entry(RTree *tree, Entry *entry, Rect *rect);
+
+// Reports a problem found by validate_tree
+void report_problem(long *problems, const char *message, RTreeNode *node);
+
+// Checks the structure of a subtree
+long validate_node(RTree *tree, RTreeNode *node, int depth, int *leaf_depth, long *problems);
+
+// Checks the structure of a tree
+long validate_tree(RTree *tree);
+
+// Reads the query counters of a tree
+QueryStats tree_query_stats(RTree *tree);
+
+// Clears the query and insert counters of a tree
+void reset_tree_stats(RTree *tree);
+
+// Adds the nodes and entries of a subtree to a tree shape
+void measure_node(RTreeNode *node, int depth, TreeShape *shape);
+
+// Measures the height and fill of a tree
+TreeShape tree_shape(RTree *tree);
+
+// Measures the area a node's entries share and the area none of them covers
+void measure_waste(RTreeNode *node, Rect *rect, double *overlap, double *dead_space);
+
+// Adds the nodes of a subtree to a tree quality report
+void measure_quality(RTreeNode *node, Rect *rect, int height, TreeQuality *quality);
+
+// Measures fill, overlap and dead space per level of a tree
+TreeQuality analyze_tree(RTree *tree);
+
+// Counts the entries in the leaves of a subtree
+int count_subtree_entries(RTreeNode *node);
+
+// Moves the leaf entries of a subtree into pack items and releases its nodes
+void take_subtree_items(RTree *tree, RTreeNode *node, PackItem *items, int *count);
+
+// Repacks a whole tree bottom-up
+void rebuild_tree(RTree *tree);
+
+// Sums the overlap and dead space of every node of a subtree
+double subtree_waste(RTreeNode *node, Rect *rect);
+
+// Collects the subtrees at a given height with the space they waste
+void collect_repack_candidates(RTreeNode *node, int node_height, int height, RepackCandidate **candidates, int *count, int *capacity);
+
+// Compares two repack candidates, most waste first
+int compare_repack_candidates(const void *a, const void *b);
+
+// Repacks the subtrees at a given height that waste the most space
+int repack_subtrees(RTree *tree, int height, int count);
+
 // Computes the minimum distance from a point to a rectangle
-float min_distance(Rect *rect, float point[2]);
+dist_t min_distance(Rect *rect, coord_t point[RTREE_DIMS]);
+
+// Creates a reusable query context
+QueryContext* create_query_context(void);
+
+// Adds the work of one query to a context's and a tree's counters
+void add_query_stats(QueryContext *ctx, RTree *tree, QueryStats *stats);
+
+// Frees a query context
+void free_query_context(QueryContext *ctx);
+
+// Finds the nearest neighbor to a given point using a query context
+Entry* nearest_neighbor_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS]);
 
 // Finds the nearest neighbor to a given point
-Entry* nearest_neighbor(RTree *tree, float point[2]);
+Entry* nearest_neighbor(RTree *tree, coord_t point[RTREE_DIMS]);
+
+// Finds the k nearest neighbors of a point using a query context
+int knn_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out);
+
+// Finds the k nearest neighbors of a point
+int knn(RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out);
+
+// Finds an approximate nearest neighbor to a given point using a query context
+Entry* nearest_neighbor_approx_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS],
+                                   const NearestOptions *options, bool *exact);
+
+// Finds an approximate nearest neighbor to a given point
+Entry* nearest_neighbor_approx(RTree *tree, coord_t point[RTREE_DIMS], const NearestOptions *options, bool *exact);
+
+// Finds approximate k nearest neighbors of a point using a query context
+int knn_approx_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out,
+                   const NearestOptions *options, bool *exact);
+
+// Finds approximate k nearest neighbors of a point
+int knn_approx(RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out, const NearestOptions *options, bool *exact);
+
+// Returns the factor squared distances are scaled by before pruning
+dist_t approx_scale(const NearestOptions *options);
+
+// Creates a cursor that returns the entries of a tree nearest first
+NearestCursor* create_nearest_cursor(RTree *tree, coord_t point[RTREE_DIMS]);
+
+// Starts a cursor over again, possibly on another tree or point
+void nearest_cursor_restart(NearestCursor *cursor, RTree *tree, coord_t point[RTREE_DIMS]);
+
+// Returns the next entry of a cursor in order of distance
+Entry* nearest_cursor_next(NearestCursor *cursor, dist_t *distance);
+
+// Frees a cursor
+void free_nearest_cursor(NearestCursor *cursor);
+
+// Reports the entries of a subtree within a squared distance of a point
+void within_distance_node(RTreeNode *node, coord_t point[RTREE_DIMS], dist_t radius2, void (*callback)(Entry *));
+
+// Reports every entry within a distance of a point
+void within_distance(RTree *tree, coord_t point[RTREE_DIMS], dist_t radius, void (*callback)(Entry *));
+
+// Compares two query keys by key
+int compare_query_keys(const void *a, const void *b);
+
+// Orders queries along a Hilbert curve through their centers
+int* order_queries(double (*centers)[RTREE_DIMS], int count);
+
+// Runs the active queries of a batch against one node and its subtree
+void search_batch_node(RTreeNode *node, Rect *rects, int *active, int num_active, NodeMask *masks, int stride, void (*callback)(int, Entry *));
+
+// Searches the tree for entries overlapping each of a batch of rectangles
+void search_batch(RTree *tree, Rect *rects, int count, void (*callback)(int, Entry *));
+
+// Finds the nearest neighbor of each of a batch of points
+void nearest_neighbor_batch(RTree *tree, coord_t (*points)[RTREE_DIMS], int count, Entry **out);
+
+// Intersects two overlapping rectangles
+Rect intersect_rects(Rect *r1, Rect *r2);
+
+// Joins two subtrees whose rectangles overlap
+void join_nodes(JoinJob *job, RTreeNode *a, int height_a, RTreeNode *b, int height_b, Rect *window, int worker);
+
+// Reports every pair of overlapping entries from two trees
+void join(RTree *tree_a, RTree *tree_b, void (*callback)(Entry *, Entry *));
+
+// Finds the height at which work is split into tasks of about a grain of entries
+int task_height_for_grain(int fanout, int grain);
+
+// Searches a subtree on the calling worker, reporting its index with each entry
+void search_subtree(RTreeNode *node, Rect *rect, void (*callback)(int, Entry *), int worker);
+
+// Runs one subtree of a parallel search as a pool task
+void parallel_search_task(ThreadPool *pool, void *arg, void *item);
+
+// Searches the tree for entries overlapping a rectangle using a thread pool
+void parallel_search(RTree *tree, ThreadPool *pool, Rect *rect, void (*callback)(int, Entry *));
 
-// Saves a node to a file
-void save_node(FILE *file, RTreeNode *node);
+// Joins one pair of subtrees of a parallel join as a pool task
+void parallel_join_task(ThreadPool *pool, void *arg, void *item);
+
+// Reports every pair of overlapping entries from two trees using a thread pool
+void parallel_join(RTree *tree_a, RTree *tree_b, ThreadPool *pool, void (*callback)(int, Entry *, Entry *));
+
+// Writes a subtree to a paged file
+uint64_t save_paged_node(FILE *file, RTreeNode *node, DiskNode *page, uint64_t *next_page, uint64_t *entry_count);
+
+// Copies the page of a node and, below the task height, its subtree
+void decode_paged_node(PagedLoad *job, RTreeNode *node, int height);
+
+// Decodes one subtree of a parallel load as a pool task
+void load_paged_task(ThreadPool *pool, void *arg, void *item);
+
+// Copies a mapped paged file into a new tree
+RTree* load_mapped_tree(MappedTree *mt, bool keep_pages, ThreadPool *pool);
 
 // Saves the tree to a file
 void save_tree(RTree *tree, const char *filename);
 
 // Loads a node from a file
-RTreeNode* load_node(FILE *file);
+RTreeNode* load_node(RTree *tree, FILE *file, bool *not_points);
 
 // Loads the tree from a file
 RTree* load_tree(const char *filename);
 
+// Loads the tree from a file, decoding subtrees on a thread pool
+RTree* load_tree_parallel(const char *filename, ThreadPool *pool);
+
 // Initializes a new R-tree node
+// tree: pointer to the R-tree whose pool provides the memory
 // is_leaf: boolean indicating if the node is a leaf
 // Returns a pointer to the newly created R-tree node
-RTreeNode* init_node(bool is_leaf) {
-    // Allocate memory for a new R-tree node
-    RTreeNode *node = (RTreeNode *)malloc(sizeof(RTreeNode));
+RTreeNode* init_node(RTree *tree, bool is_leaf) {
+    // Leaves and internal nodes come from separate slabs, as leaves may be smaller
+    NodeSlab **slabs = is_leaf ? &tree->pool.leaf_slabs : &tree->pool.slabs;
+    RTreeNode **free_nodes = is_leaf ? &tree->pool.free_leaves : &tree->pool.free_nodes;
+    size_t node_size = is_leaf ? LEAF_NODE_SIZE : sizeof(RTreeNode);
+    RTreeNode *node;
+    if (*free_nodes) {
+        // Reuse a released node
+        node = *free_nodes;
+        *free_nodes = node->parent;
+    } else {
+        // Start a new slab, twice as large as the last one, when the current one is full
+        NodeSlab *slab = *slabs;
+        if (!slab || slab->used == slab->capacity) {
+            int capacity = slab ? slab->capacity * 2 : FIRST_SLAB_NODES;
+            if (capacity > MAX_SLAB_NODES) capacity = MAX_SLAB_NODES;
+            slab = (NodeSlab *)malloc(sizeof(NodeSlab) + node_size * capacity);
+            slab->next = *slabs;
+            slab->capacity = capacity;
+            slab->used = 0;
+            slab->node_size = node_size;
+            *slabs = slab;
+        }
+        // Hand out the next node of the slab
+        node = (RTreeNode *)((char *)slab->nodes + node_size * slab->used++);
+    }
     // Set the is_leaf property of the node
     node->is_leaf = is_leaf;
     // Initialize the number of entries in the node to 0
     node->num_entries = 0;
     // Set the parent of the node to NULL
     node->parent = NULL;
+    // The node has never been written to a page
+    node->page = 0;
+    node->dirty = true;
     // Return the newly created node
     return node;
 }
 
+// Returns a node to the tree's pool for reuse
+// tree: pointer to the R-tree owning the node
+// node: pointer to the node, which must no longer be referenced by the tree
+void release_node(RTree *tree, RTreeNode *node) {
+    // Its page, if any, can be reused once a checkpoint no longer references it
+    if (node->page != 0) page_list_push(&tree->released_pages, node->page);
+    // Push the node onto the free list, linked through its parent pointer.
+    // An internal node that became a leaf is big enough to be reused as one.
+    RTreeNode **free_nodes = node->is_leaf ? &tree->pool.free_leaves : &tree->pool.free_nodes;
+    node->parent = *free_nodes;
+    *free_nodes = node;
+}
+
+// Allocates an entry owned by the tree
+// tree: pointer to the R-tree
+// Returns a pointer to an entry that lives until the tree is freed
+Entry* alloc_entry(RTree *tree) {
+    NodePool *pool = &tree->pool;
+    if (pool->free_entries) {
+        // Reuse a released entry
+        Entry *entry = pool->free_entries;
+        pool->free_entries = (Entry *)entry->data;
+        return entry;
+    }
+    EntrySlab *slab = pool->entry_slabs;
+    // Start a new slab when the current one is full
+    if (!slab || slab->used == slab->capacity) {
+        int capacity = slab ? slab->capacity * 2 : FIRST_SLAB_NODES * MAX_ENTRIES;
+        // A loaded tree's first slab is sized to fit and may even be empty
+        if (capacity < FIRST_SLAB_NODES * MAX_ENTRIES) capacity = FIRST_SLAB_NODES * MAX_ENTRIES;
+        if (capacity > MAX_SLAB_NODES * MAX_ENTRIES) capacity = MAX_SLAB_NODES * MAX_ENTRIES;
+        slab = (EntrySlab *)malloc(sizeof(EntrySlab) + sizeof(Entry) * capacity);
+        slab->next = pool->entry_slabs;
+        slab->capacity = capacity;
+        slab->used = 0;
+        pool->entry_slabs = slab;
+    }
+    return &slab->entries[slab->used++];
+}
+
+// Returns a tree-owned entry to the tree for reuse
+// tree: pointer to the R-tree that allocated the entry
+// entry: pointer to the entry, which must no longer be in the tree
+void release_entry(RTree *tree, Entry *entry) {
+    // Push the entry onto the free list, linked through its data pointer
+    entry->data = tree->pool.free_entries;
+    tree->pool.free_entries = entry;
+}
+
+// Appends a page number to a page list, growing it as needed
+// list: pointer to the list
+// page: page number to append
+void page_list_push(PageList *list, uint64_t page) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->pages = (uint64_t *)realloc(list->pages, sizeof(uint64_t) * list->capacity);
+    }
+    list->pages[list->count++] = page;
+}
+
+// Marks a node and its ancestors as changed since the last checkpoint
+// node: pointer to the node that changed
+void mark_dirty(RTreeNode *node) {
+    // Stop at the first dirty ancestor: everything above it is dirty already
+    while (node != NULL && !node->dirty) {
+        node->dirty = true;
+        node = node->parent;
+    }
+}
+
 // Initializes a new R-tree
 // Returns a pointer to the newly created R-tree
 RTree* init_tree() {
     // Allocate memory for a new R-tree
     RTree *tree = (RTree *)malloc(sizeof(RTree));
+    // Start with an empty node pool
+    tree->pool.slabs = NULL;
+    tree->pool.free_nodes = NULL;
+    tree->pool.leaf_slabs = NULL;
+    tree->pool.free_leaves = NULL;
+    tree->pool.entry_slabs = NULL;
+    tree->pool.free_entries = NULL;
+    // No node has been written to a page yet
+    tree->released_pages.pages = NULL;
+    tree->released_pages.count = 0;
+    tree->released_pages.capacity = 0;
+    // Start counting from zero
+    reset_tree_stats(tree);
     // Initialize the root of the tree as a leaf node
-    tree->root = init_node(true);
+    tree->root = init_node(tree, true);
     // Set the maximum number of entries in a node
     tree->max_entries = MAX_ENTRIES;
     // Set the minimum number of entries in a node
     tree->min_entries = MIN_ENTRIES;
+    // Split overflowing nodes with Guttman's quadratic algorithm by default
+    tree->split_policy = SPLIT_QUADRATIC;
+    tree->reinserted_levels = 0;
+    // New trees can be modified
+    tree->read_only = false;
     // Return the newly created tree
     return tree;
 }
 
-// Adds an entry to a node
+// Frees a tree together with all of its nodes
+// tree: pointer to the R-tree
+// Entries passed to insert() belong to the caller and are not freed
+void free_tree(RTree *tree) {
+    // Free the node slabs; this releases every node without walking the tree
+    NodeSlab *chains[2] = {tree->pool.slabs, tree->pool.leaf_slabs};
+    for (int c = 0; c < 2; c++) {
+        NodeSlab *slab = chains[c];
+        while (slab) {
+            NodeSlab *next = slab->next;
+            free(slab);
+            slab = next;
+        }
+    }
+    // Free the entries the tree allocated itself
+    EntrySlab *entry_slab = tree->pool.entry_slabs;
+    while (entry_slab) {
+        EntrySlab *next = entry_slab->next;
+        free(entry_slab);
+        entry_slab = next;
+    }
+    free(tree->released_pages.pages);
+    free(tree);
+}
+
+// Compares two pack items by key
+// Returns a negative, zero or positive value as for qsort
+int compare_pack_items(const void *a, const void *b) {
+    double ka = ((const PackItem *)a)->key;
+    double kb = ((const PackItem *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+// Computes the position of a grid cell along a Hilbert curve
+// cell: cell coordinates in [0, 2^bits), one per dimension; overwritten
+// bits: number of bits per coordinate
+// Returns the distance of the cell along the curve
+uint64_t hilbert_index(uint32_t cell[RTREE_DIMS], int bits) {
+    // Convert the coordinates to the transposed Hilbert index (Skilling's method)
+    uint32_t top = (uint32_t)1 << (bits - 1);
+    for (uint32_t q = top; q > 1; q >>= 1) {
+        uint32_t p = q - 1;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            if (cell[j] & q) {
+                // Invert the low bits of the first coordinate
+                cell[0] ^= p;
+            } else {
+                // Exchange the low bits of the first and current coordinates
+                uint32_t t = (cell[0] ^ cell[j]) & p;
+                cell[0] ^= t;
+                cell[j] ^= t;
+            }
+        }
+    }
+    // Gray encode
+    for (int j = 1; j < RTREE_DIMS; j++) {
+        cell[j] ^= cell[j - 1];
+    }
+    uint32_t t = 0;
+    for (uint32_t q = top; q > 1; q >>= 1) {
+        if (cell[RTREE_DIMS - 1] & q) t ^= q - 1;
+    }
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        cell[j] ^= t;
+    }
+    // Interleave the bits, most significant first
+    uint64_t d = 0;
+    for (int b = bits - 1; b >= 0; b--) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            d = (d << 1) | ((cell[j] >> b) & 1);
+        }
+    }
+    return d;
+}
+
+// Packs a run of ordered items into nodes holding at most max_entries entries
+// tree: pointer to the R-tree providing the nodes
+// items: ordered items to pack
+// count: number of items in the run
+// is_leaf: whether the created nodes are leaves
+// parents: output array receiving one parent slot per created node
+// num_parents: number of parent slots already in the output array
+// Returns the new number of parent slots
+int pack_run(RTree *tree, PackItem *items, int count, bool is_leaf, NodeSlot *parents, int num_parents) {
+    // Spread the items evenly so no node ends up underfull
+    int groups = (count + tree->max_entries - 1) / tree->max_entries;
+    for (int g = 0; g < groups; g++) {
+        int start = (int)((long long)g * count / groups);
+        int end = (int)((long long)(g + 1) * count / groups);
+        // Fill a new node with the items of this group
+        RTreeNode *node = init_node(tree, is_leaf);
+        for (int i = start; i < end; i++) {
+            add_slot(node, &items[i].slot);
+        }
+        // Create the parent slot pointing to the node
+        parents[num_parents].rect = node_bounding_box(node);
+        parents[num_parents].child.node = node;
+        num_parents++;
+    }
+    return num_parents;
+}
+
+// Packs one level of the tree using Sort-Tile-Recursive ordering
+// tree: pointer to the R-tree providing the nodes
+// items: items of the level, reordered in place
+// count: number of items
+// axis: axis to slice along; later axes are handled recursively
+// is_leaf: whether the created nodes are leaves
+// parents: output array receiving one parent slot per created node
+// num_parents: number of parent slots already in the output array
+// Returns the new number of parent slots
+int pack_str(RTree *tree, PackItem *items, int count, int axis, bool is_leaf, NodeSlot *parents, int num_parents) {
+    // Sort the items by the center coordinate along this axis
+    for (int i = 0; i < count; i++) {
+        items[i].key = (double)items[i].slot.rect.min[axis] + items[i].slot.rect.max[axis];
+    }
+    parallel_sort(items, (size_t)count, sizeof(PackItem), compare_pack_items);
+    // Along the last axis, the sorted run is packed directly into nodes
+    if (axis == RTREE_DIMS - 1) {
+        return pack_run(tree, items, count, is_leaf, parents, num_parents);
+    }
+    // Otherwise cut it into slabs, one per node count^(1/remaining axes), and tile each slab
+    int nodes = (count + tree->max_entries - 1) / tree->max_entries;
+    int slices = (int)ceil(pow((double)nodes, 1.0 / (RTREE_DIMS - axis)));
+    for (int s = 0; s < slices; s++) {
+        int start = (int)((long long)s * count / slices);
+        int end = (int)((long long)(s + 1) * count / slices);
+        if (end > start) {
+            num_parents = pack_str(tree, items + start, end - start, axis + 1, is_leaf, parents, num_parents);
+        }
+    }
+    return num_parents;
+}
+
+// Orders items along a Hilbert curve through the centers of their rectangles
+// items: items to reorder in place
+// count: number of items
+void order_hilbert(PackItem *items, int count) {
+    // Find the extent of the rectangle centers
+    double lo[RTREE_DIMS], hi[RTREE_DIMS];
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        lo[j] = DBL_MAX;
+        hi[j] = -DBL_MAX;
+    }
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double c = ((double)items[i].slot.rect.min[j] + items[i].slot.rect.max[j]) / 2.0;
+            if (c < lo[j]) lo[j] = c;
+            if (c > hi[j]) hi[j] = c;
+        }
+    }
+    // Map each center onto a grid and take its Hilbert index; the index must fit
+    // in the 53-bit mantissa of the sort key
+    const int bits = 52 / RTREE_DIMS < 16 ? 52 / RTREE_DIMS : 16;
+    const double cells = (double)((1u << bits) - 1);
+    for (int i = 0; i < count; i++) {
+        uint32_t cell[RTREE_DIMS];
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double c = ((double)items[i].slot.rect.min[j] + items[i].slot.rect.max[j]) / 2.0;
+            double extent = hi[j] - lo[j];
+            cell[j] = extent > 0.0 ? (uint32_t)((c - lo[j]) / extent * cells) : 0;
+        }
+        items[i].key = (double)hilbert_index(cell, bits);
+    }
+    parallel_sort(items, (size_t)count, sizeof(PackItem), compare_pack_items);
+}
+
+// Packs items into nodes bottom-up, one level at a time
+// tree: pointer to the R-tree providing the nodes
+// items: leaf entries to pack; the array is reused for the upper levels
+// count: number of items
+// method: ordering used to group items into nodes
+// levels: maximum number of levels to build, counting the leaves
+// limit: stop once a level has at most this many nodes
+// parents: output array, at least count long, receiving the top level's slots
+// Returns the number of nodes in the top level built
+int pack_levels(RTree *tree, PackItem *items, int count, BulkLoadMethod method, int levels, int limit, NodeSlot *parents) {
+    // Hilbert order is computed once; upper levels inherit it from the leaves
+    if (method == BULK_LOAD_HILBERT) {
+        order_hilbert(items, count);
+    }
+
+    bool is_leaf = true;
+    int level_count = count;
+    for (int level = 1; ; level++) {
+        int num_parents;
+        if (method == BULK_LOAD_STR) {
+            num_parents = pack_str(tree, items, level_count, 0, is_leaf, parents, 0);
+        } else {
+            num_parents = pack_run(tree, items, level_count, is_leaf, parents, 0);
+        }
+        if (num_parents <= limit || level == levels) return num_parents;
+        // The parent slots become the items of the next level
+        for (int i = 0; i < num_parents; i++) {
+            items[i].slot = parents[i];
+        }
+        level_count = num_parents;
+        is_leaf = false;
+    }
+}
+
+// Builds a tree bottom-up from an array of entries
+// entries: array of pointers to the entries to be stored in the leaves; in a
+// point build (RTREE_POINTS) entries that aren't points are skipped
+// count: number of entries in the array
+// method: ordering used to group entries into nodes
+// Returns a pointer to the newly created R-tree
+RTree* bulk_load(Entry **entries, int count, BulkLoadMethod method) {
+    // Start from an empty tree so the node limits are set as usual
+    RTree *tree = init_tree();
+    if (count <= 0) return tree;
+
+    // Copy the entries into the working array
+    PackItem *items = (PackItem *)malloc(sizeof(PackItem) * count);
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+#ifdef RTREE_POINTS
+        if (!is_point(&entries[i]->rect)) continue;
+#endif
+        items[n].slot.rect = entries[i]->rect;
+        items[n].slot.child.entry = entries[i];
+        n++;
+    }
+    if (n < count) fprintf(stderr, "%d entries are not points, insert ignored\n", count - n);
+    if (n == 0) {
+        free(items);
+        return tree;
+    }
+    count = n;
+    // Parent slots of the level being built (STR slices may each round up, so
+    // size the array for the worst case rather than count / max_entries)
+    NodeSlot *parents = (NodeSlot *)malloc(sizeof(NodeSlot) * count);
+
+    // Pack one level at a time until a single node remains
+    pack_levels(tree, items, count, method, INT_MAX, 1, parents);
+
+    // Replace the empty root with the top packed node
+    release_node(tree, tree->root);
+    tree->root = parents[0].child.node;
+    free(parents);
+    free(items);
+    return tree;
+}
+
+// Reads the rectangle of an entry of a node
+// node: pointer to the R-tree node
+// i: index of the entry
+// Returns the entry's rectangle
+Rect entry_rect(RTreeNode *node, int i) {
+    Rect rect;
+    coord_t (*max)[MAX_ENTRIES + 1] = NODE_MAX_ARRAYS(node);
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        rect.min[j] = node->min[j][i];
+        rect.max[j] = max[j][i];
+    }
+    return rect;
+}
+
+// Writes the rectangle of an entry of a node
+// node: pointer to the R-tree node
+// i: index of the entry
+// rect: pointer to the new rectangle
+void set_entry_rect(RTreeNode *node, int i, Rect *rect) {
+    mark_dirty(node);
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        node->min[j][i] = rect->min[j];
+        if (NODE_HAS_MAX(node)) node->max[j][i] = rect->max[j];
+    }
+}
+
+// Appends a slot to a node
+// node: pointer to the R-tree node
+// slot: pointer to the slot to be added
+void add_slot(RTreeNode *node, NodeSlot *slot) {
+    mark_dirty(node);
+    int i = node->num_entries++;
+    // Store the rectangle inline and keep the child or entry alongside it
+    set_entry_rect(node, i, &slot->rect);
+    node->child[i] = slot->child;
+    // If the slot holds a child node, set its parent to the current node
+    if (!node->is_leaf) {
+        slot->child.node->parent = node;
+    }
+}
+
+// Adds an entry to a leaf node
 // node: pointer to the R-tree node
 // entry: pointer to the entry to be added
 void add_entry(RTreeNode *node, Entry *entry) {
-    // Add the entry to the node's entries array
-    node->entries[node->num_entries++] = entry;
-    // If the entry has a child node, set its parent to the current node
-    if (entry->child != NULL) {
-        entry->child->parent = node;
+    NodeSlot slot = {entry->rect, {.entry = entry}};
+    add_slot(node, &slot);
+}
+
+// Adds a child node to an internal node
+// node: pointer to the internal node
+// child: pointer to the child node
+// rect: pointer to the bounding rectangle of the child
+void add_child(RTreeNode *node, RTreeNode *child, Rect *rect) {
+    NodeSlot slot = {*rect, {.node = child}};
+    add_slot(node, &slot);
+}
+
+// Copies an entry of a node into a slot
+// node: pointer to the R-tree node
+// i: index of the entry
+// Returns the slot holding the entry's rectangle and child
+NodeSlot take_slot(RTreeNode *node, int i) {
+    NodeSlot slot = {entry_rect(node, i), node->child[i]};
+    return slot;
+}
+
+// Removes an entry from a node, keeping the order of the others
+// node: pointer to the R-tree node
+// i: index of the entry to remove
+void remove_slot(RTreeNode *node, int i) {
+    mark_dirty(node);
+    for (int k = i; k < node->num_entries - 1; k++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            node->min[j][k] = node->min[j][k + 1];
+            if (NODE_HAS_MAX(node)) node->max[j][k] = node->max[j][k + 1];
+        }
+        node->child[k] = node->child[k + 1];
     }
+    node->num_entries--;
 }
 
 // Computes the bounding box for a set of rectangles
@@ -115,11 +935,15 @@ void add_entry(RTreeNode *node, Entry *entry) {
 // Returns the bounding box that contains all the rectangles
 Rect bounding_box(Rect *rects, int count) {
     // Initialize the bounding box with extreme values
-    Rect bbox = {{FLT_MAX, FLT_MAX}, {-FLT_MAX, -FLT_MAX}};
+    Rect bbox;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        bbox.min[j] = COORD_MAX;
+        bbox.max[j] = -COORD_MAX;
+    }
     // Iterate over each rectangle
     for (int i = 0; i < count; i++) {
         // Update the bounding box to include the current rectangle
-        for (int j = 0; j < 2; j++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
             if (rects[i].min[j] < bbox.min[j]) bbox.min[j] = rects[i].min[j];
             if (rects[i].max[j] > bbox.max[j]) bbox.max[j] = rects[i].max[j];
         }
@@ -128,66 +952,506 @@ Rect bounding_box(Rect *rects, int count) {
     return bbox;
 }
 
+// Computes the bounding box of all entries in a node
+// node: pointer to the R-tree node
+// Returns the bounding box that contains every entry of the node
+Rect node_bounding_box(RTreeNode *node) {
+    // Initialize the bounding box with extreme values
+    Rect bbox;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        bbox.min[j] = COORD_MAX;
+        bbox.max[j] = -COORD_MAX;
+    }
+    // Extend the bounding box axis by axis over the inline rectangles
+    coord_t (*max)[MAX_ENTRIES + 1] = NODE_MAX_ARRAYS(node);
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        for (int i = 0; i < node->num_entries; i++) {
+            if (node->min[j][i] < bbox.min[j]) bbox.min[j] = node->min[j][i];
+            if (max[j][i] > bbox.max[j]) bbox.max[j] = max[j][i];
+        }
+    }
+    // Return the computed bounding box
+    return bbox;
+}
+
 // Computes the enlargement needed to include a new rectangle
 // r1: pointer to the first rectangle
 // r2: pointer to the second rectangle
 // Returns the enlargement area needed to include both rectangles
-float enlargement(Rect *r1, Rect *r2) {
+dist_t enlargement(Rect *r1, Rect *r2) {
     // Compute the bounding box that includes both rectangles
     Rect bbox = bounding_box((Rect[]){*r1, *r2}, 2);
     // Compute the area of the first rectangle
-    float area1 = (r1->max[0] - r1->min[0]) * (r1->max[1] - r1->min[1]);
+    dist_t area1 = rect_area(r1);
     // Compute the area of the bounding box
-    float area2 = (bbox.max[0] - bbox.min[0]) * (bbox.max[1] - bbox.min[1]);
+    dist_t area2 = rect_area(&bbox);
     // Return the difference between the bounding box area and the first rectangle area
     return area2 - area1;
 }
 
-// Chooses the appropriate leaf node for insertion
-// node: pointer to the current R-tree node
-// entry: pointer to the entry to be inserted
-// Returns the leaf node where the entry should be inserted
-RTreeNode* choose_leaf(RTreeNode *node, Entry *entry) {
-    // If the current node is a leaf, return it
-    if (node->is_leaf) return node;
+// Computes the area of a rectangle
+// rect: pointer to the rectangle
+// Returns the area of the rectangle
+dist_t rect_area(Rect *rect) {
+    dist_t area = 1;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        area *= (dist_t)rect->max[j] - rect->min[j];
+    }
+    return area;
+}
+
+// Computes the margin (half perimeter) of a rectangle
+// rect: pointer to the rectangle
+// Returns the sum of the rectangle's side lengths
+dist_t rect_margin(Rect *rect) {
+    dist_t margin = 0;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        margin += (dist_t)rect->max[j] - rect->min[j];
+    }
+    return margin;
+}
+
+// Computes the area of the intersection of two rectangles
+// r1: pointer to the first rectangle
+// r2: pointer to the second rectangle
+// Returns the overlapping area, or 0 if the rectangles are disjoint
+dist_t overlap_area(Rect *r1, Rect *r2) {
+    dist_t area = 1;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        coord_t lo = r1->min[j] > r2->min[j] ? r1->min[j] : r2->min[j];
+        coord_t hi = r1->max[j] < r2->max[j] ? r1->max[j] : r2->max[j];
+        if (hi <= lo) return 0;
+        area *= (dist_t)hi - lo;
+    }
+    return area;
+}
+
+// Picks the entry of an internal node whose child best fits a new rectangle
+// node: pointer to the internal node
+// rect: pointer to the rectangle to be inserted
+// Returns the index of the child needing the least enlargement, ties going to the smaller child
+int choose_child_slot(RTreeNode *node, Rect *rect) {
     // Initialize the minimum enlargement to a large value
-    float min_enlargement = FLT_MAX;
-    // Initialize the best choice node to NULL
-    RTreeNode *best_choice = NULL;
+    dist_t min_enlargement = DIST_MAX;
+    dist_t min_area = DIST_MAX;
+    // Initialize the best choice to the first child
+    int best_choice = 0;
     // Iterate over each entry in the current node
     for (int i = 0; i < node->num_entries; i++) {
-        // Compute the enlargement needed to include the entry's rectangle
-        float e = enlargement(&node->entries[i]->rect, &entry->rect);
+        // Compute the enlargement needed to include the rectangle
+        Rect r = entry_rect(node, i);
+        dist_t e = enlargement(&r, rect);
+        dist_t area = rect_area(&r);
         // If the enlargement is smaller than the current minimum, update the best choice
-        if (e < min_enlargement) {
+        if (e < min_enlargement || (e == min_enlargement && area < min_area)) {
             min_enlargement = e;
-            best_choice = node->entries[i]->child;
+            min_area = area;
+            best_choice = i;
         }
     }
+    return best_choice;
+}
+
+// Picks the child of an internal node that best fits a new rectangle
+// node: pointer to the internal node
+// rect: pointer to the rectangle to be inserted
+// Returns the child needing the least enlargement, ties going to the smaller child
+RTreeNode* choose_child(RTreeNode *node, Rect *rect) {
+    return node->child[choose_child_slot(node, rect)].node;
+}
+
+// Chooses the appropriate leaf node for insertion
+// node: pointer to the current R-tree node
+// entry: pointer to the entry to be inserted
+// Returns the leaf node where the entry should be inserted
+RTreeNode* choose_leaf(RTreeNode *node, Entry *entry) {
+    // If the current node is a leaf, return it
+    if (node->is_leaf) return node;
     // Recursively choose the leaf node in the best choice subtree
-    return choose_leaf(best_choice, entry);
+    return choose_leaf(choose_child(node, &entry->rect), entry);
 }
 
-// Splits a node into two nodes
-// tree: pointer to the R-tree
-// node: pointer to the node to be split
-// Returns the new sibling node created by the split
-RTreeNode* split_node(RTree *tree, RTreeNode *node) {
-    // Compute the midpoint of the node's entries
-    int mid = node->num_entries / 2;
-    // Initialize a new sibling node with the same leaf status as the current node
-    RTreeNode *sibling = init_node(node->is_leaf);
-    // Move the second half of the entries to the sibling node
-    for (int i = mid; i < node->num_entries; i++) {
-        add_entry(sibling, node->entries[i]);
+// Computes the height of a node above the leaf level
+// node: pointer to the R-tree node
+// Returns 0 for a leaf, 1 for its parent, and so on
+int node_height(RTreeNode *node) {
+    int height = 0;
+    // Follow the first child down to the leaf level
+    while (!node->is_leaf) {
+        node = node->child[0].node;
+        height++;
     }
-    // Update the number of entries in the current node
-    node->num_entries = mid;
-    // Return the new sibling node
-    return sibling;
+    return height;
 }
 
-// Adjusts the tree after insertion
+// Chooses the node at a given height that should receive a rectangle
+// tree: pointer to the R-tree
+// rect: pointer to the rectangle to be inserted
+// height: height above the leaves of the node to return (0 for a leaf)
+// Returns the node at that height where the rectangle should be added
+RTreeNode* choose_node(RTree *tree, Rect *rect, int height) {
+    RTreeNode *node = tree->root;
+    // Descend from the root until the requested height is reached
+    for (int h = node_height(node); h > height; h--) {
+        STATS_ADD(tree->insert_stats.nodes_visited, 1);
+        node = choose_child(node, rect);
+    }
+    return node;
+}
+
+// Builds the two halves of a split from a group assignment
+// tree: pointer to the R-tree providing the sibling node
+// node: pointer to the node being split; it keeps the entries of group 0
+// slots: copy of the node's entries before the split
+// count: number of entries
+// group: group (0 or 1) assigned to each entry
+// Returns the new sibling node holding the entries of group 1
+RTreeNode* distribute_entries(RTree *tree, RTreeNode *node, NodeSlot *slots, int count, int *group) {
+    // Initialize a new sibling node with the same leaf status as the current node
+    RTreeNode *sibling = init_node(tree, node->is_leaf);
+    // Refill the node and its sibling according to the assignment
+    node->num_entries = 0;
+    for (int i = 0; i < count; i++) {
+        add_slot(group[i] == 0 ? node : sibling, &slots[i]);
+    }
+    return sibling;
+}
+
+// Splits a node by moving the second half of its entries to a new node
+// tree: pointer to the R-tree providing the sibling node
+// node: pointer to the node to be split
+// Returns the new sibling node created by the split
+RTreeNode* split_midpoint(RTree *tree, RTreeNode *node) {
+    // Compute the midpoint of the node's entries
+    int mid = node->num_entries / 2;
+    // Initialize a new sibling node with the same leaf status as the current node
+    RTreeNode *sibling = init_node(tree, node->is_leaf);
+    // Move the second half of the entries to the sibling node
+    for (int i = mid; i < node->num_entries; i++) {
+        NodeSlot slot = take_slot(node, i);
+        add_slot(sibling, &slot);
+    }
+    // Update the number of entries in the current node
+    node->num_entries = mid;
+    mark_dirty(node);
+    // Return the new sibling node
+    return sibling;
+}
+
+// Picks the two seed entries of a linear split
+// slots: entries of the node being split
+// count: number of entries
+// seed1, seed2: receive the indices of the seeds
+void linear_pick_seeds(NodeSlot *slots, int count, int *seed1, int *seed2) {
+    dist_t best_separation = -DIST_MAX;
+    *seed1 = 0;
+    *seed2 = 1;
+    // Find the most separated pair along each axis
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        int highest_low = 0, lowest_high = 0;
+        coord_t lo = COORD_MAX, hi = -COORD_MAX;
+        for (int i = 0; i < count; i++) {
+            Rect *r = &slots[i].rect;
+            if (r->min[j] > slots[highest_low].rect.min[j]) highest_low = i;
+            if (r->max[j] < slots[lowest_high].rect.max[j]) lowest_high = i;
+            if (r->min[j] < lo) lo = r->min[j];
+            if (r->max[j] > hi) hi = r->max[j];
+        }
+        // The same entry cannot be both seeds
+        if (highest_low == lowest_high) {
+            lowest_high = highest_low == 0 ? 1 : 0;
+        }
+        // Normalize the separation by the width of the whole set
+        dist_t width = (dist_t)hi - lo;
+        dist_t separation = (dist_t)slots[highest_low].rect.min[j] - slots[lowest_high].rect.max[j];
+        if (width > 0) separation /= width;
+        if (separation > best_separation) {
+            best_separation = separation;
+            *seed1 = lowest_high;
+            *seed2 = highest_low;
+        }
+    }
+}
+
+// Picks the two seed entries of a quadratic split
+// slots: entries of the node being split
+// count: number of entries
+// seed1, seed2: receive the indices of the seeds
+void quadratic_pick_seeds(NodeSlot *slots, int count, int *seed1, int *seed2) {
+    dist_t worst_waste = -DIST_MAX;
+    *seed1 = 0;
+    *seed2 = 1;
+    // Find the pair that would waste the most area if kept together
+    for (int i = 0; i < count; i++) {
+        for (int k = i + 1; k < count; k++) {
+            Rect bbox = bounding_box((Rect[]){slots[i].rect, slots[k].rect}, 2);
+            dist_t waste = rect_area(&bbox) - rect_area(&slots[i].rect) - rect_area(&slots[k].rect);
+            if (waste > worst_waste) {
+                worst_waste = waste;
+                *seed1 = i;
+                *seed2 = k;
+            }
+        }
+    }
+}
+
+// Splits a node with Guttman's linear or quadratic algorithm
+// tree: pointer to the R-tree
+// node: pointer to the node to be split
+// quadratic: true for the quadratic variant, false for the linear one
+// Returns the new sibling node created by the split
+RTreeNode* split_guttman(RTree *tree, RTreeNode *node, bool quadratic) {
+    int count = node->num_entries;
+    NodeSlot slots[MAX_ENTRIES + 1];
+    int group[MAX_ENTRIES + 1];
+    for (int i = 0; i < count; i++) {
+        slots[i] = take_slot(node, i);
+        group[i] = -1;
+    }
+
+    // Start each group from one seed
+    int seed1, seed2;
+    if (quadratic) {
+        quadratic_pick_seeds(slots, count, &seed1, &seed2);
+    } else {
+        linear_pick_seeds(slots, count, &seed1, &seed2);
+    }
+    Rect cover[2] = {slots[seed1].rect, slots[seed2].rect};
+    int size[2] = {1, 1};
+    group[seed1] = 0;
+    group[seed2] = 1;
+    int remaining = count - 2;
+
+    while (remaining > 0) {
+        // If one group needs all remaining entries to reach the minimum, give them to it
+        int forced = -1;
+        if (size[0] + remaining <= tree->min_entries) forced = 0;
+        if (size[1] + remaining <= tree->min_entries) forced = 1;
+        if (forced >= 0) {
+            for (int i = 0; i < count; i++) {
+                if (group[i] < 0) group[i] = forced;
+            }
+            break;
+        }
+
+        // Pick the next entry: the first unassigned one for the linear split,
+        // the one with the strongest preference for a group for the quadratic split
+        int next = -1;
+        dist_t max_difference = -1;
+        for (int i = 0; i < count; i++) {
+            if (group[i] >= 0) continue;
+            if (!quadratic) {
+                next = i;
+                break;
+            }
+            dist_t difference = enlargement(&cover[0], &slots[i].rect) - enlargement(&cover[1], &slots[i].rect);
+            if (difference < 0) difference = -difference;
+            if (difference > max_difference) {
+                max_difference = difference;
+                next = i;
+            }
+        }
+
+        // Add it to the group that needs the least enlargement, then the smaller
+        // area, then the fewer entries
+        dist_t d0 = enlargement(&cover[0], &slots[next].rect);
+        dist_t d1 = enlargement(&cover[1], &slots[next].rect);
+        int target;
+        if (d0 != d1) {
+            target = d0 < d1 ? 0 : 1;
+        } else if (rect_area(&cover[0]) != rect_area(&cover[1])) {
+            target = rect_area(&cover[0]) < rect_area(&cover[1]) ? 0 : 1;
+        } else {
+            target = size[0] <= size[1] ? 0 : 1;
+        }
+        group[next] = target;
+        cover[target] = bounding_box((Rect[]){cover[target], slots[next].rect}, 2);
+        size[target]++;
+        remaining--;
+    }
+
+    return distribute_entries(tree, node, slots, count, group);
+}
+
+// Sorts slots by one side of their rectangles along an axis
+// slots: slots to sort in place
+// count: number of slots
+// axis: axis to sort along
+// by_max: sort by the upper side first instead of the lower side
+void sort_slots_by_axis(NodeSlot *slots, int count, int axis, bool by_max) {
+    // Insertion sort; nodes hold at most MAX_ENTRIES + 1 entries
+    for (int i = 1; i < count; i++) {
+        NodeSlot s = slots[i];
+        coord_t key1 = by_max ? s.rect.max[axis] : s.rect.min[axis];
+        coord_t key2 = by_max ? s.rect.min[axis] : s.rect.max[axis];
+        int k = i - 1;
+        while (k >= 0) {
+            coord_t other1 = by_max ? slots[k].rect.max[axis] : slots[k].rect.min[axis];
+            coord_t other2 = by_max ? slots[k].rect.min[axis] : slots[k].rect.max[axis];
+            if (other1 < key1 || (other1 == key1 && other2 <= key2)) break;
+            slots[k + 1] = slots[k];
+            k--;
+        }
+        slots[k + 1] = s;
+    }
+}
+
+// Computes the bounding boxes of every prefix and suffix of a slot array
+// slots: ordered slots
+// count: number of slots
+// prefix: receives the box of slots [0, i] at index i
+// suffix: receives the box of slots [i, count) at index i
+void prefix_suffix_boxes(NodeSlot *slots, int count, Rect *prefix, Rect *suffix) {
+    prefix[0] = slots[0].rect;
+    for (int i = 1; i < count; i++) {
+        prefix[i] = bounding_box((Rect[]){prefix[i - 1], slots[i].rect}, 2);
+    }
+    suffix[count - 1] = slots[count - 1].rect;
+    for (int i = count - 2; i >= 0; i--) {
+        suffix[i] = bounding_box((Rect[]){suffix[i + 1], slots[i].rect}, 2);
+    }
+}
+
+// Splits a node with the R*-tree algorithm
+// tree: pointer to the R-tree
+// node: pointer to the node to be split
+// Returns the new sibling node created by the split
+RTreeNode* split_rstar(RTree *tree, RTreeNode *node) {
+    int count = node->num_entries;
+    int min_fill = tree->min_entries;
+    NodeSlot slots[MAX_ENTRIES + 1];
+    NodeSlot sorted[MAX_ENTRIES + 1];
+    Rect prefix[MAX_ENTRIES + 1];
+    Rect suffix[MAX_ENTRIES + 1];
+    for (int i = 0; i < count; i++) {
+        slots[i] = take_slot(node, i);
+    }
+
+    // Choose the split axis: the one whose distributions have the smallest total margin
+    int best_axis = 0;
+    dist_t best_margin = DIST_MAX;
+    for (int axis = 0; axis < RTREE_DIMS; axis++) {
+        dist_t margin = 0;
+        for (int by_max = 0; by_max < 2; by_max++) {
+            memcpy(sorted, slots, sizeof(NodeSlot) * count);
+            sort_slots_by_axis(sorted, count, axis, by_max);
+            prefix_suffix_boxes(sorted, count, prefix, suffix);
+            for (int k = min_fill; k <= count - min_fill; k++) {
+                margin += rect_margin(&prefix[k - 1]) + rect_margin(&suffix[k]);
+            }
+        }
+        if (margin < best_margin) {
+            best_margin = margin;
+            best_axis = axis;
+        }
+    }
+
+    // Along that axis, choose the distribution with the least overlap, then the least area
+    int best_by_max = 0, best_k = min_fill;
+    dist_t best_overlap = DIST_MAX, best_area = DIST_MAX;
+    for (int by_max = 0; by_max < 2; by_max++) {
+        memcpy(sorted, slots, sizeof(NodeSlot) * count);
+        sort_slots_by_axis(sorted, count, best_axis, by_max);
+        prefix_suffix_boxes(sorted, count, prefix, suffix);
+        for (int k = min_fill; k <= count - min_fill; k++) {
+            dist_t o = overlap_area(&prefix[k - 1], &suffix[k]);
+            dist_t area = rect_area(&prefix[k - 1]) + rect_area(&suffix[k]);
+            if (o < best_overlap || (o == best_overlap && area < best_area)) {
+                best_overlap = o;
+                best_area = area;
+                best_by_max = by_max;
+                best_k = k;
+            }
+        }
+    }
+
+    // The first best_k entries of the chosen ordering stay in the node
+    memcpy(sorted, slots, sizeof(NodeSlot) * count);
+    sort_slots_by_axis(sorted, count, best_axis, best_by_max);
+    int group[MAX_ENTRIES + 1];
+    for (int i = 0; i < count; i++) group[i] = i < best_k ? 0 : 1;
+    return distribute_entries(tree, node, sorted, count, group);
+}
+
+// Splits a node into two nodes
+// tree: pointer to the R-tree
+// node: pointer to the node to be split
+// Returns the new sibling node created by the split
+RTreeNode* split_node(RTree *tree, RTreeNode *node) {
+    // Dispatch on the tree's split policy
+    switch (tree->split_policy) {
+        case SPLIT_LINEAR:
+            return split_guttman(tree, node, false);
+        case SPLIT_QUADRATIC:
+            return split_guttman(tree, node, true);
+        case SPLIT_RSTAR:
+            return split_rstar(tree, node);
+        case SPLIT_MIDPOINT:
+        default:
+            return split_midpoint(tree, node);
+    }
+}
+
+// Finds the position of a node in its parent
+// node: pointer to a non-root R-tree node
+// Returns the index of the parent's entry pointing to the node, or -1
+int child_index(RTreeNode *node) {
+    RTreeNode *parent = node->parent;
+    if (!parent) return -1;
+    for (int i = 0; i < parent->num_entries; i++) {
+        if (parent->child[i].node == node) return i;
+    }
+    return -1;
+}
+
+// Removes the entries farthest from the center of an overflowing node and
+// inserts them again at the same height (R*-tree forced reinsertion)
+// tree: pointer to the R-tree
+// node: pointer to the overflowing, non-root node
+// height: height of the node above the leaves
+void reinsert_entries(RTree *tree, RTreeNode *node, int height) {
+    int count = node->num_entries;
+    // Reinsert 30% of the entries, at least one
+    int p = count * 3 / 10;
+    if (p < 1) p = 1;
+
+    // Order the entries by the distance of their centers from the node's center
+    Rect bbox = node_bounding_box(node);
+    NodeSlot slots[MAX_ENTRIES + 1];
+    dist_t distance[MAX_ENTRIES + 1];
+    for (int i = 0; i < count; i++) {
+        NodeSlot s = take_slot(node, i);
+        // Compare doubled centers to stay exact for integer coordinates
+        dist_t d = 0;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            dist_t delta = ((dist_t)s.rect.min[j] + s.rect.max[j]) - ((dist_t)bbox.min[j] + bbox.max[j]);
+            d += delta * delta;
+        }
+        // Insertion sort, nearest first
+        int k = i - 1;
+        while (k >= 0 && distance[k] > d) {
+            slots[k + 1] = slots[k];
+            distance[k + 1] = distance[k];
+            k--;
+        }
+        slots[k + 1] = s;
+        distance[k + 1] = d;
+    }
+
+    // Keep the nearest entries in the node and shrink the rectangles above it
+    node->num_entries = 0;
+    for (int i = 0; i < count - p; i++) {
+        add_slot(node, &slots[i]);
+    }
+    refresh_ancestors(node);
+
+    // Reinsert the removed entries, closest first
+    for (int i = count - p; i < count; i++) {
+        insert_at_height(tree, &slots[i], height);
+    }
+}
+
+// Adjusts the tree after insertion
 // tree: pointer to the R-tree
 // node: pointer to the node that was just inserted into
 void adjust_tree(RTree *tree, RTreeNode *node) {
@@ -196,19 +1460,15 @@ void adjust_tree(RTree *tree, RTreeNode *node) {
         // If the root has more entries than allowed
         if (node->num_entries > tree->max_entries) {
             // Create a new root node
-            RTreeNode *new_root = init_node(false);
+            RTreeNode *new_root = init_node(tree, false);
             // Split the current root node
+            STATS_ADD(tree->insert_stats.splits, 1);
             RTreeNode *sibling = split_node(tree, node);
-            // Create entries for the new root
-            Entry *entry1 = (Entry *)malloc(sizeof(Entry));
-            entry1->rect = bounding_box((Rect[]){node->entries[0]->rect}, node->num_entries);
-            entry1->child = node;
-            Entry *entry2 = (Entry *)malloc(sizeof(Entry));
-            entry2->rect = bounding_box((Rect[]){sibling->entries[0]->rect}, sibling->num_entries);
-            entry2->child = sibling;
-            // Add the entries to the new root
-            add_entry(new_root, entry1);
-            add_entry(new_root, entry2);
+            // Add both halves to the new root
+            Rect rect1 = node_bounding_box(node);
+            Rect rect2 = node_bounding_box(sibling);
+            add_child(new_root, node, &rect1);
+            add_child(new_root, sibling, &rect2);
             // Update the tree's root
             tree->root = new_root;
         }
@@ -217,14 +1477,27 @@ void adjust_tree(RTree *tree, RTreeNode *node) {
         RTreeNode *parent = node->parent;
         // If the node has more entries than allowed
         if (node->num_entries > tree->max_entries) {
+            // The first overflow at each height during an R* insert reinserts
+            // entries instead of splitting
+            if (tree->split_policy == SPLIT_RSTAR) {
+                int height = node_height(node);
+                unsigned int bit = 1u << (height < 31 ? height : 31);
+                if (!(tree->reinserted_levels & bit)) {
+                    tree->reinserted_levels |= bit;
+                    STATS_ADD(tree->insert_stats.reinsertions, 1);
+                    reinsert_entries(tree, node, height);
+                    return;
+                }
+            }
             // Split the node
+            STATS_ADD(tree->insert_stats.splits, 1);
             RTreeNode *sibling = split_node(tree, node);
-            // Create an entry for the parent
-            Entry *entry = (Entry *)malloc(sizeof(Entry));
-            entry->rect = bounding_box((Rect[]){sibling->entries[0]->rect}, sibling->num_entries);
-            entry->child = sibling;
-            // Add the entry to the parent
-            add_entry(parent, entry);
+            // The node lost entries, so shrink its rectangle in the parent
+            Rect shrunk = node_bounding_box(node);
+            set_entry_rect(parent, child_index(node), &shrunk);
+            // Add the sibling to the parent
+            Rect rect = node_bounding_box(sibling);
+            add_child(parent, sibling, &rect);
             // Recursively adjust the tree
             adjust_tree(tree, parent);
         }
@@ -236,8 +1509,34 @@ void adjust_tree(RTree *tree, RTreeNode *node) {
 // r2: pointer to the second rectangle
 // Returns true if the rectangles overlap, false otherwise
 bool overlap(Rect *r1, Rect *r2) {
-    // Check if the rectangles do not overlap on the x-axis or y-axis
-    return !(r1->max[0] < r2->min[0] || r1->min[0] > r2->max[0] || r1->max[1] < r2->min[1] || r1->min[1] > r2->max[1]);
+    // Check if the rectangles are separated along any axis
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        if (r1->max[j] < r2->min[j] || r1->min[j] > r2->max[j]) return false;
+    }
+    return true;
+}
+
+// Checks if a rectangle is a single point
+// rect: pointer to the rectangle
+// Returns true if its min and max corners are equal
+bool is_point(Rect *rect) {
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        if (rect->min[j] != rect->max[j]) return false;
+    }
+    return true;
+}
+
+// Checks if an entry of a node overlaps a rectangle
+// node: pointer to the R-tree node
+// i: index of the entry
+// rect: pointer to the rectangle
+// Returns true if the entry's rectangle overlaps rect, false otherwise
+bool entry_overlaps(RTreeNode *node, int i, Rect *rect) {
+    coord_t (*max)[MAX_ENTRIES + 1] = NODE_MAX_ARRAYS(node);
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        if (max[j][i] < rect->min[j] || node->min[j][i] > rect->max[j]) return false;
+    }
+    return true;
 }
 
 // Searches the tree for entries that overlap with a given rectangle
@@ -245,19 +1544,52 @@ bool overlap(Rect *r1, Rect *r2) {
 // rect: pointer to the rectangle to search for
 // callback: function to call for each overlapping entry
 void search(RTreeNode *node, Rect *rect, void (*callback)(Entry *)) {
-    // Iterate over each entry in the node
-    for (int i = 0; i < node->num_entries; i++) {
-        // If the entry's rectangle overlaps with the search rectangle
-        if (overlap(&node->entries[i]->rect, rect)) {
-            // If the node is a leaf, call the callback function with the entry
-            if (node->is_leaf) {
-                callback(node->entries[i]);
-            } else {
-                // If the node is not a leaf, recursively search the child node
-                search(node->entries[i]->child, rect, callback);
-            }
+    // Test all entries of the node against the search rectangle in one pass
+    NodeMask hits = node_overlap_mask(node, rect);
+#ifdef RTREE_STATS
+    if (search_stats != NULL) {
+        search_stats->nodes_visited++;
+        search_stats->entries_tested += node->num_entries;
+        if (!node->is_leaf) {
+            int descended = 0;
+            for (int w = 0; w < NODE_MASK_WORDS; w++) descended += __builtin_popcountll(hits.bits[w]);
+            search_stats->subtrees_pruned += node->num_entries - descended;
         }
     }
+#endif
+    int i;
+    // Iterate over each overlapping entry in the node
+    NODE_MASK_FOREACH(hits, i) {
+        // If the node is a leaf, call the callback function with the entry
+        if (node->is_leaf) {
+            callback(node->child[i].entry);
+        } else {
+            // If the node is not a leaf, recursively search the child node
+            search(node->child[i].node, rect, callback);
+        }
+    }
+}
+
+// Searches the tree for entries that overlap a rectangle like search, and
+// when built with RTREE_STATS counts the work in the context and the tree
+// ctx: query context receiving the counts
+// tree: pointer to the R-tree
+// rect: pointer to the rectangle to search for
+// callback: function to call for each overlapping entry
+void search_ctx(QueryContext *ctx, RTree *tree, Rect *rect, void (*callback)(Entry *)) {
+#ifdef RTREE_STATS
+    QueryStats stats = {0};
+    // A callback may run searches of its own; they count separately
+    QueryStats *outer = search_stats;
+    search_stats = &stats;
+    search(tree->root, rect, callback);
+    search_stats = outer;
+    stats.queries = 1;
+    add_query_stats(ctx, tree, &stats);
+#else
+    (void)ctx;
+    search(tree->root, rect, callback);
+#endif
 }
 
 // Finds the leaf node containing a specific entry
@@ -270,7 +1602,7 @@ RTreeNode* find_leaf(RTreeNode *node, Entry *entry) {
         // Iterate over each entry in the node
         for (int i = 0; i < node->num_entries; i++) {
             // If the entry is found, return the node
-            if (node->entries[i] == entry) {
+            if (node->child[i].entry == entry) {
                 return node;
             }
         }
@@ -280,9 +1612,9 @@ RTreeNode* find_leaf(RTreeNode *node, Entry *entry) {
     // If the node is not a leaf, iterate over each entry
     for (int i = 0; i < node->num_entries; i++) {
         // If the entry's rectangle overlaps with the search entry's rectangle
-        if (overlap(&node->entries[i]->rect, &entry->rect)) {
+        if (entry_overlaps(node, i, &entry->rect)) {
             // Recursively search the child node
-            RTreeNode *result = find_leaf(node->entries[i]->child, entry);
+            RTreeNode *result = find_leaf(node->child[i].node, entry);
             // If the entry is found in the child node, return the result
             if (result) return result;
         }
@@ -291,219 +1623,2026 @@ RTreeNode* find_leaf(RTreeNode *node, Entry *entry) {
     return NULL;
 }
 
+// Enlarges the rectangles of a node's ancestors to cover a new rectangle
+// node: pointer to the node that just received rect
+// rect: pointer to the rectangle added to node
+void enlarge_ancestors(RTreeNode *node, Rect *rect) {
+    while (node->parent != NULL) {
+        RTreeNode *parent = node->parent;
+        int i = child_index(node);
+        // Stop at the first ancestor that already covers the rectangle
+        bool grown = false;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            if (rect->min[j] < parent->min[j][i]) {
+                parent->min[j][i] = rect->min[j];
+                grown = true;
+            }
+            if (rect->max[j] > parent->max[j][i]) {
+                parent->max[j][i] = rect->max[j];
+                grown = true;
+            }
+        }
+        if (!grown) break;
+        mark_dirty(parent);
+        node = parent;
+    }
+}
+
+// Refreshes the rectangles above a node after its entries changed, which may
+// grow or shrink them, up to the first rectangle that doesn't change
+// node: pointer to the node whose entries changed
+void refresh_ancestors(RTreeNode *node) {
+    while (node->parent != NULL) {
+        RTreeNode *parent = node->parent;
+        int i = child_index(node);
+        Rect tight = node_bounding_box(node);
+        Rect current = entry_rect(parent, i);
+        if (memcmp(&tight, &current, sizeof(Rect)) == 0) break;
+        set_entry_rect(parent, i, &tight);
+        node = parent;
+    }
+}
+
+// Inserts a slot into a node at a given height above the leaves
+// tree: pointer to the R-tree
+// slot: pointer to the slot to be inserted (a child node when height > 0)
+// height: height of the node that should receive the slot
+void insert_at_height(RTree *tree, NodeSlot *slot, int height) {
+    // Choose the appropriate node for insertion
+    RTreeNode *node = choose_node(tree, &slot->rect, height);
+    // Add the slot to the node
+    add_slot(node, slot);
+    // Make the path from the root cover the new rectangle
+    enlarge_ancestors(node, &slot->rect);
+    // If the node has more entries than allowed, adjust the tree
+    if (node->num_entries > tree->max_entries) {
+        adjust_tree(tree, node);
+    }
+}
+
 // Inserts an entry into the tree
 // tree: pointer to the R-tree
 // entry: pointer to the entry to be inserted
 void insert(RTree *tree, Entry *entry) {
-    // Choose the appropriate leaf node for insertion
-    RTreeNode *leaf = choose_leaf(tree->root, entry);
-    // Add the entry to the leaf node
-    add_entry(leaf, entry);
-    // If the leaf node has more entries than allowed, adjust the tree
-    if (leaf->num_entries > tree->max_entries) {
-        adjust_tree(tree, leaf);
+    if (tree->read_only) {
+        fprintf(stderr, "Tree is read-only, insert ignored\n");
+        return;
+    }
+#ifdef RTREE_POINTS
+    if (!is_point(&entry->rect)) {
+        fprintf(stderr, "Entry is not a point, insert ignored\n");
+        return;
     }
+#endif
+    // Each insert may do one forced reinsertion per level
+    tree->reinserted_levels = 0;
+    STATS_ADD(tree->insert_stats.inserts, 1);
+    NodeSlot slot = {entry->rect, {.entry = entry}};
+    insert_at_height(tree, &slot, 0);
 }
 
-// Condenses the tree after deletion
-// tree: pointer to the R-tree
-// node: pointer to the node that was just deleted from
-void condense_tree(RTree *tree, RTreeNode *node) {
-    // If the node is the root
-    if (node == tree->root) {
-        // If the root has only one entry and is not a leaf
-        if (node->num_entries == 1 && !node->is_leaf) {
-            // Update the root to be the single child node
-            tree->root = node->entries[0]->child;
-            tree->root->parent = NULL;
+// Reorders items so the one at index k is where sorting by key would put it,
+// with no larger key before it and no smaller key after it (quickselect)
+// items: items to reorder in place
+// count: number of items
+// k: index to settle, in [0, count]; count leaves the items as they are
+void select_pack_items(PackItem *items, int count, int k) {
+    int lo = 0, hi = count - 1;
+    while (lo < hi && k <= hi) {
+        // Partition around the median of the first, middle and last keys
+        double a = items[lo].key, b = items[(lo + hi) / 2].key, c = items[hi].key;
+        double pivot = a < b ? (b < c ? b : (a < c ? c : a)) : (a < c ? a : (b < c ? c : b));
+        int i = lo, j = hi;
+        while (i <= j) {
+            while (items[i].key < pivot) i++;
+            while (items[j].key > pivot) j--;
+            if (i <= j) {
+                PackItem swap = items[i];
+                items[i] = items[j];
+                items[j] = swap;
+                i++;
+                j--;
+            }
+        }
+        // Keep the side holding index k
+        if (k <= j) hi = j;
+        else if (k >= i) lo = i;
+        else return;
+    }
+}
+
+// Fills one node per group of items. The items are split in two along the
+// axis where their centers spread widest, recursively, with the cut placed at
+// a group boundary; group g of the whole array holds items
+// [total * g / groups, total * (g + 1) / groups), so every group has the same
+// size to within one item.
+// tree: pointer to the R-tree providing the nodes
+// items: every item being grouped; only the range of the groups handled is reordered
+// total: number of items
+// groups: number of groups the items are split into
+// first_group: first group handled by this call
+// end_group: group after the last one handled
+// first: node to fill with the first group handled, or NULL for a new node
+// is_leaf: whether the items are entries (true) or child nodes
+// out: receives one slot per filled node
+// num_out: number of slots already in out; updated
+void pack_groups(RTree *tree, PackItem *items, int total, int groups, int first_group, int end_group,
+                 RTreeNode *first, bool is_leaf, PackItem *out, int *num_out) {
+    int start = (int)((long long)total * first_group / groups);
+    int end = (int)((long long)total * end_group / groups);
+    if (end_group - first_group == 1) {
+        RTreeNode *node = first != NULL ? first : init_node(tree, is_leaf);
+        for (int i = start; i < end; i++) {
+            add_slot(node, &items[i].slot);
         }
+        out[*num_out].slot.rect = node_bounding_box(node);
+        out[*num_out].slot.child.node = node;
+        (*num_out)++;
         return;
     }
-    // If the node is not the root
-    RTreeNode *parent = node->parent;
-    // If the node has fewer entries than allowed
-    if (node->num_entries < tree->min_entries) {
-        // Remove the node from its parent's entries
-        for (int i = 0; i < parent->num_entries; i++) {
-            if (parent->entries[i]->child == node) {
-                for (int j = i; j < parent->num_entries - 1; j++) {
-                    parent->entries[j] = parent->entries[j + 1];
-                }
-                parent->num_entries--;
-                break;
-            }
+
+    // Find the axis along which the (doubled) centers spread widest
+    double lo[RTREE_DIMS], hi[RTREE_DIMS];
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        lo[j] = DBL_MAX;
+        hi[j] = -DBL_MAX;
+    }
+    for (int i = start; i < end; i++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double c = (double)items[i].slot.rect.min[j] + items[i].slot.rect.max[j];
+            if (c < lo[j]) lo[j] = c;
+            if (c > hi[j]) hi[j] = c;
         }
-        // Reinsert the node's entries into the tree
-        for (int i = 0; i < node->num_entries; i++) {
-            insert(tree, node->entries[i]);
+    }
+    int axis = 0;
+    for (int j = 1; j < RTREE_DIMS; j++) {
+        if (hi[j] - lo[j] > hi[axis] - lo[axis]) axis = j;
+    }
+    // Cut along it at the boundary of the middle group; the items only need
+    // to be on the right side of the cut, not sorted
+    for (int i = start; i < end; i++) {
+        items[i].key = (double)items[i].slot.rect.min[axis] + items[i].slot.rect.max[axis];
+    }
+    int middle = first_group + (end_group - first_group) / 2;
+    select_pack_items(items + start, end - start, (int)((long long)total * middle / groups) - start);
+    pack_groups(tree, items, total, groups, first_group, middle, first, is_leaf, out, num_out);
+    pack_groups(tree, items, total, groups, middle, end_group, NULL, is_leaf, out, num_out);
+}
+
+// Adds items to a node. If they overflow it by one, the node is split with
+// the tree's policy; beyond that the node's entries and the items are spread
+// evenly over as few nodes as can hold them, the node itself being the first,
+// so an overflow costs one split however many items arrive.
+// tree: pointer to the R-tree
+// node: pointer to the node receiving the items
+// extra: items to add: entries for a leaf, child nodes otherwise
+// num_extra: number of items
+// out: receives a slot for the node and one for each new sibling, the node first
+// Returns the number of slots written to out
+int settle_node(RTree *tree, RTreeNode *node, PackItem *extra, int num_extra, PackItem *out) {
+    int total = node->num_entries + num_extra;
+    if (total <= tree->max_entries) {
+        for (int i = 0; i < num_extra; i++) {
+            add_slot(node, &extra[i].slot);
+        }
+        out[0].slot.rect = node_bounding_box(node);
+        out[0].slot.child.node = node;
+        return 1;
+    }
+    // One entry too many: split with the tree's policy, as insert would
+    if (total == tree->max_entries + 1) {
+        for (int i = 0; i < num_extra; i++) {
+            add_slot(node, &extra[i].slot);
         }
+        STATS_ADD(tree->insert_stats.splits, 1);
+        RTreeNode *sibling = split_node(tree, node);
+        out[0].slot.rect = node_bounding_box(node);
+        out[0].slot.child.node = node;
+        out[1].slot.rect = node_bounding_box(sibling);
+        out[1].slot.child.node = sibling;
+        return 2;
     }
-    // Recursively condense the tree
-    condense_tree(tree, parent);
+
+    // Gather the node's own entries with the new ones and share them out
+    PackItem *items = (PackItem *)malloc(sizeof(PackItem) * total);
+    for (int i = 0; i < node->num_entries; i++) {
+        items[i].slot = take_slot(node, i);
+    }
+    memcpy(items + node->num_entries, extra, sizeof(PackItem) * num_extra);
+    node->num_entries = 0;
+    int groups = (total + tree->max_entries - 1) / tree->max_entries;
+    STATS_ADD(tree->insert_stats.splits, groups - 1);
+    int num_out = 0;
+    pack_groups(tree, items, total, groups, 0, groups, node, node->is_leaf, out, &num_out);
+    free(items);
+    return num_out;
 }
 
+// Inserts a batch of items into a subtree. Each item is routed to the child
+// that needs the least enlargement, as insert does, but the items bound for
+// one child are gathered and passed down together, so every node on their
+// paths is visited once per batch; a leaf takes all its items at once, and
+// nodes that overflow are settled once with all the siblings their children
+// produced.
+// tree: pointer to the R-tree
+// node: root of the subtree
+// items: entries to insert; reordered by child
+// count: number of items
+// scratch: working space for count items
+// which: working space for count child indices
+// out: receives the slots of the node and of its new siblings, at most count + 1
+// Returns the number of slots written to out
+int insert_batch_node(RTree *tree, RTreeNode *node, PackItem *items, int count, PackItem *scratch, int *which, PackItem *out) {
+    STATS_ADD(tree->insert_stats.nodes_visited, 1);
+    if (node->is_leaf) {
+        return settle_node(tree, node, items, count, out);
+    }
 
-// Computes the minimum distance from a point to a rectangle
-// rect: pointer to the rectangle
-// point: array representing the point (x, y)
-// Returns the minimum distance from the point to the rectangle
-float min_distance(Rect *rect, float point[2]) {
-    // Compute the distance on the x-axis
-    float dx = fmaxf(fmaxf(rect->min[0] - point[0], 0.0f), point[0] - rect->max[0]);
-    // Compute the distance on the y-axis
-    float dy = fmaxf(fmaxf(rect->min[1] - point[1], 0.0f), point[1] - rect->max[1]);
-    // Return the Euclidean distance
-    return sqrtf(dx * dx + dy * dy);
+    // Route each item to the child choose_child_slot would pick, growing the
+    // child's rectangle as insert would. The areas of the children are worked
+    // out once per visit rather than once per item.
+    int num_children = node->num_entries;
+    dist_t areas[MAX_ENTRIES + 1];
+    for (int c = 0; c < num_children; c++) {
+        areas[c] = 1;
+        for (int j = 0; j < RTREE_DIMS; j++) areas[c] *= (dist_t)node->max[j][c] - node->min[j][c];
+    }
+    int sizes[MAX_ENTRIES + 1] = {0};
+    for (int i = 0; i < count; i++) {
+        Rect *rect = &items[i].slot.rect;
+        dist_t min_enlargement = DIST_MAX, min_area = DIST_MAX, best_grown = 0;
+        int best = 0;
+        for (int c = 0; c < num_children; c++) {
+            dist_t grown = 1;
+            for (int j = 0; j < RTREE_DIMS; j++) {
+                coord_t lo = rect->min[j] < node->min[j][c] ? rect->min[j] : node->min[j][c];
+                coord_t hi = rect->max[j] > node->max[j][c] ? rect->max[j] : node->max[j][c];
+                grown *= (dist_t)hi - lo;
+            }
+            dist_t e = grown - areas[c];
+            if (e < min_enlargement || (e == min_enlargement && areas[c] < min_area)) {
+                min_enlargement = e;
+                min_area = areas[c];
+                best_grown = grown;
+                best = c;
+            }
+        }
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            if (rect->min[j] < node->min[j][best]) node->min[j][best] = rect->min[j];
+            if (rect->max[j] > node->max[j][best]) node->max[j][best] = rect->max[j];
+        }
+        areas[best] = best_grown;
+        which[i] = best;
+        sizes[best]++;
+    }
+    mark_dirty(node);
+
+    // Gather the items of each child together, keeping their order
+    int offsets[MAX_ENTRIES + 2];
+    offsets[0] = 0;
+    for (int c = 0; c < num_children; c++) {
+        offsets[c + 1] = offsets[c] + sizes[c];
+    }
+    int fill[MAX_ENTRIES + 1];
+    memcpy(fill, offsets, sizeof(int) * num_children);
+    for (int i = 0; i < count; i++) {
+        scratch[fill[which[i]]++] = items[i];
+    }
+    memcpy(items, scratch, sizeof(PackItem) * count);
+
+    // Pass each group down; every child comes back as itself plus any new
+    // siblings, which are collected for this node
+    PackItem local[BATCH_LOCAL_SIBLINGS];
+    PackItem *siblings = count < BATCH_LOCAL_SIBLINGS ? local : (PackItem *)malloc(sizeof(PackItem) * (count + 1));
+    int num_siblings = 0;
+    for (int c = 0; c < num_children; c++) {
+        if (sizes[c] == 0) continue;
+        int start = offsets[c];
+        int produced = insert_batch_node(tree, node->child[c].node, items + start, sizes[c], scratch + start,
+                                         which + start, siblings + num_siblings);
+        // The first slot is the child itself, with its new rectangle
+        set_entry_rect(node, c, &siblings[num_siblings].slot.rect);
+        siblings[num_siblings] = siblings[num_siblings + produced - 1];
+        num_siblings += produced - 1;
+    }
+    int settled = settle_node(tree, node, siblings, num_siblings, out);
+    if (siblings != local) free(siblings);
+    return settled;
 }
 
-// Finds the nearest neighbor to a given point
+// Inserts many entries at once. The batch is pushed down the tree together
+// rather than one entry at a time, the entries bound for each child being
+// gathered at every node: each node on the way is visited once per batch,
+// each leaf receives all of its
+// entries in one go, and a node that overflows is split once into as many
+// nodes as it needs. A node overflowing by one entry is split with the tree's
+// policy, larger overflows by pack_groups, and there is no R* forced
+// reinsertion.
 // tree: pointer to the R-tree
-// point: array representing the point (x, y)
-// Returns the nearest neighbor entry to the point
-Entry* nearest_neighbor(RTree *tree, float point[2]) {
-    // Create a priority queue for the search
-    PriorityQueue *pq = create_priority_queue(10);
-    // Push the root node into the priority queue with distance 0
-    priority_queue_push(pq, tree->root, 0.0f);
-    // Initialize the nearest neighbor and its distance
-    Entry *nearest = NULL;
-    float nearest_distance = FLT_MAX;
+// entries: array of pointers to the entries to insert
+// count: number of entries
+// Returns the number of entries inserted
+int insert_batch(RTree *tree, Entry **entries, int count) {
+    if (tree->read_only) {
+        fprintf(stderr, "Tree is read-only, insert ignored\n");
+        return 0;
+    }
+    if (count <= 0) return 0;
+    PackItem *items = (PackItem *)malloc(sizeof(PackItem) * count);
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+#ifdef RTREE_POINTS
+        if (!is_point(&entries[i]->rect)) continue;
+#endif
+        items[n].slot.rect = entries[i]->rect;
+        items[n].slot.child.entry = entries[i];
+        n++;
+    }
+    if (n < count) fprintf(stderr, "%d entries are not points, insert ignored\n", count - n);
+    if (n == 0) {
+        free(items);
+        return 0;
+    }
+    STATS_ADD(tree->insert_stats.inserts, n);
 
-    // While there are nodes in the priority queue
-    while (pq->size > 0) {
-        // Pop the node with the smallest distance
-        PriorityQueueNode pq_node = priority_queue_pop(pq);
+    PackItem *scratch = (PackItem *)malloc(sizeof(PackItem) * n);
+    int *which = (int *)malloc(sizeof(int) * n);
+    PackItem *top = (PackItem *)malloc(sizeof(PackItem) * (n + 1));
+    int num_top = insert_batch_node(tree, tree->root, items, n, scratch, which, top);
 
-        // If the distance is greater than or equal to the nearest distance, skip it
-        if (pq_node.distance >= nearest_distance) continue;
+    // The root split: add levels above it until one node holds them all
+    while (num_top > 1) {
+        int groups = (num_top + tree->max_entries - 1) / tree->max_entries;
+        int num_parents = 0;
+        pack_groups(tree, top, num_top, groups, 0, groups, NULL, false, scratch, &num_parents);
+        memcpy(top, scratch, sizeof(PackItem) * num_parents);
+        num_top = num_parents;
+    }
+    tree->root = top[0].slot.child.node;
+    free(top);
+    free(which);
+    free(scratch);
+    free(items);
+    return n;
+}
 
-        // Get the current node
-        RTreeNode *node = pq_node.node;
-        // Iterate over each entry in the node
-        for (int i = 0; i < node->num_entries; i++) {
-            // Compute the distance from the point to the entry's rectangle
-            float distance = min_distance(&node->entries[i]->rect, point);
-            // If the distance is smaller than the nearest distance
-            if (distance < nearest_distance) {
-                // If the node is a leaf, update the nearest neighbor and distance
-                if (node->is_leaf) {
-                    nearest = node->entries[i];
-                    nearest_distance = distance;
-                } else {
-                    // If the node is not a leaf, push the child node into the priority queue
-                    priority_queue_push(pq, node->entries[i]->child, distance);
+// Compares two node pointers by address, for sorting
+// Returns a negative, zero or positive value as for qsort
+int compare_node_pointers(const void *a, const void *b) {
+    uintptr_t pa = (uintptr_t)*(RTreeNode *const *)a;
+    uintptr_t pb = (uintptr_t)*(RTreeNode *const *)b;
+    return (pa > pb) - (pa < pb);
+}
+
+// Reinserts every leaf entry of a subtree and releases its nodes
+// tree: pointer to the R-tree
+// node: root of a subtree no longer linked into the tree
+void reinsert_subtree_entries(RTree *tree, RTreeNode *node) {
+    for (int i = 0; i < node->num_entries; i++) {
+        if (node->is_leaf) {
+            NodeSlot slot = take_slot(node, i);
+            tree->reinserted_levels = 0;
+            insert_at_height(tree, &slot, 0);
+        } else {
+            reinsert_subtree_entries(tree, node->child[i].node);
+        }
+    }
+    release_node(tree, node);
+}
+
+// Condenses the tree after entries were removed from or changed in some
+// nodes of one level, usually leaves. Working up one level at a time, underfull nodes are taken out and
+// their entries kept aside, and the rectangles of the remaining nodes are
+// refreshed in their parents, stopping early on paths whose rectangles don't
+// change. The kept entries are reinserted once the whole batch is condensed.
+// tree: pointer to the R-tree
+// touched: nodes that changed, possibly repeated; the array is reused
+// count: number of nodes
+// height: height of the touched nodes above the leaves (0 for leaves)
+void condense_tree(RTree *tree, RTreeNode **touched, int count, int height) {
+    // Entries of dissolved nodes, with the height of the nodes that held them
+    NodeSlot *orphans = NULL;
+    int *orphan_heights = NULL;
+    int num_orphans = 0, orphan_capacity = 0;
+
+    while (count > 0) {
+        // A node can be reached from several of its children; handle it once
+        qsort(touched, count, sizeof(RTreeNode *), compare_node_pointers);
+        int next_count = 0;
+        RTreeNode *previous = NULL;
+        for (int t = 0; t < count; t++) {
+            RTreeNode *node = touched[t];
+            if (node == previous || node == tree->root) continue;
+            previous = node;
+            RTreeNode *parent = node->parent;
+            int index = child_index(node);
+            if (node->num_entries < tree->min_entries) {
+                // Take the node out and keep its entries for reinsertion
+                if (num_orphans + node->num_entries > orphan_capacity) {
+                    orphan_capacity = (num_orphans + node->num_entries) * 2;
+                    orphans = (NodeSlot *)realloc(orphans, sizeof(NodeSlot) * orphan_capacity);
+                    orphan_heights = (int *)realloc(orphan_heights, sizeof(int) * orphan_capacity);
                 }
+                for (int i = 0; i < node->num_entries; i++) {
+                    orphans[num_orphans] = take_slot(node, i);
+                    orphan_heights[num_orphans++] = height;
+                }
+                remove_slot(parent, index);
+                release_node(tree, node);
+            } else {
+                // Refresh the node's rectangle in its parent if it changed
+                Rect tight = node_bounding_box(node);
+                Rect current = entry_rect(parent, index);
+                if (memcmp(&tight, &current, sizeof(Rect)) == 0) continue;
+                set_entry_rect(parent, index, &tight);
             }
+            // Parents are distinct from the nodes still to be visited at this
+            // height, so they can be collected in the front of the same array
+            touched[next_count++] = parent;
         }
+        count = next_count;
+        height++;
     }
 
-    // Free the priority queue
-    free(pq->nodes);
-    free(pq);
+    // Shorten the tree while the root has a single child, and turn an
+    // internal root that lost all of its children into an empty leaf
+    while (!tree->root->is_leaf && tree->root->num_entries == 1) {
+        RTreeNode *old_root = tree->root;
+        tree->root = old_root->child[0].node;
+        tree->root->parent = NULL;
+        release_node(tree, old_root);
+    }
+    if (!tree->root->is_leaf && tree->root->num_entries == 0) {
+        tree->root->is_leaf = true;
+        mark_dirty(tree->root);
+    }
 
-    // Return the nearest neighbor
-    return nearest;
+    // Reinsert the kept entries at their original height, highest first so
+    // subtrees go back before the entries that may end up beside them
+    int root_height = node_height(tree->root);
+    for (int i = num_orphans - 1; i >= 0; i--) {
+        if (orphan_heights[i] > 0 && orphan_heights[i] > root_height) {
+            // The tree became too short to hold the subtree as a whole
+            reinsert_subtree_entries(tree, orphans[i].child.node);
+            continue;
+        }
+        tree->reinserted_levels = 0;
+        insert_at_height(tree, &orphans[i], orphan_heights[i]);
+        root_height = node_height(tree->root);
+    }
+    free(orphans);
+    free(orphan_heights);
 }
 
-// Saves a node to a file
-// file: pointer to the file
-// node: pointer to the R-tree node to be saved
-void save_node(FILE *file, RTreeNode *node) {
-    // Write the is_leaf property to the file
-    fwrite(&node->is_leaf, sizeof(bool), 1, file);
-    // Write the number of entries to the file
-    fwrite(&node->num_entries, sizeof(int), 1, file);
-    // Iterate over each entry in the node
-    for (int i = 0; i < node->num_entries; i++) {
-        // Write the entry's rectangle to the file
-        fwrite(&node->entries[i]->rect, sizeof(Rect), 1, file);
-        // If the node is not a leaf, recursively save the child node
-        if (!node->is_leaf) {
-            save_node(file, node->entries[i]->child);
+// Removes an entry from its leaf without condensing the tree
+// tree: pointer to the R-tree
+// entry: pointer to the entry
+// Returns the leaf the entry was removed from, or NULL if it is not in the tree
+RTreeNode* remove_entry(RTree *tree, Entry *entry) {
+    RTreeNode *leaf = find_leaf(tree->root, entry);
+    if (leaf == NULL) return NULL;
+    for (int i = 0; i < leaf->num_entries; i++) {
+        if (leaf->child[i].entry == entry) {
+            remove_slot(leaf, i);
+            break;
         }
     }
+    return leaf;
 }
 
-// Saves the tree to a file
+// Deletes an entry from the tree
 // tree: pointer to the R-tree
-// filename: name of the file to save the tree to
-void save_tree(RTree *tree, const char *filename) {
-    // Open the file for writing in binary mode
-    FILE *file = fopen(filename, "wb");
-    // If the file is successfully opened
-    if (file) {
-        // Save the root node to the file
-        save_node(file, tree->root);
-        // Close the file
-        fclose(file);
-        // Print a success message
-        printf("Tree saved successfully to %s\n", filename);
-    } else {
-        // Print an error message if the file could not be opened
-        printf("Failed to open file %s for writing\n", filename);
+// entry: pointer to the entry to delete; it still belongs to the caller
+void delete_entry(RTree *tree, Entry *entry) {
+    if (tree->read_only) {
+        fprintf(stderr, "Tree is read-only, delete ignored\n");
+        return;
     }
+    RTreeNode *leaf = remove_entry(tree, entry);
+    if (leaf == NULL) return;
+    // Dissolve underfull nodes and tighten rectangles on the way to the root
+    condense_tree(tree, &leaf, 1, 0);
 }
 
-// Loads a node from a file
-// file: pointer to the file to read from
-// Returns a pointer to the loaded R-tree node
-RTreeNode* load_node(FILE *file) {
-    // Declare a variable to store whether the node is a leaf
-    bool is_leaf;
-    // Read the is_leaf property from the file
+// Deletes several entries, condensing the tree once for the whole batch
+// tree: pointer to the R-tree
+// entries: array of pointers to the entries; they still belong to the caller
+// count: number of entries
+// Returns the number of entries found and deleted
+int delete_batch(RTree *tree, Entry **entries, int count) {
+    if (tree->read_only) {
+        fprintf(stderr, "Tree is read-only, delete ignored\n");
+        return 0;
+    }
+    // Underfull leaves stay linked until the condense, so every entry can
+    // still be found by its rectangle
+    RTreeNode **touched = (RTreeNode **)malloc(sizeof(RTreeNode *) * (count > 0 ? count : 1));
+    int removed = 0;
+    for (int i = 0; i < count; i++) {
+        RTreeNode *leaf = remove_entry(tree, entries[i]);
+        if (leaf != NULL) touched[removed++] = leaf;
+    }
+    condense_tree(tree, touched, removed, 0);
+    free(touched);
+    return removed;
+}
+
+// Checks whether a rectangle lies within the rectangle of a node's slot
+// node: pointer to the node
+// i: index of the slot
+// rect: pointer to the rectangle
+// Returns true if the slot's rectangle covers rect
+bool entry_covers(RTreeNode *node, int i, Rect *rect) {
+    coord_t (*max)[MAX_ENTRIES + 1] = NODE_MAX_ARRAYS(node);
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        if (rect->min[j] < node->min[j][i] || rect->max[j] > max[j][i]) return false;
+    }
+    return true;
+}
+
+// Moves an entry to a new rectangle. A short move, one that stays within the
+// rectangle of the leaf's parent, keeps the entry in its leaf and refreshes
+// the rectangles above it; a longer one removes the entry and inserts it
+// again where it now belongs.
+// tree: pointer to the R-tree
+// entry: pointer to an entry in the tree; its rect is updated
+// rect: pointer to the new rectangle
+// Returns true if the entry was found
+bool update_entry(RTree *tree, Entry *entry, Rect *rect) {
+    if (tree->read_only) {
+        fprintf(stderr, "Tree is read-only, update ignored\n");
+        return false;
+    }
+#ifdef RTREE_POINTS
+    if (!is_point(rect)) {
+        fprintf(stderr, "Rectangle is not a point, update ignored\n");
+        return false;
+    }
+#endif
+    RTreeNode *leaf = find_leaf(tree->root, entry);
+    if (leaf == NULL) return false;
+    int i = 0;
+    while (leaf->child[i].entry != entry) i++;
+
+    // A root leaf holds every entry, so any move stays in it. Otherwise the
+    // move is short if the new rectangle is inside the leaf's own rectangle,
+    // or inside its parent's when the parent is not the root
+    bool in_place = true;
+    RTreeNode *parent = leaf->parent;
+    if (parent != NULL && !entry_covers(parent, child_index(leaf), rect)) {
+        in_place = parent->parent != NULL && entry_covers(parent->parent, child_index(parent), rect);
+    }
+    entry->rect = *rect;
+    if (in_place) {
+        set_entry_rect(leaf, i, rect);
+        refresh_ancestors(leaf);
+        return true;
+    }
+
+    remove_slot(leaf, i);
+    condense_tree(tree, &leaf, 1, 0);
+    tree->reinserted_levels = 0;
+    NodeSlot slot = {entry->rect, {.entry = entry}};
+    insert_at_height(tree, &slot, 0);
+    return true;
+}
+
+// Reports a problem found by validate_tree; only the first few are printed
+// problems: pointer to the number of problems found so far
+// message: description of the problem
+// node: node where it was found
+void report_problem(long *problems, const char *message, RTreeNode *node) {
+    if (*problems < VALIDATE_MAX_REPORTS) fprintf(stderr, "Invalid tree: %s (node %p)\n", message, (void *)node);
+    (*problems)++;
+}
+
+// Checks the structure of a subtree, see validate_tree
+// tree: pointer to the R-tree
+// node: root of the subtree
+// depth: depth of node below the root
+// leaf_depth: depth of the first leaf found, or -1 before any
+// problems: pointer to the number of problems found so far
+// Returns the number of entries in the subtree
+long validate_node(RTree *tree, RTreeNode *node, int depth, int *leaf_depth, long *problems) {
+    if (node->num_entries > tree->max_entries) report_problem(problems, "node overflows", node);
+    if (node != tree->root && node->num_entries < tree->min_entries) report_problem(problems, "node underflows", node);
+    if (node->is_leaf) {
+        if (*leaf_depth < 0) *leaf_depth = depth;
+        else if (*leaf_depth != depth) report_problem(problems, "leaves at different depths", node);
+        for (int i = 0; i < node->num_entries; i++) {
+            Rect rect = entry_rect(node, i);
+            if (memcmp(&rect, &node->child[i].entry->rect, sizeof(Rect)) != 0) {
+                report_problem(problems, "leaf rectangle differs from its entry's", node);
+            }
+        }
+        return node->num_entries;
+    }
+    long entries = 0;
+    for (int i = 0; i < node->num_entries; i++) {
+        RTreeNode *child = node->child[i].node;
+        if (child->parent != node) report_problem(problems, "wrong parent pointer", child);
+        // Rectangles are kept exact, not just covering, by every change
+        if (child->num_entries > 0) {
+            Rect tight = node_bounding_box(child);
+            Rect rect = entry_rect(node, i);
+            if (memcmp(&tight, &rect, sizeof(Rect)) != 0) {
+                report_problem(problems, entry_covers(node, i, &tight) ? "loose rectangle" : "rectangle misses entries", child);
+            }
+        }
+        entries += validate_node(tree, child, depth + 1, leaf_depth, problems);
+    }
+    return entries;
+}
+
+// Checks the structure of a tree: every node within the fanout limits, all
+// leaves at one depth, parent pointers right, and every rectangle equal to
+// the bounding box of the node it describes. Prints the first few problems.
+// tree: pointer to the R-tree
+// Returns the number of problems found, 0 for a valid tree
+long validate_tree(RTree *tree) {
+    long problems = 0;
+    int leaf_depth = -1;
+    if (tree->root->parent != NULL) report_problem(&problems, "root has a parent", tree->root);
+    validate_node(tree, tree->root, 0, &leaf_depth, &problems);
+    return problems;
+}
+
+// Reads the query counters of a tree, summed over every thread; they are
+// updated only when built with RTREE_STATS
+// tree: pointer to the R-tree
+// Returns a copy of the counters
+QueryStats tree_query_stats(RTree *tree) {
+    QueryStats stats;
+    stats.queries = atomic_load(&tree->query_stats.queries);
+    stats.nodes_visited = atomic_load(&tree->query_stats.nodes_visited);
+    stats.entries_tested = atomic_load(&tree->query_stats.entries_tested);
+    stats.subtrees_pruned = atomic_load(&tree->query_stats.subtrees_pruned);
+    stats.max_queue_size = atomic_load(&tree->query_stats.max_queue_size);
+    return stats;
+}
+
+// Clears the query and insert counters of a tree; must not overlap queries
+// tree: pointer to the R-tree
+void reset_tree_stats(RTree *tree) {
+    atomic_init(&tree->query_stats.queries, 0);
+    atomic_init(&tree->query_stats.nodes_visited, 0);
+    atomic_init(&tree->query_stats.entries_tested, 0);
+    atomic_init(&tree->query_stats.subtrees_pruned, 0);
+    atomic_init(&tree->query_stats.max_queue_size, 0);
+    memset(&tree->insert_stats, 0, sizeof(InsertStats));
+}
+
+// Adds the nodes and entries of a subtree to a tree shape
+// node: root of the subtree
+// depth: depth of node below the root
+// shape: pointer to the shape being measured; leaf_fill and internal_fill
+// hold the total number of slots until tree_shape divides them
+void measure_node(RTreeNode *node, int depth, TreeShape *shape) {
+    if (node->is_leaf) {
+        shape->height = depth;
+        shape->leaves++;
+        shape->entries += node->num_entries;
+        shape->leaf_fill += node->num_entries;
+        return;
+    }
+    shape->internal_nodes++;
+    shape->internal_fill += node->num_entries;
+    for (int i = 0; i < node->num_entries; i++) measure_node(node->child[i].node, depth + 1, shape);
+}
+
+// Measures the height of a tree and how full its nodes are, to spot a tree
+// that degrades under changes. Walks every node, so it is not for hot paths.
+// tree: pointer to the R-tree
+// Returns the shape of the tree
+TreeShape tree_shape(RTree *tree) {
+    TreeShape shape;
+    memset(&shape, 0, sizeof(TreeShape));
+    measure_node(tree->root, 0, &shape);
+    shape.leaf_fill /= (double)shape.leaves * tree->max_entries;
+    if (shape.internal_nodes > 0) shape.internal_fill /= (double)shape.internal_nodes * tree->max_entries;
+    return shape;
+}
+
+// Measures the area a node's entries share and the area none of them covers
+// node: pointer to a node with at least one entry
+// rect: pointer to the node's rectangle
+// overlap: receives the area shared by pairs of entries
+// dead_space: receives the area of rect covered by no entry, estimated by
+// inclusion-exclusion over pairs and clamped to [0, area of rect]
+void measure_waste(RTreeNode *node, Rect *rect, double *overlap, double *dead_space) {
+    double covered = 0, shared = 0;
+    for (int i = 0; i < node->num_entries; i++) {
+        Rect a = entry_rect(node, i);
+        covered += rect_area(&a);
+        for (int k = i + 1; k < node->num_entries; k++) {
+            Rect b = entry_rect(node, k);
+            shared += overlap_area(&a, &b);
+        }
+    }
+    double area = rect_area(rect);
+    double dead = area - covered + shared;
+    *overlap = shared;
+    *dead_space = dead < 0 ? 0 : dead > area ? area : dead;
+}
+
+// Adds the nodes of a subtree to a tree quality report
+// node: root of the subtree
+// rect: pointer to the node's rectangle
+// height: height of node above the leaves
+// quality: pointer to the report; fill holds the number of entries until
+// analyze_tree divides it
+void measure_quality(RTreeNode *node, Rect *rect, int height, TreeQuality *quality) {
+    double overlap = 0, dead_space = 0;
+    if (node->num_entries > 0) measure_waste(node, rect, &overlap, &dead_space);
+    if (height < QUALITY_MAX_LEVELS) {
+        LevelQuality *level = &quality->levels[height];
+        level->nodes++;
+        level->entries += node->num_entries;
+        level->area += node->num_entries > 0 ? rect_area(rect) : 0;
+        level->dead_space += dead_space;
+        // Overlap between children counts at the children's level; overlap
+        // between the entries of a leaf belongs to the data, not the tree
+        if (height > 0) level[-1].overlap += overlap;
+    }
+    if (node->is_leaf) return;
+    for (int i = 0; i < node->num_entries; i++) {
+        Rect child = entry_rect(node, i);
+        measure_quality(node->child[i].node, &child, height - 1, quality);
+    }
+}
+
+// Measures how well a tree is packed, level by level: how full the nodes
+// are, how much sibling nodes overlap and how much of their area is empty.
+// Trees built by many inserts drift from the tight, full nodes of a bulk
+// load; rebuild_tree and repack_subtrees restore them. Walks every node and
+// compares the entries of each node pairwise, so it is not for hot paths.
+// tree: pointer to the R-tree
+// Returns the quality report
+TreeQuality analyze_tree(RTree *tree) {
+    TreeQuality quality;
+    memset(&quality, 0, sizeof(TreeQuality));
+    quality.height = node_height(tree->root);
+    Rect rect = node_bounding_box(tree->root);
+    measure_quality(tree->root, &rect, quality.height, &quality);
+    for (int h = 0; h <= quality.height && h < QUALITY_MAX_LEVELS; h++) {
+        LevelQuality *level = &quality.levels[h];
+        level->fill = (double)level->entries / ((double)level->nodes * tree->max_entries);
+        quality.overlap += level->overlap;
+        quality.dead_space += level->dead_space;
+    }
+    return quality;
+}
+
+// Counts the entries in the leaves of a subtree
+// node: root of the subtree
+// Returns the number of entries
+int count_subtree_entries(RTreeNode *node) {
+    if (node->is_leaf) return node->num_entries;
+    int count = 0;
+    for (int i = 0; i < node->num_entries; i++) count += count_subtree_entries(node->child[i].node);
+    return count;
+}
+
+// Moves the leaf entries of a subtree into pack items and releases its nodes
+// tree: pointer to the R-tree owning the nodes
+// node: root of a subtree no longer needed by the tree
+// items: output array with room for every entry of the subtree
+// count: pointer to the number of items filled so far; advanced
+void take_subtree_items(RTree *tree, RTreeNode *node, PackItem *items, int *count) {
+    for (int i = 0; i < node->num_entries; i++) {
+        if (node->is_leaf) {
+            items[(*count)++].slot = take_slot(node, i);
+        } else {
+            take_subtree_items(tree, node->child[i].node, items, count);
+        }
+    }
+    release_node(tree, node);
+}
+
+// Repacks a whole tree bottom-up with Sort-Tile-Recursive ordering, giving
+// it the full, tight nodes of bulk_load without building a new tree, so its
+// settings, counters and released pages are kept. To rebuild a tree while
+// other threads query it, use concurrent_rebuild (concurrent_tree.h).
+// tree: pointer to the R-tree
+void rebuild_tree(RTree *tree) {
+    if (tree->read_only) {
+        fprintf(stderr, "Tree is read-only, rebuild ignored\n");
+        return;
+    }
+    int count = count_subtree_entries(tree->root);
+    if (count == 0) return;
+    PackItem *items = (PackItem *)malloc(sizeof(PackItem) * count);
+    NodeSlot *parents = (NodeSlot *)malloc(sizeof(NodeSlot) * count);
+    int taken = 0;
+    take_subtree_items(tree, tree->root, items, &taken);
+    pack_levels(tree, items, count, BULK_LOAD_STR, INT_MAX, 1, parents);
+    tree->root = parents[0].child.node;
+    free(parents);
+    free(items);
+}
+
+// Sums the overlap between children and the dead space of every node of a
+// subtree, the area that makes queries visit nodes in vain
+// node: root of the subtree
+// rect: pointer to the node's rectangle
+// Returns the summed area
+double subtree_waste(RTreeNode *node, Rect *rect) {
+    double overlap, dead_space;
+    measure_waste(node, rect, &overlap, &dead_space);
+    if (node->is_leaf) return dead_space;
+    double waste = overlap + dead_space;
+    for (int i = 0; i < node->num_entries; i++) {
+        Rect child = entry_rect(node, i);
+        waste += subtree_waste(node->child[i].node, &child);
+    }
+    return waste;
+}
+
+// Collects the subtrees at a given height, below the root, with the space
+// each wastes
+// node: current node
+// node_height: height of node above the leaves
+// height: height of the subtrees to collect
+// candidates: pointer to the growing array of candidates
+// count: pointer to the number of candidates collected
+// capacity: pointer to the capacity of the array
+void collect_repack_candidates(RTreeNode *node, int node_height, int height, RepackCandidate **candidates, int *count, int *capacity) {
+    for (int i = 0; i < node->num_entries; i++) {
+        RTreeNode *child = node->child[i].node;
+        if (node_height - 1 > height) {
+            collect_repack_candidates(child, node_height - 1, height, candidates, count, capacity);
+            continue;
+        }
+        if (*count == *capacity) {
+            *capacity = *capacity ? *capacity * 2 : 64;
+            *candidates = (RepackCandidate *)realloc(*candidates, sizeof(RepackCandidate) * *capacity);
+        }
+        Rect rect = entry_rect(node, i);
+        (*candidates)[*count].waste = subtree_waste(child, &rect);
+        (*candidates)[*count].node = child;
+        (*count)++;
+    }
+}
+
+// Compares two repack candidates, most waste first
+// Returns a negative, zero or positive value as for qsort
+int compare_repack_candidates(const void *a, const void *b) {
+    double wa = ((const RepackCandidate *)a)->waste;
+    double wb = ((const RepackCandidate *)b)->waste;
+    return (wa < wb) - (wa > wb);
+}
+
+// Repacks the subtrees at a given height that waste the most space (overlap
+// and dead space, see analyze_tree), a cheaper alternative to rebuilding the
+// whole tree. Each subtree is taken out, its entries are packed bottom-up
+// with Sort-Tile-Recursive ordering into full nodes, and those nodes are
+// inserted back at their height; parents left underfull are condensed.
+// To repack while other threads query, use concurrent_repack.
+// tree: pointer to the R-tree
+// height: height of the subtrees above the leaves, at least 1; at or above
+// the root's height the whole tree is rebuilt
+// count: number of subtrees to repack
+// Returns the number of subtrees repacked
+int repack_subtrees(RTree *tree, int height, int count) {
+    if (tree->read_only) {
+        fprintf(stderr, "Tree is read-only, repack ignored\n");
+        return 0;
+    }
+    if (height < 1) height = 1;
+    int root_height = node_height(tree->root);
+    if (height >= root_height) {
+        rebuild_tree(tree);
+        return 1;
+    }
+
+    // Rank the subtrees at that height by the space they waste
+    RepackCandidate *candidates = NULL;
+    int num_candidates = 0, capacity = 0;
+    collect_repack_candidates(tree->root, root_height, height, &candidates, &num_candidates, &capacity);
+    qsort(candidates, num_candidates, sizeof(RepackCandidate), compare_repack_candidates);
+    if (count > num_candidates) count = num_candidates;
+
+    // Take the worst subtrees out, keeping their entries in one array with a
+    // run per subtree. A parent keeps its last child so no node ends up
+    // empty; the rectangles above are refreshed right away, so they stay
+    // exact through the inserts below.
+    int total = 0;
+    for (int c = 0; c < count; c++) total += count_subtree_entries(candidates[c].node);
+    PackItem *items = (PackItem *)malloc(sizeof(PackItem) * (total > 0 ? total : 1));
+    int *starts = (int *)malloc(sizeof(int) * (count + 1));
+    RTreeNode **touched = (RTreeNode **)malloc(sizeof(RTreeNode *) * (count > 0 ? count : 1));
+    int repacked = 0, taken = 0;
+    for (int c = 0; c < count; c++) {
+        RTreeNode *node = candidates[c].node;
+        RTreeNode *parent = node->parent;
+        if (parent->num_entries == 1) continue;
+        remove_slot(parent, child_index(node));
+        refresh_ancestors(parent);
+        starts[repacked] = taken;
+        take_subtree_items(tree, node, items, &taken);
+        touched[repacked++] = parent;
+    }
+    starts[repacked] = taken;
+
+    // Pack each subtree's entries on their own, so distant subtrees don't
+    // share nodes, up to nodes no taller than the subtree's children, and
+    // insert the top nodes where they fit best
+    NodeSlot *parents = (NodeSlot *)malloc(sizeof(NodeSlot) * (total > 0 ? total : 1));
+    for (int r = 0; r < repacked; r++) {
+        int num_parents = pack_levels(tree, items + starts[r], starts[r + 1] - starts[r], BULK_LOAD_STR, height, tree->max_entries, parents);
+        int top_height = node_height(parents[0].child.node);
+        for (int i = 0; i < num_parents; i++) {
+            tree->reinserted_levels = 0;
+            insert_at_height(tree, &parents[i], top_height + 1);
+        }
+    }
+
+    // Dissolve the parents left underfull
+    condense_tree(tree, touched, repacked, height + 1);
+    free(parents);
+    free(touched);
+    free(starts);
+    free(items);
+    free(candidates);
+    return repacked;
+}
+
+// Computes the minimum distance from a point to a rectangle
+// rect: pointer to the rectangle
+// point: array representing the point, one coordinate per dimension
+// Returns the minimum distance from the point to the rectangle
+dist_t min_distance(Rect *rect, coord_t point[RTREE_DIMS]) {
+    dist_t sum = 0;
+    // Add up the squared distance on each axis
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        dist_t d = 0;
+        if (point[j] < rect->min[j]) d = (dist_t)rect->min[j] - point[j];
+        else if (point[j] > rect->max[j]) d = (dist_t)point[j] - rect->max[j];
+        sum += d * d;
+    }
+    // Return the Euclidean distance
+    return DIST_SQRT(sum);
+}
+
+// Creates a reusable query context
+// Returns a context with small initial buffers that grow as queries need them
+QueryContext* create_query_context(void) {
+    QueryContext *ctx = (QueryContext *)malloc(sizeof(QueryContext));
+    init_priority_queue(&ctx->queue, 64);
+    init_result_heap(&ctx->results, 16);
+    memset(&ctx->stats, 0, sizeof(QueryStats));
+    return ctx;
+}
+
+// Adds the work of one query to a context's counters and, atomically, to the
+// counters of the tree it ran on
+// ctx: query context, or NULL
+// tree: pointer to the R-tree
+// stats: pointer to the work of the query
+void add_query_stats(QueryContext *ctx, RTree *tree, QueryStats *stats) {
+    if (ctx != NULL) {
+        ctx->stats.queries += stats->queries;
+        ctx->stats.nodes_visited += stats->nodes_visited;
+        ctx->stats.entries_tested += stats->entries_tested;
+        ctx->stats.subtrees_pruned += stats->subtrees_pruned;
+        if (stats->max_queue_size > ctx->stats.max_queue_size) ctx->stats.max_queue_size = stats->max_queue_size;
+    }
+    SharedQueryStats *shared = &tree->query_stats;
+    atomic_fetch_add_explicit(&shared->queries, stats->queries, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->nodes_visited, stats->nodes_visited, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->entries_tested, stats->entries_tested, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shared->subtrees_pruned, stats->subtrees_pruned, memory_order_relaxed);
+    long largest = atomic_load_explicit(&shared->max_queue_size, memory_order_relaxed);
+    while (stats->max_queue_size > largest &&
+           !atomic_compare_exchange_weak_explicit(&shared->max_queue_size, &largest, stats->max_queue_size,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Frees a query context
+// ctx: pointer to the context
+void free_query_context(QueryContext *ctx) {
+    free_priority_queue(&ctx->queue);
+    free_result_heap(&ctx->results);
+    free(ctx);
+}
+
+// Returns the factor squared distances are scaled by before pruning
+// options: approximation options, or NULL for exact queries
+// Returns (1 + epsilon)^2, or 1 for exact queries
+dist_t approx_scale(const NearestOptions *options) {
+    if (options == NULL || options->epsilon <= 0) return 1;
+    return (dist_t)((1.0 + options->epsilon) * (1.0 + options->epsilon));
+}
+
+// Finds the nearest neighbor to a given point using a query context
+// ctx: query context whose buffers are reused
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// Returns the nearest neighbor entry to the point
+Entry* nearest_neighbor_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS]) {
+    return nearest_neighbor_approx_ctx(ctx, tree, point, NULL, NULL);
+}
+
+// Finds an approximate nearest neighbor to a given point using a query context
+// ctx: query context whose buffers are reused
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// options: allowed error and node budget, or NULL for the exact answer
+// exact: receives whether the answer is certainly the nearest, or NULL
+// Returns the nearest neighbor entry found
+Entry* nearest_neighbor_approx_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS],
+                                   const NearestOptions *options, bool *exact) {
+    // Reuse the context's priority queue for the search
+    PriorityQueue *pq = &ctx->queue;
+    pq->size = 0;
+    // Push the root node into the priority queue with distance 0
+    priority_queue_push(pq, tree->root, 0);
+    // Initialize the nearest neighbor and its squared distance; squared
+    // distances order the same way, so no square root is taken in the loop
+    Entry *nearest = NULL;
+    dist_t nearest_distance = DIST_MAX;
+    dist_t distances[MAX_ENTRIES + 1];
+    // Nodes are pruned once (1 + epsilon) times their distance reaches the best one
+    dist_t scale = approx_scale(options);
+    long max_nodes = options != NULL ? options->max_nodes : 0;
+    long visited = 0;
+    // Closest subtree skipped that an exact search would have visited
+    dist_t closest_skipped = DIST_MAX;
+#ifdef RTREE_STATS
+    // One query, with the root in the queue
+    QueryStats stats = {1, 0, 0, 0, 1};
+#endif
+
+    // While there are nodes in the priority queue
+    while (pq->size > 0) {
+        // Out of budget: stop, unless no answer has been found yet
+        if (max_nodes > 0 && visited >= max_nodes && nearest != NULL) {
+            if (pq->nodes[0].distance < closest_skipped) closest_skipped = pq->nodes[0].distance;
+            STATS_ADD(stats.subtrees_pruned, pq->size);
+            break;
+        }
+
+        // Pop the node with the smallest distance
+        PriorityQueueNode pq_node = priority_queue_pop(pq);
+
+        // Every remaining node is at least this far, so none can be nearer
+        // (or nearer by more than the allowed error)
+        if (pq_node.distance * scale >= nearest_distance) {
+            if (pq_node.distance < closest_skipped) closest_skipped = pq_node.distance;
+            STATS_ADD(stats.subtrees_pruned, pq->size + 1);
+            break;
+        }
+
+        // Get the current node
+        RTreeNode *node = pq_node.node;
+        visited++;
+        STATS_ADD(stats.nodes_visited, 1);
+        STATS_ADD(stats.entries_tested, node->num_entries);
+        // Compute the squared distance from the point to every entry in one pass
+        node_min_dist2(node, point, distances);
+        // Iterate over each entry in the node
+        for (int i = 0; i < node->num_entries; i++) {
+            if (node->is_leaf) {
+                // If the distance is smaller than the nearest distance, update
+                // the nearest neighbor and distance
+                if (distances[i] < nearest_distance) {
+                    nearest = node->child[i].entry;
+                    nearest_distance = distances[i];
+                }
+            } else if (distances[i] * scale < nearest_distance) {
+                // If the node is not a leaf, push the child node into the priority queue
+                priority_queue_push(pq, node->child[i].node, distances[i]);
+                STATS_MAX(stats.max_queue_size, pq->size);
+            } else {
+                if (distances[i] < closest_skipped) closest_skipped = distances[i];
+                STATS_ADD(stats.subtrees_pruned, 1);
+            }
+        }
+    }
+#ifdef RTREE_STATS
+    add_query_stats(ctx, tree, &stats);
+#endif
+
+    // The answer is exact if nothing skipped could have held a nearer entry
+    if (exact != NULL) *exact = closest_skipped >= nearest_distance;
+    // Return the nearest neighbor
+    return nearest;
+}
+
+// Finds the nearest neighbor to a given point
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// Returns the nearest neighbor entry to the point
+Entry* nearest_neighbor(RTree *tree, coord_t point[RTREE_DIMS]) {
+    // One-off query: use a temporary context
+    QueryContext *ctx = create_query_context();
+    Entry *nearest = nearest_neighbor_ctx(ctx, tree, point);
+    free_query_context(ctx);
+    return nearest;
+}
+
+// Finds an approximate nearest neighbor to a given point
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// options: allowed error and node budget, or NULL for the exact answer
+// exact: receives whether the answer is certainly the nearest, or NULL
+// Returns the nearest neighbor entry found
+Entry* nearest_neighbor_approx(RTree *tree, coord_t point[RTREE_DIMS], const NearestOptions *options, bool *exact) {
+    QueryContext *ctx = create_query_context();
+    Entry *nearest = nearest_neighbor_approx_ctx(ctx, tree, point, options, exact);
+    free_query_context(ctx);
+    return nearest;
+}
+
+// Finds the k nearest neighbors of a point using a query context
+// ctx: query context whose buffers are reused
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// k: number of neighbors wanted
+// out: receives up to k entries, nearest first
+// Returns the number of entries written to out (less than k if the tree is smaller)
+int knn_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out) {
+    return knn_approx_ctx(ctx, tree, point, k, out, NULL, NULL);
+}
+
+// Finds approximate k nearest neighbors of a point using a query context. The
+// i-th entry returned is at most (1 + epsilon) times as far as the true i-th
+// nearest, unless the node budget ran out.
+// ctx: query context whose buffers are reused
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// k: number of neighbors wanted
+// out: receives up to k entries, nearest first
+// options: allowed error and node budget, or NULL for the exact answer
+// exact: receives whether the entries are certainly the k nearest, or NULL
+// Returns the number of entries written to out (less than k if the tree is smaller)
+int knn_approx_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out,
+                   const NearestOptions *options, bool *exact) {
+    if (exact != NULL) *exact = true;
+    if (k <= 0) return 0;
+    // Nodes still to visit, closest first, and the k closest entries so far
+    PriorityQueue *pq = &ctx->queue;
+    ResultHeap *results = &ctx->results;
+    pq->size = 0;
+    result_heap_reset(results, k);
+    dist_t distances[MAX_ENTRIES + 1];
+    priority_queue_push(pq, tree->root, 0);
+    // Nodes are pruned once (1 + epsilon) times their distance reaches the k-th best
+    dist_t scale = approx_scale(options);
+    long max_nodes = options != NULL ? options->max_nodes : 0;
+    long visited = 0;
+    // Closest subtree skipped that an exact search would have visited
+    dist_t closest_skipped = DIST_MAX;
+#ifdef RTREE_STATS
+    // One query, with the root in the queue
+    QueryStats stats = {1, 0, 0, 0, 1};
+#endif
+
+    while (pq->size > 0) {
+        // Out of budget: stop, unless fewer than k entries have been found
+        if (max_nodes > 0 && visited >= max_nodes && results->size == k) {
+            if (pq->nodes[0].distance < closest_skipped) closest_skipped = pq->nodes[0].distance;
+            STATS_ADD(stats.subtrees_pruned, pq->size);
+            break;
+        }
+
+        PriorityQueueNode pq_node = priority_queue_pop(pq);
+        // Every remaining node is at least this far, so none can improve the
+        // results (by more than the allowed error)
+        if (pq_node.distance * scale >= result_heap_bound(results)) {
+            if (pq_node.distance < closest_skipped) closest_skipped = pq_node.distance;
+            STATS_ADD(stats.subtrees_pruned, pq->size + 1);
+            break;
+        }
+
+        RTreeNode *node = pq_node.node;
+        visited++;
+        STATS_ADD(stats.nodes_visited, 1);
+        STATS_ADD(stats.entries_tested, node->num_entries);
+        // Squared distances order the same way as distances
+        node_min_dist2(node, point, distances);
+        for (int i = 0; i < node->num_entries; i++) {
+            if (node->is_leaf) {
+                result_heap_offer(results, node->child[i].entry, distances[i]);
+            } else if (distances[i] * scale < result_heap_bound(results)) {
+                priority_queue_push(pq, node->child[i].node, distances[i]);
+                STATS_MAX(stats.max_queue_size, pq->size);
+            } else {
+                if (distances[i] < closest_skipped) closest_skipped = distances[i];
+                STATS_ADD(stats.subtrees_pruned, 1);
+            }
+        }
+    }
+#ifdef RTREE_STATS
+    add_query_stats(ctx, tree, &stats);
+#endif
+
+    // The results are exact if nothing skipped could have held a nearer entry
+    if (exact != NULL) *exact = closest_skipped >= result_heap_bound(results);
+    // Pop the farthest result first so out ends up sorted nearest first
+    int found = results->size;
+    for (int i = found - 1; i >= 0; i--) out[i] = result_heap_pop(results).entry;
+    return found;
+}
+
+// Finds the k nearest neighbors of a point
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// k: number of neighbors wanted
+// out: receives up to k entries, nearest first
+// Returns the number of entries written to out (less than k if the tree is smaller)
+int knn(RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out) {
+    // One-off query: use a temporary context
+    QueryContext *ctx = create_query_context();
+    int found = knn_ctx(ctx, tree, point, k, out);
+    free_query_context(ctx);
+    return found;
+}
+
+// Finds approximate k nearest neighbors of a point
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// k: number of neighbors wanted
+// out: receives up to k entries, nearest first
+// options: allowed error and node budget, or NULL for the exact answer
+// exact: receives whether the entries are certainly the k nearest, or NULL
+// Returns the number of entries written to out (less than k if the tree is smaller)
+int knn_approx(RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out, const NearestOptions *options, bool *exact) {
+    QueryContext *ctx = create_query_context();
+    int found = knn_approx_ctx(ctx, tree, point, k, out, options, exact);
+    free_query_context(ctx);
+    return found;
+}
+
+// Creates a cursor that returns the entries of a tree nearest first
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// Returns the cursor, positioned before the nearest entry
+NearestCursor* create_nearest_cursor(RTree *tree, coord_t point[RTREE_DIMS]) {
+    NearestCursor *cursor = (NearestCursor *)malloc(sizeof(NearestCursor));
+    init_priority_queue(&cursor->nodes, 64);
+    init_priority_queue(&cursor->entries, 64);
+    nearest_cursor_restart(cursor, tree, point);
+    return cursor;
+}
+
+// Starts a cursor over again, keeping its buffers
+// cursor: pointer to the cursor
+// tree: pointer to the R-tree to browse
+// point: array representing the point, one coordinate per dimension
+void nearest_cursor_restart(NearestCursor *cursor, RTree *tree, coord_t point[RTREE_DIMS]) {
+    cursor->tree = tree;
+    for (int d = 0; d < RTREE_DIMS; d++) cursor->point[d] = point[d];
+    cursor->nodes.size = 0;
+    cursor->entries.size = 0;
+    priority_queue_push(&cursor->nodes, tree->root, 0);
+#ifdef RTREE_STATS
+    // One query, with the root in the queue
+    QueryStats stats = {1, 0, 0, 0, 1};
+    add_query_stats(NULL, tree, &stats);
+#endif
+}
+
+// Returns the next entry of a cursor in order of distance. Nodes are expanded
+// only until the closest one left is no nearer than the closest entry found,
+// so each call does just the work needed for one more entry.
+// cursor: pointer to the cursor
+// distance: receives the distance of the entry from the point, or NULL
+// Returns the next nearest entry, or NULL once every entry has been returned
+Entry* nearest_cursor_next(NearestCursor *cursor, dist_t *distance) {
+    PriorityQueue *nodes = &cursor->nodes;
+    PriorityQueue *entries = &cursor->entries;
+    dist_t distances[MAX_ENTRIES + 1];
+#ifdef RTREE_STATS
+    QueryStats stats = {0, 0, 0, 0, 0};
+#endif
+
+    // An entry can be returned once no unexpanded node could hold a nearer one
+    while (nodes->size > 0 &&
+           (entries->size == 0 || nodes->nodes[0].distance < entries->nodes[0].distance)) {
+        RTreeNode *node = priority_queue_pop(nodes).node;
+        STATS_ADD(stats.nodes_visited, 1);
+        STATS_ADD(stats.entries_tested, node->num_entries);
+        // Squared distances order the same way as distances
+        node_min_dist2(node, cursor->point, distances);
+        for (int i = 0; i < node->num_entries; i++) {
+            if (node->is_leaf) {
+                priority_queue_push_entry(entries, node->child[i].entry, distances[i]);
+            } else {
+                priority_queue_push(nodes, node->child[i].node, distances[i]);
+                STATS_MAX(stats.max_queue_size, nodes->size);
+            }
+        }
+    }
+#ifdef RTREE_STATS
+    add_query_stats(NULL, cursor->tree, &stats);
+#endif
+
+    if (entries->size == 0) return NULL;
+    PriorityQueueNode next = priority_queue_pop(entries);
+    if (distance != NULL) *distance = DIST_SQRT(next.distance);
+    return next.entry;
+}
+
+// Frees a cursor; the tree and its entries are left alone
+// cursor: pointer to the cursor
+void free_nearest_cursor(NearestCursor *cursor) {
+    free_priority_queue(&cursor->nodes);
+    free_priority_queue(&cursor->entries);
+    free(cursor);
+}
+
+// Reports the entries of a subtree within a squared distance of a point
+// node: pointer to the current R-tree node
+// point: array representing the point, one coordinate per dimension
+// radius2: squared search radius
+// callback: function to call for each entry within the radius
+void within_distance_node(RTreeNode *node, coord_t point[RTREE_DIMS], dist_t radius2, void (*callback)(Entry *)) {
+    dist_t distances[MAX_ENTRIES + 1];
+    node_min_dist2(node, point, distances);
+    for (int i = 0; i < node->num_entries; i++) {
+        // Skip entries and subtrees entirely outside the radius
+        if (distances[i] > radius2) continue;
+        if (node->is_leaf) {
+            callback(node->child[i].entry);
+        } else {
+            within_distance_node(node->child[i].node, point, radius2, callback);
+        }
+    }
+}
+
+// Reports every entry within a distance of a point
+// tree: pointer to the R-tree
+// point: array representing the point, one coordinate per dimension
+// radius: search radius; entries whose rectangle is at most this far are reported
+// callback: function to call for each entry within the radius
+void within_distance(RTree *tree, coord_t point[RTREE_DIMS], dist_t radius, void (*callback)(Entry *)) {
+    if (radius < 0) return;
+    within_distance_node(tree->root, point, radius * radius, callback);
+}
+
+// Query index paired with its position along the Hilbert curve
+typedef struct QueryKey {
+    // Hilbert index of the query's center
+    double key;
+    // Position of the query in the caller's array
+    int index;
+} QueryKey;
+
+// Compares two query keys by key
+// Returns a negative, zero or positive value as for qsort
+int compare_query_keys(const void *a, const void *b) {
+    double ka = ((const QueryKey *)a)->key;
+    double kb = ((const QueryKey *)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+// Orders queries along a Hilbert curve through their centers, so that
+// consecutive queries touch mostly the same nodes
+// centers: center of each query
+// count: number of queries
+// Returns a newly allocated array of query indices in curve order
+int* order_queries(double (*centers)[RTREE_DIMS], int count) {
+    // Find the extent of the centers
+    double lo[RTREE_DIMS], hi[RTREE_DIMS];
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        lo[j] = DBL_MAX;
+        hi[j] = -DBL_MAX;
+    }
+    for (int q = 0; q < count; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            if (centers[q][j] < lo[j]) lo[j] = centers[q][j];
+            if (centers[q][j] > hi[j]) hi[j] = centers[q][j];
+        }
+    }
+    // Map each center onto the same grid bulk loading uses and sort by curve position
+    const int bits = 52 / RTREE_DIMS < 16 ? 52 / RTREE_DIMS : 16;
+    const double cells = (double)((1u << bits) - 1);
+    QueryKey *keys = (QueryKey *)malloc(sizeof(QueryKey) * count);
+    for (int q = 0; q < count; q++) {
+        uint32_t cell[RTREE_DIMS];
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            double extent = hi[j] - lo[j];
+            cell[j] = extent > 0.0 ? (uint32_t)((centers[q][j] - lo[j]) / extent * cells) : 0;
+        }
+        keys[q].key = (double)hilbert_index(cell, bits);
+        keys[q].index = q;
+    }
+    parallel_sort(keys, (size_t)count, sizeof(QueryKey), compare_query_keys);
+
+    int *order = (int *)malloc(sizeof(int) * count);
+    for (int q = 0; q < count; q++) order[q] = keys[q].index;
+    free(keys);
+    return order;
+}
+
+// Runs the active queries of a batch against one node and its subtree
+// node: pointer to the current R-tree node
+// rects: query rectangles of the whole batch
+// active: indices of the queries whose rectangles overlap this node
+// num_active: number of active queries
+// masks: scratch space for this level's overlap masks
+// stride: size of each level's scratch; the next level's active list and
+//         masks start stride elements further on
+// callback: function to call with the query index and each overlapping entry
+void search_batch_node(RTreeNode *node, Rect *rects, int *active, int num_active, NodeMask *masks, int stride, void (*callback)(int, Entry *)) {
+    // Test every active query against all entries of the node while it is in cache
+    for (int a = 0; a < num_active; a++) masks[a] = node_overlap_mask(node, &rects[active[a]]);
+
+    if (node->is_leaf) {
+        for (int a = 0; a < num_active; a++) {
+            int i;
+            NODE_MASK_FOREACH(masks[a], i) {
+                callback(active[a], node->child[i].entry);
+            }
+        }
+        return;
+    }
+
+    // Descend into each child once, with the queries that overlap it
+    int *child_active = active + stride;
+    for (int i = 0; i < node->num_entries; i++) {
+        int num_child_active = 0;
+        for (int a = 0; a < num_active; a++) {
+            if ((masks[a].bits[i / 64] >> (i % 64)) & 1) child_active[num_child_active++] = active[a];
+        }
+        if (num_child_active > 0) {
+            search_batch_node(node->child[i].node, rects, child_active, num_child_active, masks + stride, stride, callback);
+        }
+    }
+}
+
+// Searches the tree for entries overlapping each of a batch of rectangles.
+// The tree is walked once for the whole batch, carrying at each node only the
+// queries that overlap it, so every node is loaded once per batch instead of
+// once per query.
+// tree: pointer to the R-tree
+// rects: array of query rectangles
+// count: number of query rectangles
+// callback: function to call with the query's index in rects and each overlapping entry
+void search_batch(RTree *tree, Rect *rects, int count, void (*callback)(int, Entry *)) {
+    if (count <= 0) return;
+    // Sort the queries spatially so the active lists stay coherent
+    double (*centers)[RTREE_DIMS] = malloc(sizeof(double[RTREE_DIMS]) * count);
+    for (int q = 0; q < count; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) centers[q][j] = ((double)rects[q].min[j] + rects[q].max[j]) / 2.0;
+    }
+    int *order = order_queries(centers, count);
+    free(centers);
+
+    // One active list and one set of masks per level of the tree
+    int levels = node_height(tree->root) + 1;
+    int *active = (int *)malloc(sizeof(int) * count * levels);
+    NodeMask *masks = (NodeMask *)malloc(sizeof(NodeMask) * count * levels);
+    memcpy(active, order, sizeof(int) * count);
+    free(order);
+
+    search_batch_node(tree->root, rects, active, count, masks, count, callback);
+
+    free(active);
+    free(masks);
+}
+
+// Finds the nearest neighbor of each of a batch of points. The points are
+// visited in Hilbert order with one shared query context, so consecutive
+// searches reuse the nodes the previous one brought into cache.
+// tree: pointer to the R-tree
+// points: array of query points
+// count: number of query points
+// out: receives the nearest entry of each point, in the order of points
+void nearest_neighbor_batch(RTree *tree, coord_t (*points)[RTREE_DIMS], int count, Entry **out) {
+    if (count <= 0) return;
+    double (*centers)[RTREE_DIMS] = malloc(sizeof(double[RTREE_DIMS]) * count);
+    for (int q = 0; q < count; q++) {
+        for (int j = 0; j < RTREE_DIMS; j++) centers[q][j] = points[q][j];
+    }
+    int *order = order_queries(centers, count);
+    free(centers);
+
+    QueryContext *ctx = create_query_context();
+    for (int q = 0; q < count; q++) out[order[q]] = nearest_neighbor_ctx(ctx, tree, points[order[q]]);
+    free_query_context(ctx);
+    free(order);
+}
+
+// Intersects two overlapping rectangles
+// r1: pointer to the first rectangle
+// r2: pointer to the second rectangle
+// Returns the rectangle covered by both
+Rect intersect_rects(Rect *r1, Rect *r2) {
+    Rect rect;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        rect.min[j] = r1->min[j] > r2->min[j] ? r1->min[j] : r2->min[j];
+        rect.max[j] = r1->max[j] < r2->max[j] ? r1->max[j] : r2->max[j];
+    }
+    return rect;
+}
+
+// Joins two subtrees whose rectangles overlap, descending both together.
+// Only entries overlapping the intersection of the two rectangles can pair
+// with anything on the other side, so the rest are skipped. The taller
+// subtree is descended alone until both are at the same height; then each
+// remaining entry of one side is tested against all of the other at once.
+// job: shared state of the join
+// a: subtree of the first tree
+// height_a: height of a above the leaves
+// b: subtree of the second tree
+// height_b: height of b above the leaves
+// window: pointer to the intersection of the rectangles of a and b
+// worker: index of the worker running the join, passed to worker_callback
+void join_nodes(JoinJob *job, RTreeNode *a, int height_a, RTreeNode *b, int height_b, Rect *window, int worker) {
+    // A parallel join stops at pairs small enough for one task
+    if (job->split_height >= 0 && height_a <= job->split_height && height_b <= job->split_height) {
+        if (job->num_pairs == job->pair_capacity) {
+            job->pair_capacity = job->pair_capacity ? job->pair_capacity * 2 : 64;
+            job->pairs = (JoinPair *)realloc(job->pairs, sizeof(JoinPair) * job->pair_capacity);
+        }
+        JoinPair *pair = &job->pairs[job->num_pairs++];
+        pair->a = a;
+        pair->height_a = height_a;
+        pair->b = b;
+        pair->height_b = height_b;
+        pair->window = *window;
+        return;
+    }
+    NodeMask hits_a = node_overlap_mask(a, window);
+    int i, k;
+    if (height_a > height_b) {
+        NODE_MASK_FOREACH(hits_a, i) {
+            Rect rect = entry_rect(a, i);
+            Rect child_window = intersect_rects(&rect, window);
+            join_nodes(job, a->child[i].node, height_a - 1, b, height_b, &child_window, worker);
+        }
+        return;
+    }
+    NodeMask hits_b = node_overlap_mask(b, window);
+    if (height_b > height_a) {
+        NODE_MASK_FOREACH(hits_b, k) {
+            Rect rect = entry_rect(b, k);
+            Rect child_window = intersect_rects(&rect, window);
+            join_nodes(job, a, height_a, b->child[k].node, height_b - 1, &child_window, worker);
+        }
+        return;
+    }
+    NODE_MASK_FOREACH(hits_a, i) {
+        Rect rect_a = entry_rect(a, i);
+        NodeMask pairs = node_overlap_mask(b, &rect_a);
+        for (int w = 0; w < NODE_MASK_WORDS; w++) pairs.bits[w] &= hits_b.bits[w];
+        NODE_MASK_FOREACH(pairs, k) {
+            if (a->is_leaf) {
+                if (job->callback) job->callback(a->child[i].entry, b->child[k].entry);
+                else job->worker_callback(worker, a->child[i].entry, b->child[k].entry);
+            } else {
+                Rect rect_b = entry_rect(b, k);
+                Rect child_window = intersect_rects(&rect_a, &rect_b);
+                join_nodes(job, a->child[i].node, height_a - 1, b->child[k].node, height_b - 1, &child_window, worker);
+            }
+        }
+    }
+}
+
+// Reports every pair of overlapping entries from two trees (a spatial join),
+// traversing both trees together so that node pairs that don't overlap are
+// pruned with all their descendants. Much faster than a range search of one
+// tree for every entry of the other. The trees may differ in height.
+// tree_a: pointer to the first R-tree
+// tree_b: pointer to the second R-tree
+// callback: function to call with each pair, the first tree's entry first
+void join(RTree *tree_a, RTree *tree_b, void (*callback)(Entry *, Entry *)) {
+    if (tree_a->root->num_entries == 0 || tree_b->root->num_entries == 0) return;
+    Rect rect_a = node_bounding_box(tree_a->root);
+    Rect rect_b = node_bounding_box(tree_b->root);
+    if (!overlap(&rect_a, &rect_b)) return;
+    JoinJob job = {callback, NULL, -1, NULL, 0, 0};
+    Rect window = intersect_rects(&rect_a, &rect_b);
+    join_nodes(&job, tree_a->root, node_height(tree_a->root), tree_b->root, node_height(tree_b->root), &window, 0);
+}
+
+// Finds the lowest height whose subtrees hold more than a grain of entries;
+// subtrees of that height or lower make one task of a parallel operation
+// fanout: number of children a node is assumed to have, at least 2
+// grain: number of entries a task should cover
+// Returns the height, 0 for leaves
+int task_height_for_grain(int fanout, int grain) {
+    if (fanout < 2) fanout = 2;
+    int height = 0;
+    double subtree_entries = fanout;
+    while (subtree_entries < grain) {
+        subtree_entries *= fanout;
+        height++;
+    }
+    return height;
+}
+
+// Subtrees holding about this many entries or fewer are searched by a single
+// task; larger ones are split into one task per overlapping child
+#define PARALLEL_SEARCH_GRAIN 4096
+
+// Shared state of one parallel search
+typedef struct ParallelSearch {
+    // Rectangle searched for
+    Rect rect;
+    // Function to call with the worker index and each overlapping entry
+    void (*callback)(int, Entry *);
+    // Subtrees of this height or lower are not split further
+    int split_height;
+} ParallelSearch;
+
+// Searches a subtree on the calling worker, reporting its index with each entry
+// node: pointer to the current R-tree node
+// rect: pointer to the rectangle to search for
+// callback: function to call with the worker index and each overlapping entry
+// worker: index of the worker running the search
+void search_subtree(RTreeNode *node, Rect *rect, void (*callback)(int, Entry *), int worker) {
+    NodeMask hits = node_overlap_mask(node, rect);
+    int i;
+    NODE_MASK_FOREACH(hits, i) {
+        if (node->is_leaf) {
+            callback(worker, node->child[i].entry);
+        } else {
+            search_subtree(node->child[i].node, rect, callback, worker);
+        }
+    }
+}
+
+// Runs one subtree of a parallel search as a pool task
+// pool: pool running the task
+// arg: pointer to the ParallelSearch
+// item: root of the subtree
+void parallel_search_task(ThreadPool *pool, void *arg, void *item) {
+    ParallelSearch *job = (ParallelSearch *)arg;
+    RTreeNode *node = (RTreeNode *)item;
+    // Small subtrees are cheaper to search than to split
+    if (node_height(node) <= job->split_height) {
+        search_subtree(node, &job->rect, job->callback, thread_pool_worker_id());
+        return;
+    }
+    // Queue each overlapping child; this worker runs them newest first while
+    // idle workers steal the oldest, which are the largest remaining pieces
+    NodeMask hits = node_overlap_mask(node, &job->rect);
+    int i;
+    NODE_MASK_FOREACH(hits, i) {
+        thread_pool_submit(pool, parallel_search_task, job, node->child[i].node);
+    }
+}
+
+// Searches the tree for entries overlapping a rectangle, splitting the work
+// into subtrees that the pool's workers share by work stealing. The callback
+// runs on the workers concurrently; it gets the worker index (0 to
+// thread_pool_size(pool) - 1) so it can collect results per thread without locks.
+// Waits for every task on the pool, so a pool should serve one search at a time.
+// tree: pointer to the R-tree
+// pool: pool of worker threads
+// rect: pointer to the rectangle to search for
+// callback: function to call with the worker index and each overlapping entry
+void parallel_search(RTree *tree, ThreadPool *pool, Rect *rect, void (*callback)(int, Entry *)) {
+    ParallelSearch job;
+    job.rect = *rect;
+    job.callback = callback;
+    job.split_height = task_height_for_grain(tree->max_entries, PARALLEL_SEARCH_GRAIN);
+    thread_pool_submit(pool, parallel_search_task, &job, tree->root);
+    thread_pool_wait(pool);
+}
+
+// Pairs of subtrees holding about this many entries or fewer on each side
+// are joined by a single task
+#define PARALLEL_JOIN_GRAIN 4096
+
+// Joins one pair of subtrees of a parallel join as a pool task
+// pool: pool running the task
+// arg: pointer to the JoinJob
+// item: pointer to the JoinPair
+void parallel_join_task(ThreadPool *pool, void *arg, void *item) {
+    (void)pool;
+    JoinPair *pair = (JoinPair *)item;
+    join_nodes((JoinJob *)arg, pair->a, pair->height_a, pair->b, pair->height_b, &pair->window, thread_pool_worker_id());
+}
+
+// Reports every pair of overlapping entries from two trees like join,
+// splitting the work on a thread pool. Both trees are descended together
+// down to pairs of subtrees of about PARALLEL_JOIN_GRAIN entries, and each
+// overlapping pair becomes one task. The callback runs on the workers
+// concurrently and gets the worker index (0 to thread_pool_size(pool) - 1).
+// Waits for every task on the pool, so a pool should serve one join at a time.
+// tree_a: pointer to the first R-tree
+// tree_b: pointer to the second R-tree
+// pool: pool of worker threads
+// callback: function to call with the worker index and each pair
+void parallel_join(RTree *tree_a, RTree *tree_b, ThreadPool *pool, void (*callback)(int, Entry *, Entry *)) {
+    if (tree_a->root->num_entries == 0 || tree_b->root->num_entries == 0) return;
+    Rect rect_a = node_bounding_box(tree_a->root);
+    Rect rect_b = node_bounding_box(tree_b->root);
+    if (!overlap(&rect_a, &rect_b)) return;
+    JoinJob job = {NULL, callback, 0, NULL, 0, 0};
+    job.split_height = task_height_for_grain(tree_a->max_entries, PARALLEL_JOIN_GRAIN);
+    // Collect the overlapping pairs at that height, then join them on the pool
+    Rect window = intersect_rects(&rect_a, &rect_b);
+    join_nodes(&job, tree_a->root, node_height(tree_a->root), tree_b->root, node_height(tree_b->root), &window, 0);
+    job.split_height = -1;
+    for (int p = 0; p < job.num_pairs; p++) {
+        thread_pool_submit(pool, parallel_join_task, &job, &job.pairs[p]);
+    }
+    thread_pool_wait(pool);
+    free(job.pairs);
+}
+
+// Writes a subtree to a paged file, children before their parent
+// file: pointer to the file, positioned where the next page goes
+// node: pointer to the root of the subtree
+// page: page buffer of the file's page size, reused for every node
+// next_page: number of the next page to be written; advanced for each page
+// entry_count: incremented by the number of leaf entries written
+// Returns the page number of node
+uint64_t save_paged_node(FILE *file, RTreeNode *node, DiskNode *page, uint64_t *next_page, uint64_t *entry_count) {
+    uint64_t refs[MAX_ENTRIES + 1];
+    if (node->is_leaf) {
+        // Leaves store the value of each entry's data pointer
+        for (int i = 0; i < node->num_entries; i++) refs[i] = (uint64_t)(uintptr_t)node->child[i].entry->data;
+        *entry_count += node->num_entries;
+    } else {
+        for (int i = 0; i < node->num_entries; i++) {
+            refs[i] = save_paged_node(file, node->child[i].node, page, next_page, entry_count);
+        }
+    }
+    uint32_t page_size = paged_page_size();
+    paged_fill_node(page, page_size, node, refs);
+    fwrite(page, page_size, 1, file);
+    return (*next_page)++;
+}
+
+// Saves the tree to a file in the paged format (see paged_file.h). Leaf data
+// pointers are stored as integers, so trees whose data holds ids rather than
+// pointers read back the same ids.
+// tree: pointer to the R-tree
+// filename: name of the file to save the tree to
+void save_tree(RTree *tree, const char *filename) {
+    // Open the file for writing in binary mode
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        // Print an error message if the file could not be opened
+        fprintf(stderr, "Failed to open file %s for writing\n", filename);
+        return;
+    }
+    // Write in large blocks rather than one call per page
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    // Reserve the header page, then write the nodes
+    unsigned char header_page[PAGED_HEADER_SIZE];
+    memset(header_page, 0, sizeof(header_page));
+    fwrite(header_page, sizeof(header_page), 1, file);
+    DiskNode *page = (DiskNode *)malloc(paged_page_size());
+    uint64_t next_page = 1, entry_count = 0;
+    uint64_t root_page = save_paged_node(file, tree->root, page, &next_page, &entry_count);
+    free(page);
+
+    // Fill in the header now that the root page and counts are known; a
+    // fresh file starts at sequence 0, in slot 0
+    PagedFileHeader header;
+    paged_init_header(&header);
+    header.height = (uint32_t)node_height(tree->root);
+    header.root_page = root_page;
+    header.page_count = next_page - 1;
+    header.entry_count = entry_count;
+    bool written = paged_write_header(file, &header);
+
+    if (fclose(file) == 0 && written) {
+        // Print a success message
+        fprintf(stderr, "Tree saved successfully to %s\n", filename);
+    } else {
+        fprintf(stderr, "Failed to write file %s\n", filename);
+    }
+}
+
+// Subtrees holding about this many entries are decoded by a single task
+#define PARALLEL_LOAD_GRAIN 4096
+
+// Copies the page of a node into the node. Children below the task height
+// are decoded right away; children at the task height are queued on the pool.
+// job: pointer to the load
+// node: node of the page to decode; its parent is already set
+// height: height of the node above the leaves, according to the header
+void decode_paged_node(PagedLoad *job, RTreeNode *node, int height) {
+    MappedTree *mt = job->mt;
+    uint64_t page = (uint64_t)(node - job->nodes) + 1;
+    DiskNode *disk = mapped_page(mt, page);
+    // Every page must be referenced once and sit at the height the header promises
+    if (atomic_exchange(&job->claimed[page - 1], 1) != 0 ||
+        disk->num_entries > MAX_ENTRIES || (disk->is_leaf != 0) != (height == 0)) {
+        atomic_store(&job->corrupt, true);
+        return;
+    }
+    node->is_leaf = disk->is_leaf != 0;
+    node->num_entries = disk->num_entries;
+    node->page = job->keep_pages ? page : 0;
+    node->dirty = !job->keep_pages;
+    memcpy(node->min, disk->min, sizeof(node->min));
+    if (NODE_HAS_MAX(node)) memcpy(node->max, disk->max, sizeof(node->max));
+
+    if (node->is_leaf) {
+        // Claim a run of entries for this leaf
+        long first = atomic_fetch_add(&job->next_entry, node->num_entries);
+        if ((uint64_t)(first + node->num_entries) > mt->header->entry_count) {
+            atomic_store(&job->corrupt, true);
+            return;
+        }
+        for (int i = 0; i < node->num_entries; i++) {
+            Entry *entry = &job->entries[first + i];
+            entry->rect = entry_rect(node, i);
+            entry->data = (void *)(uintptr_t)disk->ref[i];
+            node->child[i].entry = entry;
+        }
+        return;
+    }
+    for (int i = 0; i < node->num_entries; i++) {
+        uint64_t ref = disk->ref[i];
+        if (ref < 1 || ref > mt->header->page_count) {
+            atomic_store(&job->corrupt, true);
+            return;
+        }
+        RTreeNode *child = &job->nodes[ref - 1];
+        child->parent = node;
+        node->child[i].node = child;
+        if (job->pool != NULL && height - 1 == job->task_height) {
+            thread_pool_submit(job->pool, load_paged_task, job, child);
+        } else {
+            decode_paged_node(job, child, height - 1);
+        }
+    }
+}
+
+// Decodes one subtree of a parallel load as a pool task
+// pool: pool running the task
+// arg: pointer to the PagedLoad
+// item: node at the task height whose page is to be decoded
+void load_paged_task(ThreadPool *pool, void *arg, void *item) {
+    (void)pool;
+    PagedLoad *job = (PagedLoad *)arg;
+    decode_paged_node(job, (RTreeNode *)item, job->task_height);
+}
+
+// Copies a mapped paged file into a new tree. All nodes and entries are
+// allocated up front in two blocks, and with a pool, subtrees are decoded
+// in parallel, one task per subtree of about PARALLEL_LOAD_GRAIN entries.
+// mt: pointer to the mapped file
+// keep_pages: when set, nodes remember the page they came from, so a
+// checkpoint back to the same file only rewrites what changed (tree_store.h)
+// pool: pool of worker threads, or NULL to decode on the calling thread
+// Returns a pointer to the loaded R-tree, or NULL if the file is damaged
+RTree* load_mapped_tree(MappedTree *mt, bool keep_pages, ThreadPool *pool) {
+    PagedFileHeader *header = mt->header;
+    // Start reading the whole file ahead of the decoding
+    mapped_prefetch(mt);
+    RTree *tree = init_tree();
+
+    // One block of nodes, one per page, and one block of entries
+    NodeSlab *node_slab = (NodeSlab *)malloc(sizeof(NodeSlab) + sizeof(RTreeNode) * header->page_count);
+    node_slab->next = tree->pool.slabs;
+    node_slab->capacity = (int)header->page_count;
+    node_slab->used = (int)header->page_count;
+    node_slab->node_size = sizeof(RTreeNode);
+    tree->pool.slabs = node_slab;
+    EntrySlab *entry_slab = (EntrySlab *)malloc(sizeof(EntrySlab) + sizeof(Entry) * header->entry_count);
+    entry_slab->next = tree->pool.entry_slabs;
+    entry_slab->capacity = (int)header->entry_count;
+    tree->pool.entry_slabs = entry_slab;
+    // On one thread, map the blocks in bulk; with a pool, the workers' page
+    // faults on first touch are spread over the threads instead
+    if (pool == NULL) {
+        prefault_memory(node_slab->nodes, sizeof(RTreeNode) * header->page_count);
+        prefault_memory(entry_slab->entries, sizeof(Entry) * header->entry_count);
+    }
+
+    PagedLoad job;
+    job.mt = mt;
+    job.nodes = node_slab->nodes;
+    job.claimed = (atomic_uchar *)calloc(header->page_count, sizeof(atomic_uchar));
+    job.entries = entry_slab->entries;
+    atomic_init(&job.next_entry, 0);
+    job.keep_pages = keep_pages;
+    job.pool = pool;
+    atomic_init(&job.corrupt, false);
+    job.task_height = task_height_for_grain(MAX_ENTRIES, PARALLEL_LOAD_GRAIN);
+
+    // Replace the empty root with the root page's node and decode from there;
+    // the levels above the task height are decoded on this thread
+    release_node(tree, tree->root);
+    tree->root = &job.nodes[header->root_page - 1];
+    tree->root->parent = NULL;
+    decode_paged_node(&job, tree->root, (int)header->height);
+    if (pool != NULL) thread_pool_wait(pool);
+    entry_slab->used = (int)atomic_load(&job.next_entry);
+    free(job.claimed);
+
+    if (atomic_load(&job.corrupt)) {
+        fprintf(stderr, "Tree file is corrupt\n");
+        free_tree(tree);
+        return NULL;
+    }
+    return tree;
+}
+
+// Loads a node from a file in the legacy recursive format
+// tree: pointer to the R-tree that will own the node and its entries
+// file: pointer to the file to read from
+// not_points: set when a leaf entry isn't a point, which a point build
+// (RTREE_POINTS) can't hold; left alone otherwise
+// Returns a pointer to the loaded R-tree node
+RTreeNode* load_node(RTree *tree, FILE *file, bool *not_points) {
+    // Declare a variable to store whether the node is a leaf
+    bool is_leaf;
+    // Read the is_leaf property from the file
     fread(&is_leaf, sizeof(bool), 1, file);
-    
+
     // Initialize a new node with the is_leaf property
-    RTreeNode *node = init_node(is_leaf);
-    
+    RTreeNode *node = init_node(tree, is_leaf);
+
     // Read the number of entries in the node from the file
-    fread(&node->num_entries, sizeof(int), 1, file);
-    
+    int num_entries;
+    fread(&num_entries, sizeof(int), 1, file);
+
     // Iterate over the number of entries
-    for (int i = 0; i < node->num_entries; i++) {
-        // Allocate memory for a new entry
-        node->entries[i] = (Entry *)malloc(sizeof(Entry));
-        
+    for (int i = 0; i < num_entries; i++) {
         // Read the rectangle of the entry from the file
-        fread(&node->entries[i]->rect, sizeof(Rect), 1, file);
-        
-        // If the node is not a leaf, recursively load the child node
-        if (!is_leaf) {
-            node->entries[i]->child = load_node(file);
+        Rect rect;
+        fread(&rect, sizeof(Rect), 1, file);
+
+        if (is_leaf) {
+#ifdef RTREE_POINTS
+            if (!is_point(&rect)) *not_points = true;
+#endif
+            // Allocate a tree-owned entry; data pointers are not stored in the file
+            Entry *entry = alloc_entry(tree);
+            entry->rect = rect;
+            entry->data = NULL;
+            add_entry(node, entry);
+        } else {
+            // If the node is not a leaf, recursively load the child node
+            RTreeNode *child = load_node(tree, file, not_points);
+            add_child(node, child, &rect);
         }
     }
-    
+
     // Return the loaded node
     return node;
 }
 
-// Loads the tree from a file
+// Loads the tree from a file, either in the paged format or in the legacy
+// recursive format written by earlier versions
 // filename: name of the file to read from
 // Returns a pointer to the loaded R-tree
 RTree* load_tree(const char *filename) {
+    return load_tree_parallel(filename, NULL);
+}
+
+// Loads the tree from a file, decoding the subtrees of a paged file on a
+// thread pool. Waits for every task on the pool.
+// filename: name of the file to read from
+// pool: pool of worker threads, or NULL to load on the calling thread
+// Returns a pointer to the loaded R-tree
+RTree* load_tree_parallel(const char *filename, ThreadPool *pool) {
     // Open the file in binary read mode
     FILE *file = fopen(filename, "rb");
-    
+
     // Check if the file was successfully opened
     if (!file) {
         // Print an error message if the file could not be opened
-        printf("Failed to open file %s for reading\n", filename);
+        fprintf(stderr, "Failed to open file %s for reading\n", filename);
         // Return NULL to indicate failure
         return NULL;
     }
-    
-    // Allocate memory for a new R-tree
-    RTree *tree = (RTree *)malloc(sizeof(RTree));
-    
-    // Load the root node of the tree from the file
-    tree->root = load_node(file);
-    
-    // Close the file after reading
-    fclose(file);
-    
+    // The legacy format is read in small pieces, so buffer it generously
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+
+    RTree *tree;
+    if (paged_file_detect(file)) {
+        fclose(file);
+        MappedTree *mt = map_tree(filename);
+        if (!mt) return NULL;
+        // Copy the pages into tree-owned nodes
+        tree = load_mapped_tree(mt, false, pool);
+        unmap_tree(mt);
+        if (!tree) return NULL;
+    } else {
+        // Create a new R-tree with the usual node limits and split policy
+        tree = init_tree();
+        // Load the root node of the tree from the file, replacing the empty root
+        rewind(file);
+        release_node(tree, tree->root);
+        bool not_points = false;
+        tree->root = load_node(tree, file, &not_points);
+        // Close the file after reading
+        fclose(file);
+        if (not_points) {
+            fprintf(stderr, "Tree file %s holds rectangles; it needs a build without RTREE_POINTS\n", filename);
+            free_tree(tree);
+            return NULL;
+        }
+    }
+
     // Print a success message
-    printf("Tree loaded successfully from %s\n", filename);
-    
+    fprintf(stderr, "Tree loaded successfully from %s\n", filename);
+
     // Return the loaded tree
     return tree;
-}
\ No newline at end of file
+}
@@ -3,58 +3,374 @@
 
 // Include standard boolean library
 #include <stdbool.h>
-
-// Define maximum number of entries in a node
-#define MAX_ENTRIES 4
-// Define minimum number of entries in a node
-#define MIN_ENTRIES 2
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+// Include the compile-time fanout, dimension and coordinate settings
+#include "rtree_config.h"
+#include "priority_queue.h"
 
 // Define a structure for a rectangle
 typedef struct Rect {
     // Minimum coordinates of the rectangle
-    float min[2];
+    coord_t min[RTREE_DIMS];
     // Maximum coordinates of the rectangle
-    float max[2];
+    coord_t max[RTREE_DIMS];
 } Rect;
 
-// Define a structure for an entry in the R-tree
+// Define a structure for an entry stored in the leaves of the R-tree
 typedef struct Entry {
     // Rectangle associated with the entry
     Rect rect;
     // Union to store either a child node or data
+    // (the tree keeps child nodes inside its own nodes, so only data is used)
     union {
         struct RTreeNode *child;
         void *data;
     };
 } Entry;
 
+// Define what a slot of a node refers to
+typedef union NodeChild {
+    // Child node, in internal nodes
+    struct RTreeNode *node;
+    // User entry, in leaf nodes
+    Entry *entry;
+} NodeChild;
+
 // Define a structure for a node in the R-tree
 typedef struct RTreeNode {
     // Boolean to indicate if the node is a leaf
     bool is_leaf;
     // Number of entries in the node
     int num_entries;
-    // Array of entries in the node
-    Entry *entries[MAX_ENTRIES + 1];
+    // Rectangles of the entries, stored inline as structure-of-arrays:
+    // entry i covers [min[0][i], max[0][i]] x [min[1][i], max[1][i]] x ...
+    coord_t min[RTREE_DIMS][MAX_ENTRIES + 1];
+#ifndef RTREE_POINTS
+    coord_t max[RTREE_DIMS][MAX_ENTRIES + 1];
+#endif
+    // Child nodes or user entries, parallel to the rectangles
+    NodeChild child[MAX_ENTRIES + 1];
     // Pointer to the parent node
     struct RTreeNode *parent;
+    // Page holding the node in the file it was last checkpointed to, or 0
+    uint64_t page;
+    // Set when the node changed since it was written to its page; a dirty
+    // node's ancestors are always dirty too, so changes can be found from the root
+    bool dirty;
+#ifdef RTREE_POINTS
+    // Upper corners, last so that leaves, whose entries are points stored
+    // in min alone, can be allocated without them (see LEAF_NODE_SIZE)
+    coord_t max[RTREE_DIMS][MAX_ENTRIES + 1];
+#endif
 } RTreeNode;
 
+// Define the bytes allocated for a leaf node, and whether a node has max
+// arrays; use NODE_MAX_ARRAYS to read the upper corners of any node
+#ifdef RTREE_POINTS
+#define LEAF_NODE_SIZE ((offsetof(RTreeNode, max) + _Alignof(RTreeNode) - 1) / _Alignof(RTreeNode) * _Alignof(RTreeNode))
+#define NODE_HAS_MAX(node) (!(node)->is_leaf)
+#else
+#define LEAF_NODE_SIZE sizeof(RTreeNode)
+#define NODE_HAS_MAX(node) true
+#endif
+#define NODE_MAX_ARRAYS(node) (NODE_HAS_MAX(node) ? (node)->max : (node)->min)
+
+// Define a block of nodes allocated at once
+typedef struct NodeSlab {
+    // Next slab in the pool
+    struct NodeSlab *next;
+    // Number of nodes the slab can hold
+    int capacity;
+    // Number of nodes handed out from the slab
+    int used;
+    // Bytes per node: sizeof(RTreeNode), or LEAF_NODE_SIZE in leaf slabs
+    size_t node_size;
+    // The nodes themselves, node_size bytes apart
+    RTreeNode nodes[];
+} NodeSlab;
+
+// Define a block of entries owned by the tree (e.g. created by load_tree)
+typedef struct EntrySlab {
+    // Next slab in the pool
+    struct EntrySlab *next;
+    // Number of entries the slab can hold
+    int capacity;
+    // Number of entries handed out from the slab
+    int used;
+    // The entries themselves
+    Entry entries[];
+} EntrySlab;
+
+// Define a growable list of page numbers
+typedef struct PageList {
+    // Page numbers
+    uint64_t *pages;
+    // Number of pages in the list
+    int count;
+    // Number of pages the array can hold
+    int capacity;
+} PageList;
+
+// Define the allocator backing all nodes of a tree
+typedef struct NodePool {
+    // Slabs of nodes, most recent first
+    NodeSlab *slabs;
+    // Released nodes available for reuse, linked through their parent pointer
+    RTreeNode *free_nodes;
+    // Slabs of leaf nodes, allocated LEAF_NODE_SIZE bytes apart
+    NodeSlab *leaf_slabs;
+    // Released leaves available for reuse
+    RTreeNode *free_leaves;
+    // Slabs of tree-owned entries, most recent first
+    EntrySlab *entry_slabs;
+    // Released tree-owned entries available for reuse, linked through their data pointer
+    Entry *free_entries;
+} NodePool;
+
+// Define counters of the work done by queries. They are updated only when
+// built with RTREE_STATS (see rtree_config.h) and stay zero otherwise.
+typedef struct QueryStats {
+    // Queries counted
+    long queries;
+    // Nodes whose entries were tested
+    long nodes_visited;
+    // Entries tested against the query
+    long entries_tested;
+    // Child nodes skipped because they cannot hold a result
+    long subtrees_pruned;
+    // Largest number of nodes waiting in a nearest-neighbor queue
+    long max_queue_size;
+} QueryStats;
+
+// Define the query counters of a tree, summed over every thread querying it
+typedef struct SharedQueryStats {
+    atomic_long queries;
+    atomic_long nodes_visited;
+    atomic_long entries_tested;
+    atomic_long subtrees_pruned;
+    atomic_long max_queue_size;
+} SharedQueryStats;
+
+// Define counters of the work done by changes to a tree, updated like QueryStats
+typedef struct InsertStats {
+    // Entries inserted by insert and insert_batch
+    long inserts;
+    // Nodes passed on the way down to the node receiving an entry, including
+    // entries moved again by deletes and forced reinsertions
+    long nodes_visited;
+    // Nodes split
+    long splits;
+    // R* forced reinsertions
+    long reinsertions;
+} InsertStats;
+
+// Define the shape of a tree, as measured by tree_shape
+typedef struct TreeShape {
+    // Levels below the root (0 when the root is a leaf)
+    int height;
+    // Number of leaf nodes
+    long leaves;
+    // Number of internal nodes
+    long internal_nodes;
+    // Number of entries
+    long entries;
+    // Average entries per leaf, as a fraction of the fanout
+    double leaf_fill;
+    // Average children per internal node, as a fraction of the fanout
+    double internal_fill;
+} TreeShape;
+
+// Define the number of levels analyze_tree reports on; taller trees are
+// still measured, but their upper levels are left out of the report
+#define QUALITY_MAX_LEVELS 32
+
+// Define the quality of one level of a tree, as measured by analyze_tree.
+// Areas are volumes beyond two dimensions.
+typedef struct LevelQuality {
+    // Number of nodes at this level
+    long nodes;
+    // Entries or children held by those nodes
+    long entries;
+    // Average entries per node, as a fraction of the fanout
+    double fill;
+    // Summed area of the nodes' rectangles
+    double area;
+    // Area covered by two nodes at once, summed over pairs of nodes that
+    // share a parent; queries there have to visit both
+    double overlap;
+    // Area of the nodes' rectangles that none of their entries covers;
+    // queries there visit a node and find nothing. Estimated from the
+    // entries' areas and their pairwise overlaps.
+    double dead_space;
+} LevelQuality;
+
+// Define the quality of a tree, as measured by analyze_tree
+typedef struct TreeQuality {
+    // Levels below the root (0 when the root is a leaf)
+    int height;
+    // Overlap summed over all levels
+    double overlap;
+    // Dead space summed over all levels
+    double dead_space;
+    // Levels indexed by height above the leaves: levels[0] are the leaves
+    // and levels[height] is the root
+    LevelQuality levels[QUALITY_MAX_LEVELS];
+} TreeQuality;
+
+// Define the algorithms available for splitting an overflowing node
+typedef enum SplitPolicy {
+    // Move the second half of the entries to the new node
+    SPLIT_MIDPOINT,
+    // Guttman's linear split: seeds by normalized separation, linear assignment
+    SPLIT_LINEAR,
+    // Guttman's quadratic split: seeds by wasted area, pick-next by preference
+    SPLIT_QUADRATIC,
+    // R*-tree split by margin and overlap, with forced reinsertion on overflow
+    SPLIT_RSTAR
+} SplitPolicy;
+
 // Define a structure for the R-tree
 typedef struct RTree {
     // Pointer to the root node of the tree
     RTreeNode *root;
+    // Allocator for the tree's nodes
+    NodePool pool;
     // Maximum number of entries in a node
     int max_entries;
     // Minimum number of entries in a node
     int min_entries;
+    // Algorithm used to split overflowing nodes
+    SplitPolicy split_policy;
+    // Levels (bit per height above the leaves) that already did an R* forced
+    // reinsertion during the current insert
+    unsigned int reinserted_levels;
+    // When set, insert, insert_batch, delete_entry, delete_batch, update_entry,
+    // rebuild_tree and repack_subtrees refuse to modify the tree (see thread safety below)
+    bool read_only;
+    // Pages of nodes released since the last checkpoint (see tree_store.h)
+    PageList released_pages;
+    // Work done by queries on the tree; read it with tree_query_stats
+    SharedQueryStats query_stats;
+    // Work done by changes to the tree
+    InsertStats insert_stats;
 } RTree;
 
+// Define the ordering used when bulk loading a tree
+typedef enum BulkLoadMethod {
+    // Sort-Tile-Recursive: slice the entries by x, then tile each slice by y
+    BULK_LOAD_STR,
+    // Order the entries along a Hilbert curve through their centers
+    BULK_LOAD_HILBERT
+} BulkLoadMethod;
+
+// Define the reusable state of nearest-neighbor queries. Queries that take a
+// context reuse its buffers, so once they have grown to fit the largest query
+// no further heap allocation happens. A context must not be shared by threads
+// running queries at the same time; give each thread its own.
+typedef struct QueryContext {
+    // Nodes still to visit, closest first
+    PriorityQueue queue;
+    // Closest entries found so far by knn
+    ResultHeap results;
+    // Work done by the queries run with this context
+    QueryStats stats;
+} QueryContext;
+
+// Define the options of an approximate nearest-neighbor query. An epsilon
+// above 0 prunes every subtree that is at least the current best distance
+// divided by (1 + epsilon) away, so each answer is at most (1 + epsilon)
+// times as far as the true one. A node budget stops the search after that
+// many nodes once an answer is in hand, whatever its quality.
+typedef struct NearestOptions {
+    // Allowed relative error of the distances; 0 for exact answers
+    double epsilon;
+    // Most nodes to visit once an answer has been found; 0 for no limit
+    long max_nodes;
+} NearestOptions;
+
+// Define a cursor that returns the entries of a tree one at a time in order
+// of distance from a point (distance browsing). Nodes are expanded only as
+// far as needed for the next entry, so the work follows the number of
+// entries taken rather than a k fixed in advance. The tree must not be
+// modified while a cursor on it is in use.
+typedef struct NearestCursor {
+    // Tree being browsed
+    RTree *tree;
+    // Query point
+    coord_t point[RTREE_DIMS];
+    // Nodes not expanded yet, closest first
+    PriorityQueue nodes;
+    // Entries of expanded leaves not returned yet, closest first
+    PriorityQueue entries;
+} NearestCursor;
+
+// Thread safety
+// Queries only read the tree: search, search_batch, nearest_neighbor, knn,
+// within_distance, nearest_neighbor_batch, parallel_search, join and
+// parallel_join may run on any number of threads at once on the same tree
+// without locks, as long as no thread modifies it meanwhile. The *_ctx
+// variants need one QueryContext per thread, and each NearestCursor belongs
+// to one thread at a time. insert, delete_entry,
+// delete_batch, update_entry, rebuild_tree, repack_subtrees and free_tree
+// modify a tree and must not overlap any other call on the same tree. Setting
+// read_only makes the functions that modify a tree refuse to run, so a tree
+// shared between threads cannot be modified by mistake. To keep modifying a
+// tree while it is being queried, use a ConcurrentRTree (concurrent_tree.h).
+// When built with RTREE_STATS, queries also add their counts to the tree's
+// query_stats with atomic operations, which stays safe on many threads.
+
+// Forward declarations of ThreadPool and MappedTree
+typedef struct ThreadPool ThreadPool;
+typedef struct MappedTree MappedTree;
+
 // Function declarations
 RTree* init_tree();
+RTree* bulk_load(Entry **entries, int count, BulkLoadMethod method);
+void free_tree(RTree *tree);
+Entry* alloc_entry(RTree *tree);
+void release_entry(RTree *tree, Entry *entry);
+void page_list_push(PageList *list, uint64_t page);
 void insert(RTree *tree, Entry *entry);
-Entry* nearest_neighbor(RTree *tree, float point[2]);
+int insert_batch(RTree *tree, Entry **entries, int count);
+void delete_entry(RTree *tree, Entry *entry);
+int delete_batch(RTree *tree, Entry **entries, int count);
+bool update_entry(RTree *tree, Entry *entry, Rect *rect);
+long validate_tree(RTree *tree);
+QueryStats tree_query_stats(RTree *tree);
+void reset_tree_stats(RTree *tree);
+TreeShape tree_shape(RTree *tree);
+TreeQuality analyze_tree(RTree *tree);
+void rebuild_tree(RTree *tree);
+int repack_subtrees(RTree *tree, int height, int count);
+void search(RTreeNode *node, Rect *rect, void (*callback)(Entry *));
+void search_ctx(QueryContext *ctx, RTree *tree, Rect *rect, void (*callback)(Entry *));
+Entry* nearest_neighbor(RTree *tree, coord_t point[RTREE_DIMS]);
+int knn(RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out);
+NearestCursor* create_nearest_cursor(RTree *tree, coord_t point[RTREE_DIMS]);
+void nearest_cursor_restart(NearestCursor *cursor, RTree *tree, coord_t point[RTREE_DIMS]);
+Entry* nearest_cursor_next(NearestCursor *cursor, dist_t *distance);
+void free_nearest_cursor(NearestCursor *cursor);
+QueryContext* create_query_context(void);
+void free_query_context(QueryContext *ctx);
+Entry* nearest_neighbor_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS]);
+int knn_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out);
+Entry* nearest_neighbor_approx(RTree *tree, coord_t point[RTREE_DIMS], const NearestOptions *options, bool *exact);
+Entry* nearest_neighbor_approx_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS],
+                                   const NearestOptions *options, bool *exact);
+int knn_approx(RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out, const NearestOptions *options, bool *exact);
+int knn_approx_ctx(QueryContext *ctx, RTree *tree, coord_t point[RTREE_DIMS], int k, Entry **out,
+                   const NearestOptions *options, bool *exact);
+void within_distance(RTree *tree, coord_t point[RTREE_DIMS], dist_t radius, void (*callback)(Entry *));
+void search_batch(RTree *tree, Rect *rects, int count, void (*callback)(int, Entry *));
+void nearest_neighbor_batch(RTree *tree, coord_t (*points)[RTREE_DIMS], int count, Entry **out);
+void parallel_search(RTree *tree, ThreadPool *pool, Rect *rect, void (*callback)(int, Entry *));
+void join(RTree *tree_a, RTree *tree_b, void (*callback)(Entry *, Entry *));
+void parallel_join(RTree *tree_a, RTree *tree_b, ThreadPool *pool, void (*callback)(int, Entry *, Entry *));
 void save_tree(RTree *tree, const char *filename);
 RTree* load_tree(const char *filename);
+RTree* load_tree_parallel(const char *filename, ThreadPool *pool);
+RTree* load_mapped_tree(MappedTree *mt, bool keep_pages, ThreadPool *pool);
 
 #endif // RTREE_H
\ No newline at end of file
@@ -0,0 +1,69 @@
+#ifndef RTREE_CONFIG_H
+#define RTREE_CONFIG_H
+
+// Compile-time configuration of the R-tree. Every setting can be overridden
+// on the compiler command line, e.g. -DMAX_ENTRIES=32 -DRTREE_DIMS=3 -DRTREE_COORD_DOUBLE
+
+#include <float.h>
+#include <stdint.h>
+
+// Define maximum number of entries in a node
+#ifndef MAX_ENTRIES
+#define MAX_ENTRIES 4
+#endif
+// Define minimum number of entries in a node
+#ifndef MIN_ENTRIES
+#define MIN_ENTRIES (MAX_ENTRIES / 2)
+#endif
+
+// Define the number of dimensions of a rectangle
+#ifndef RTREE_DIMS
+#define RTREE_DIMS 2
+#endif
+
+// Define the coordinate type (float by default, or double / int32_t) and the
+// type used for distances, areas and margins computed from coordinates
+#if defined(RTREE_COORD_DOUBLE)
+typedef double coord_t;
+typedef double dist_t;
+#define COORD_MAX DBL_MAX
+#define DIST_MAX DBL_MAX
+#define DIST_SQRT sqrt
+#elif defined(RTREE_COORD_INT32)
+typedef int32_t coord_t;
+typedef double dist_t;
+#define COORD_MAX INT32_MAX
+#define DIST_MAX DBL_MAX
+#define DIST_SQRT sqrt
+#else
+typedef float coord_t;
+typedef float dist_t;
+#define COORD_MAX FLT_MAX
+#define DIST_MAX FLT_MAX
+#define DIST_SQRT sqrtf
+#endif
+
+// Define RTREE_STATS to count the work done by queries and inserts (see
+// QueryStats and InsertStats in rtree.h). Without it the counters stay zero
+// and the code that would update them is not compiled at all.
+#ifdef RTREE_STATS
+#define RTREE_STATS_ENABLED 1
+#else
+#define RTREE_STATS_ENABLED 0
+#endif
+
+// Define RTREE_POINTS when every entry is a point (rect.min == rect.max).
+// Leaves then store one corner per entry instead of two and are allocated
+// without room for the other, and leaf scans test points rather than
+// rectangles. insert, insert_batch, bulk_load and update_entry refuse
+// rectangles that aren't points, and load_tree and map_tree refuse files
+// that hold them.
+
+#if MIN_ENTRIES < 1 || MIN_ENTRIES > MAX_ENTRIES / 2
+#error "MIN_ENTRIES must be between 1 and MAX_ENTRIES / 2"
+#endif
+#if RTREE_DIMS < 1
+#error "RTREE_DIMS must be at least 1"
+#endif
+
+#endif // RTREE_CONFIG_H
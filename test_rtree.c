@@ -0,0 +1,301 @@
+#include "rtree.h"
+#include "node_scan.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Tests for the R-tree. Every way of changing a tree runs under every split
+// policy and bulk load method, and after each one the tree is checked with
+// validate_tree and its searches against a brute-force scan of the entries.
+// Build with the same settings as the library, e.g.
+//   gcc -O2 -o test_rtree test_rtree.c rtree.c priority_queue.c parallel_sort.c node_scan.c thread_pool.c concurrent_tree.c paged_file.c tree_store.c compact_tree.c -lm -lpthread
+// Usage: ./test_rtree [entries]
+// Unless RTREE_SCAN_KERNEL is set, the program runs itself once for each of
+// its settings, so every scan kernel the CPU has is tested.
+// Exits with status 1 if any check fails.
+
+// Side length of the square (cube, ...) the entries are spread over
+#define TEST_WORLD 1000
+// Largest side of an entry's rectangle; entries are points when the library
+// is built to store points
+#ifdef RTREE_POINTS
+#define TEST_SIDE 0
+#else
+#define TEST_SIDE 5
+#endif
+// Queries of each kind run against the brute-force scan per check
+#define TEST_QUERIES 100
+// Single-entry changes between two validate_tree calls
+#define TEST_VALIDATE_EVERY 250
+
+// State of the pseudo-random generator, fixed so failures can be reproduced
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+// Entries of the test; in_tree marks the ones the tree should hold
+static Entry *entries = NULL;
+static bool *in_tree = NULL;
+static int entry_count = 0;
+
+// Number of failed checks
+static int failures = 0;
+
+// Number of entries reported by the range query callback
+static long range_hits = 0;
+
+// Returns a pseudo-random number in [0, limit) (xorshift64*)
+int next_random_int(int limit) {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (int)(((rng_state * 0x2545F4914F6CDD1Dull) >> 33) % (uint64_t)limit);
+}
+
+// Fills a rectangle with a random position and size inside the world
+// rect: pointer to the rectangle
+// side: largest side of the rectangle
+void random_rect(Rect *rect, int side) {
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        rect->min[j] = (coord_t)next_random_int(TEST_WORLD);
+        rect->max[j] = rect->min[j] + (coord_t)(side > 0 ? next_random_int(side + 1) : 0);
+    }
+}
+
+// Counts one result of a range query
+void count_hit(Entry *entry) {
+    (void)entry;
+    range_hits++;
+}
+
+// Checks if two rectangles overlap, the way the brute-force scan sees it
+// a, b: pointers to the rectangles
+// Returns true if they share at least one point
+bool rects_overlap(Rect *a, Rect *b) {
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        if (a->min[j] > b->max[j] || b->min[j] > a->max[j]) return false;
+    }
+    return true;
+}
+
+// Records a failed check
+// ok: result of the check
+// step: name of the step being checked
+// what: description of the check
+void check(bool ok, const char *step, const char *what) {
+    if (ok) return;
+    if (failures < 20) printf("FAIL %s: %s\n", step, what);
+    failures++;
+}
+
+// Computes the squared distance from a point to a rectangle
+// rect: pointer to the rectangle
+// point: the point, one coordinate per dimension
+// Returns 0 if the point lies in the rectangle
+double rect_distance2(Rect *rect, coord_t point[RTREE_DIMS]) {
+    double sum = 0;
+    for (int j = 0; j < RTREE_DIMS; j++) {
+        double d = 0;
+        if (point[j] < rect->min[j]) d = (double)rect->min[j] - point[j];
+        else if (point[j] > rect->max[j]) d = (double)point[j] - rect->max[j];
+        sum += d * d;
+    }
+    return sum;
+}
+
+// Checks a tree's structure, entry count, range searches and nearest
+// neighbors against the entries marked in_tree
+// tree: pointer to the R-tree
+// step: name of the step that last changed the tree
+void check_tree(RTree *tree, const char *step) {
+    check(validate_tree(tree) == 0, step, "validate_tree found problems");
+    long expected = 0;
+    for (int i = 0; i < entry_count; i++) expected += in_tree[i];
+    check(tree_shape(tree).entries == expected, step, "wrong number of entries");
+
+    for (int q = 0; q < TEST_QUERIES; q++) {
+        Rect rect;
+        random_rect(&rect, TEST_WORLD / 10);
+        long brute_hits = 0;
+        for (int i = 0; i < entry_count; i++) {
+            if (in_tree[i] && rects_overlap(&entries[i].rect, &rect)) brute_hits++;
+        }
+        range_hits = 0;
+        search(tree->root, &rect, count_hit);
+        check(range_hits == brute_hits, step, "range search differs from the brute-force scan");
+
+        coord_t point[RTREE_DIMS];
+        for (int j = 0; j < RTREE_DIMS; j++) point[j] = (coord_t)next_random_int(TEST_WORLD);
+        double best = -1;
+        for (int i = 0; i < entry_count; i++) {
+            if (!in_tree[i]) continue;
+            double d = rect_distance2(&entries[i].rect, point);
+            if (best < 0 || d < best) best = d;
+        }
+        Entry *nearest = nearest_neighbor(tree, point);
+        if (best < 0) check(nearest == NULL, step, "nearest neighbor found in an empty tree");
+        else check(nearest != NULL && rect_distance2(&nearest->rect, point) == best, step,
+                   "nearest neighbor differs from the brute-force scan");
+    }
+}
+
+// Validates the tree every TEST_VALIDATE_EVERY single-entry changes
+// tree: pointer to the R-tree
+// changes: number of changes made so far in this step
+// step: name of the step
+void check_every(RTree *tree, int changes, const char *step) {
+    if (changes % TEST_VALIDATE_EVERY == 0) {
+        check(validate_tree(tree) == 0, step, "validate_tree found problems");
+    }
+}
+
+// Builds a tree by insertion and changes it every way the library offers
+// policy: split policy of the tree
+void test_split_policy(SplitPolicy policy) {
+    RTree *tree = init_tree();
+    tree->split_policy = policy;
+    memset(in_tree, 0, sizeof(bool) * entry_count);
+
+    // The first half one at a time, the second half in one batch
+    int half = entry_count / 2;
+    for (int i = 0; i < half; i++) {
+        insert(tree, &entries[i]);
+        in_tree[i] = true;
+        check_every(tree, i + 1, "insert");
+    }
+    check_tree(tree, "insert");
+    Entry **batch = (Entry **)malloc(sizeof(Entry *) * entry_count);
+    for (int i = half; i < entry_count; i++) batch[i - half] = &entries[i];
+    int inserted = insert_batch(tree, batch, entry_count - half);
+    check(inserted == entry_count - half, "insert_batch", "not every entry was inserted");
+    for (int i = half; i < entry_count; i++) in_tree[i] = true;
+    check_tree(tree, "insert_batch");
+
+    // Short moves stay in their leaves, long ones are reinserted
+    for (int k = 0; k < entry_count / 2; k++) {
+        Entry *entry = &entries[next_random_int(entry_count)];
+        Rect rect = entry->rect;
+        bool long_move = k % 10 == 0;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            coord_t shift = (coord_t)(long_move ? next_random_int(TEST_WORLD) - rect.min[j] : next_random_int(3));
+            rect.min[j] += shift;
+            rect.max[j] += shift;
+        }
+        check(update_entry(tree, entry, &rect), "update_entry", "entry not found");
+        check_every(tree, k + 1, "update_entry");
+    }
+    check_tree(tree, "update_entry");
+
+    // Delete a quarter one at a time and a quarter in one batch
+    int quarter = entry_count / 4;
+    for (int i = 0; i < quarter; i++) {
+        delete_entry(tree, &entries[i]);
+        in_tree[i] = false;
+        check_every(tree, i + 1, "delete_entry");
+    }
+    check_tree(tree, "delete_entry");
+    for (int i = 0; i < quarter; i++) batch[i] = &entries[quarter + i];
+    int deleted = delete_batch(tree, batch, quarter);
+    check(deleted == quarter, "delete_batch", "not every entry was deleted");
+    for (int i = quarter; i < 2 * quarter; i++) in_tree[i] = false;
+    check_tree(tree, "delete_batch");
+
+    repack_subtrees(tree, 1, 20);
+    check_tree(tree, "repack_subtrees");
+    repack_subtrees(tree, 2, 5);
+    check_tree(tree, "repack_subtrees");
+
+    // Empty the tree entirely, then fill it again
+    for (int i = 0; i < entry_count; i++) batch[i] = &entries[i];
+    delete_batch(tree, batch, entry_count);
+    memset(in_tree, 0, sizeof(bool) * entry_count);
+    check_tree(tree, "delete_batch to empty");
+    for (int i = 0; i < quarter; i++) {
+        insert(tree, &entries[i]);
+        in_tree[i] = true;
+    }
+    check_tree(tree, "insert after emptying");
+
+    free(batch);
+    free_tree(tree);
+}
+
+// Bulk loads a tree and changes it afterwards
+// method: ordering used to group entries into nodes
+void test_bulk_load(BulkLoadMethod method) {
+    Entry **list = (Entry **)malloc(sizeof(Entry *) * entry_count);
+    for (int i = 0; i < entry_count; i++) {
+        list[i] = &entries[i];
+        in_tree[i] = true;
+    }
+    RTree *tree = bulk_load(list, entry_count, method);
+    check_tree(tree, "bulk_load");
+
+    // Bulk loaded nodes are full, so the first inserts split them
+    int tenth = entry_count / 10;
+    for (int i = 0; i < tenth; i++) {
+        delete_entry(tree, &entries[i]);
+        in_tree[i] = false;
+    }
+    check_tree(tree, "delete_entry after bulk_load");
+    insert_batch(tree, list, tenth);
+    for (int i = 0; i < tenth; i++) in_tree[i] = true;
+    check_tree(tree, "insert_batch after bulk_load");
+
+    RTree *empty = bulk_load(list, 0, method);
+    memset(in_tree, 0, sizeof(bool) * entry_count);
+    check_tree(empty, "bulk_load of nothing");
+
+    free_tree(empty);
+    free_tree(tree);
+    free(list);
+}
+
+// Runs every test with the scan kernels selected for this process
+// count: number of entries
+// Returns the number of failed checks
+int run_tests(int count) {
+    entry_count = count;
+    entries = (Entry *)calloc(count, sizeof(Entry));
+    in_tree = (bool *)calloc(count, sizeof(bool));
+    for (int i = 0; i < count; i++) {
+        random_rect(&entries[i].rect, TEST_SIDE);
+        entries[i].data = (void *)(uintptr_t)i;
+    }
+
+    const char *policies[] = {"midpoint", "linear", "quadratic", "rstar"};
+    for (int p = SPLIT_MIDPOINT; p <= SPLIT_RSTAR; p++) {
+        int before = failures;
+        test_split_policy((SplitPolicy)p);
+        printf("%s split (%s kernels): %s\n", policies[p], node_scan_kernel_name(), failures == before ? "ok" : "FAILED");
+    }
+    const char *methods[] = {"STR", "Hilbert"};
+    for (int m = BULK_LOAD_STR; m <= BULK_LOAD_HILBERT; m++) {
+        int before = failures;
+        test_bulk_load((BulkLoadMethod)m);
+        printf("%s bulk load (%s kernels): %s\n", methods[m], node_scan_kernel_name(), failures == before ? "ok" : "FAILED");
+    }
+
+    free(entries);
+    free(in_tree);
+    return failures;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 5000;
+    if (count < 8) count = 8;
+    if (getenv("RTREE_SCAN_KERNEL") != NULL) return run_tests(count) == 0 ? 0 : 1;
+
+    // Run once per kernel setting; a setting the CPU lacks falls back to
+    // the default, which the output names
+    const char *kernels[] = {"scalar", "avx2", "avx512"};
+    bool ok = true;
+    for (int k = 0; k < 3; k++) {
+        char command[4096];
+        snprintf(command, sizeof(command), "RTREE_SCAN_KERNEL=%s \"%s\" %d", kernels[k], argv[0], count);
+        fflush(stdout);
+        if (system(command) != 0) ok = false;
+    }
+    printf("%s\n", ok ? "All tests passed" : "Some tests FAILED");
+    return ok ? 0 : 1;
+}
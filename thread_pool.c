@@ -0,0 +1,288 @@
+#include "thread_pool.h"
+#include "parallel_sort.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Initial number of tasks each worker's deque can hold (a power of two)
+#define DEQUE_INITIAL_CAPACITY 64
+
+// One unit of work waiting in a deque
+typedef struct PoolTask {
+    // Function to run
+    ThreadPoolTaskFn fn;
+    // Arguments passed to fn
+    void *arg;
+    void *item;
+} PoolTask;
+
+// Double-ended queue of tasks owned by one worker. The owner pushes and pops
+// at the tail (newest first, which keeps its working set in cache); idle
+// workers steal from the head (oldest first, which tends to be the largest
+// remaining piece of work).
+typedef struct WorkerDeque {
+    // Lock protecting the deque; contended only while stealing
+    pthread_mutex_t lock;
+    // Ring buffer of tasks, capacity is a power of two
+    PoolTask *tasks;
+    int capacity;
+    // Index of the oldest task and one past the newest task
+    unsigned int head;
+    unsigned int tail;
+} WorkerDeque;
+
+// Define one worker thread of the pool
+typedef struct PoolWorker {
+    // Pool the worker belongs to
+    ThreadPool *pool;
+    // Index of the worker in the pool
+    int id;
+    // Thread running the worker
+    pthread_t thread;
+    // Tasks queued on this worker
+    WorkerDeque deque;
+    // State of the generator choosing steal victims
+    unsigned int seed;
+} PoolWorker;
+
+// Define the pool of worker threads
+struct ThreadPool {
+    // Number of worker threads
+    int num_threads;
+    // The workers themselves
+    PoolWorker *workers;
+    // Lock and condition variables for sleeping workers and waiting callers
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t all_done;
+    // Number of workers about to wait or waiting for work
+    atomic_int sleeping;
+    // Set when the pool is being freed
+    bool shutdown;
+    // Tasks sitting in some deque
+    atomic_long queued;
+    // Tasks submitted and not yet finished
+    atomic_long pending;
+    // Next worker to receive a task submitted from outside the pool
+    atomic_uint next_worker;
+};
+
+// Worker running on the current thread, or NULL outside any pool
+static _Thread_local PoolWorker *current_worker = NULL;
+
+// Function declarations
+bool deque_push(WorkerDeque *deque, PoolTask *task);
+bool deque_pop(WorkerDeque *deque, PoolTask *task);
+bool deque_steal(WorkerDeque *deque, PoolTask *task);
+bool steal_task(PoolWorker *worker, PoolTask *task);
+void run_task(ThreadPool *pool, PoolTask *task);
+void *worker_main(void *arg);
+ThreadPool* create_thread_pool(int num_threads);
+void free_thread_pool(ThreadPool *pool);
+int thread_pool_size(ThreadPool *pool);
+int thread_pool_worker_id(void);
+void thread_pool_submit(ThreadPool *pool, ThreadPoolTaskFn fn, void *arg, void *item);
+void thread_pool_wait(ThreadPool *pool);
+
+// Pushes a task at the tail of a deque, growing it when full
+// Returns true (the push cannot fail)
+bool deque_push(WorkerDeque *deque, PoolTask *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail - deque->head == (unsigned int)deque->capacity) {
+        // Copy the tasks in order into a ring twice the size
+        int capacity = deque->capacity * 2;
+        PoolTask *tasks = (PoolTask *)malloc(sizeof(PoolTask) * capacity);
+        unsigned int count = deque->tail - deque->head;
+        for (unsigned int i = 0; i < count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+        deque->tail = count;
+    }
+    deque->tasks[deque->tail & (deque->capacity - 1)] = *task;
+    deque->tail++;
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+// Pops the newest task from the tail of a deque
+// Returns true if a task was taken
+bool deque_pop(WorkerDeque *deque, PoolTask *task) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->tail != deque->head;
+    if (found) {
+        deque->tail--;
+        *task = deque->tasks[deque->tail & (deque->capacity - 1)];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Steals the oldest task from the head of a deque
+// Returns true if a task was taken
+bool deque_steal(WorkerDeque *deque, PoolTask *task) {
+    // Don't wait for a busy victim; another one may be free
+    if (pthread_mutex_trylock(&deque->lock) != 0) return false;
+    bool found = deque->tail != deque->head;
+    if (found) {
+        *task = deque->tasks[deque->head & (deque->capacity - 1)];
+        deque->head++;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+// Tries to steal a task from the other workers, starting at a random victim
+// Returns true if a task was taken
+bool steal_task(PoolWorker *worker, PoolTask *task) {
+    ThreadPool *pool = worker->pool;
+    worker->seed = worker->seed * 1103515245u + 12345u;
+    int start = (int)((worker->seed >> 16) % (unsigned int)pool->num_threads);
+    for (int i = 0; i < pool->num_threads; i++) {
+        PoolWorker *victim = &pool->workers[(start + i) % pool->num_threads];
+        if (victim != worker && deque_steal(&victim->deque, task)) return true;
+    }
+    return false;
+}
+
+// Runs a task taken from a deque and wakes waiting callers after the last one
+void run_task(ThreadPool *pool, PoolTask *task) {
+    atomic_fetch_sub(&pool->queued, 1);
+    task->fn(pool, task->arg, task->item);
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->all_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Main loop of a worker thread: run own tasks, then steal, then sleep
+// arg: pointer to the PoolWorker
+void *worker_main(void *arg) {
+    PoolWorker *worker = (PoolWorker *)arg;
+    ThreadPool *pool = worker->pool;
+    current_worker = worker;
+    while (1) {
+        PoolTask task;
+        if (deque_pop(&worker->deque, &task) || steal_task(worker, &task)) {
+            run_task(pool, &task);
+            continue;
+        }
+        // Nothing to run anywhere: sleep until a task is submitted
+        pthread_mutex_lock(&pool->lock);
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        // Announce the sleep before checking for work; a submitter increments
+        // queued before checking sleeping, so one of the two sees the other
+        atomic_fetch_add(&pool->sleeping, 1);
+        if (atomic_load(&pool->queued) == 0) pthread_cond_wait(&pool->work_ready, &pool->lock);
+        atomic_fetch_sub(&pool->sleeping, 1);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+// Creates a pool of worker threads
+// num_threads: number of workers, or 0 for one per processor
+// Returns a pointer to the new pool
+ThreadPool* create_thread_pool(int num_threads) {
+    if (num_threads <= 0) num_threads = parallel_thread_count();
+    ThreadPool *pool = (ThreadPool *)malloc(sizeof(ThreadPool));
+    pool->num_threads = num_threads;
+    pool->workers = (PoolWorker *)malloc(sizeof(PoolWorker) * num_threads);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    atomic_init(&pool->sleeping, 0);
+    pool->shutdown = false;
+    atomic_init(&pool->queued, 0);
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->next_worker, 0);
+    // Set up every deque before any thread can try to steal from it
+    for (int i = 0; i < num_threads; i++) {
+        PoolWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->id = i;
+        worker->seed = 2654435761u * (unsigned int)(i + 1);
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->deque.tasks = (PoolTask *)malloc(sizeof(PoolTask) * DEQUE_INITIAL_CAPACITY);
+        worker->deque.capacity = DEQUE_INITIAL_CAPACITY;
+        worker->deque.head = 0;
+        worker->deque.tail = 0;
+    }
+    for (int i = 0; i < num_threads; i++) {
+        pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]);
+    }
+    return pool;
+}
+
+// Waits for all submitted tasks, stops the workers and frees the pool
+// pool: pointer to the pool
+void free_thread_pool(ThreadPool *pool) {
+    thread_pool_wait(pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->num_threads; i++) pthread_join(pool->workers[i].thread, NULL);
+    for (int i = 0; i < pool->num_threads; i++) {
+        pthread_mutex_destroy(&pool->workers[i].deque.lock);
+        free(pool->workers[i].deque.tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->workers);
+    free(pool);
+}
+
+// Returns the number of worker threads in a pool
+int thread_pool_size(ThreadPool *pool) {
+    return pool->num_threads;
+}
+
+// Returns the index of the worker running the calling thread, or -1 when
+// called from outside any pool; tasks use it to pick per-thread state
+int thread_pool_worker_id(void) {
+    return current_worker ? current_worker->id : -1;
+}
+
+// Queues a task on the pool. A task submitted from one of the pool's own
+// workers goes on that worker's deque, so split work stays local until
+// another worker steals it; others are dealt out round-robin.
+// pool: pointer to the pool
+// fn: function to run
+// arg, item: pointers passed to fn
+void thread_pool_submit(ThreadPool *pool, ThreadPoolTaskFn fn, void *arg, void *item) {
+    PoolTask task = {fn, arg, item};
+    PoolWorker *worker = current_worker;
+    if (worker == NULL || worker->pool != pool) {
+        worker = &pool->workers[atomic_fetch_add(&pool->next_worker, 1) % (unsigned int)pool->num_threads];
+    }
+    // Count the task as pending before it can run, so waiters never see zero early
+    atomic_fetch_add(&pool->pending, 1);
+    deque_push(&worker->deque, &task);
+    atomic_fetch_add(&pool->queued, 1);
+    // Wake a sleeping worker, if any; taking the lock only when one sleeps
+    // keeps submission cheap while every worker is busy
+    if (atomic_load(&pool->sleeping) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work_ready);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Waits until every submitted task, including tasks they submit, has finished.
+// Must be called from outside the pool's workers.
+// pool: pointer to the pool
+void thread_pool_wait(ThreadPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending) > 0) pthread_cond_wait(&pool->all_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,19 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+// Forward declaration of ThreadPool
+typedef struct ThreadPool ThreadPool;
+
+// Function run by a task: the pool it runs on, plus the two pointers given
+// when the task was submitted (typically shared job state and one work item)
+typedef void (*ThreadPoolTaskFn)(ThreadPool *pool, void *arg, void *item);
+
+// Function declarations
+ThreadPool* create_thread_pool(int num_threads);
+void free_thread_pool(ThreadPool *pool);
+int thread_pool_size(ThreadPool *pool);
+int thread_pool_worker_id(void);
+void thread_pool_submit(ThreadPool *pool, ThreadPoolTaskFn fn, void *arg, void *item);
+void thread_pool_wait(ThreadPool *pool);
+
+#endif // THREAD_POOL_H
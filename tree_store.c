@@ -0,0 +1,391 @@
+#include "tree_store.h"
+#include "paged_file.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Function declarations
+void seal_log_record(LogRecord *record);
+bool log_record_valid(LogRecord *record);
+bool append_log(TreeStore *store, LogOp op, Rect *rect, void *data);
+Entry* find_stored_entry(RTreeNode *node, Rect *rect, void *data);
+void apply_insert(TreeStore *store, Rect *rect, void *data);
+bool apply_delete(TreeStore *store, Rect *rect, void *data);
+long replay_log(TreeStore *store, bool *log_found);
+void mark_used_pages(RTreeNode *node, unsigned char *used);
+int compare_pages_descending(const void *a, const void *b);
+uint64_t allocate_page(TreeStore *store);
+bool checkpoint_node(TreeStore *store, RTreeNode *node, DiskNode *page, PageList *replaced, uint64_t *last_page);
+TreeStore* open_tree_store(const char *path);
+void close_tree_store(TreeStore *store);
+bool store_insert(TreeStore *store, Rect *rect, void *data);
+bool store_delete(TreeStore *store, Rect *rect, void *data);
+bool store_checkpoint(TreeStore *store);
+
+// Stores the checksum of a log record in the record
+// record: pointer to the record
+void seal_log_record(LogRecord *record) {
+    record->checksum = paged_checksum((unsigned char *)record + sizeof(uint32_t), sizeof(LogRecord) - sizeof(uint32_t));
+}
+
+// Checks the checksum and kind of a log record read back from the log
+// record: pointer to the record
+// Returns true if the record is complete
+bool log_record_valid(LogRecord *record) {
+    uint32_t actual = paged_checksum((unsigned char *)record + sizeof(uint32_t), sizeof(LogRecord) - sizeof(uint32_t));
+    return record->checksum == actual && (record->op == LOG_INSERT || record->op == LOG_DELETE);
+}
+
+// Appends a change to the log
+// store: pointer to the store
+// op: kind of change
+// rect: rectangle of the entry
+// data: data pointer of the entry
+// Returns true if the record was written
+bool append_log(TreeStore *store, LogOp op, Rect *rect, void *data) {
+    LogRecord record;
+    // Clear the padding too, since the checksum covers it
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.position = store->log_position + 1;
+    record.data = (uint64_t)(uintptr_t)data;
+    record.rect = *rect;
+    seal_log_record(&record);
+    bool written = store->log != NULL && fwrite(&record, sizeof(record), 1, store->log) == 1;
+    // Hand the record to the OS now, so it survives a crash of the process
+    written = written && (store->sync_log ? paged_sync(store->log) : fflush(store->log) == 0);
+    if (!written) {
+        fprintf(stderr, "Failed to write change log %s\n", store->log_path);
+        return false;
+    }
+    store->log_position = record.position;
+    return true;
+}
+
+// Finds an entry with a given rectangle and data pointer
+// node: pointer to the current R-tree node
+// rect: rectangle of the entry
+// data: data pointer of the entry
+// Returns the entry, or NULL if the subtree holds no such entry
+Entry* find_stored_entry(RTreeNode *node, Rect *rect, void *data) {
+    coord_t (*max)[MAX_ENTRIES + 1] = NODE_MAX_ARRAYS(node);
+    for (int i = 0; i < node->num_entries; i++) {
+        // Only entries whose rectangle contains rect can lead to it
+        bool contains = true;
+        for (int j = 0; j < RTREE_DIMS; j++) {
+            if (node->min[j][i] > rect->min[j] || max[j][i] < rect->max[j]) contains = false;
+        }
+        if (!contains) continue;
+        if (node->is_leaf) {
+            Entry *entry = node->child[i].entry;
+            if (entry->data == data && memcmp(&entry->rect, rect, sizeof(Rect)) == 0) return entry;
+        } else {
+            Entry *entry = find_stored_entry(node->child[i].node, rect, data);
+            if (entry) return entry;
+        }
+    }
+    return NULL;
+}
+
+// Inserts a tree-owned entry into the store's tree
+// store: pointer to the store
+// rect: rectangle of the entry
+// data: data pointer of the entry
+void apply_insert(TreeStore *store, Rect *rect, void *data) {
+    Entry *entry = alloc_entry(store->tree);
+    entry->rect = *rect;
+    entry->data = data;
+    insert(store->tree, entry);
+    store->entry_count++;
+}
+
+// Deletes an entry from the store's tree
+// store: pointer to the store
+// rect: rectangle of the entry
+// data: data pointer of the entry
+// Returns true if the entry was found
+bool apply_delete(TreeStore *store, Rect *rect, void *data) {
+    Entry *entry = find_stored_entry(store->tree->root, rect, data);
+    if (entry == NULL) return false;
+    delete_entry(store->tree, entry);
+    release_entry(store->tree, entry);
+    store->entry_count--;
+    return true;
+}
+
+// Applies the log records written after the loaded checkpoint. Reading stops
+// at the first incomplete record, which a crash may have left at the end.
+// store: pointer to the store, holding the checkpoint's tree and log position
+// log_found: set to whether the log holds any bytes at all
+// Returns the number of records applied
+long replay_log(TreeStore *store, bool *log_found) {
+    *log_found = false;
+    FILE *log = fopen(store->log_path, "rb");
+    if (!log) return 0;
+    fseek(log, 0, SEEK_END);
+    *log_found = ftell(log) > 0;
+    rewind(log);
+    long applied = 0;
+    LogRecord record;
+    while (fread(&record, sizeof(record), 1, log) == 1) {
+        if (!log_record_valid(&record)) break;
+        // Records up to the checkpoint's position are already in the tree
+        if (record.position <= store->log_position) continue;
+        void *data = (void *)(uintptr_t)record.data;
+        if (record.op == LOG_INSERT) apply_insert(store, &record.rect, data);
+        else apply_delete(store, &record.rect, data);
+        store->log_position = record.position;
+        applied++;
+    }
+    fclose(log);
+    return applied;
+}
+
+// Marks the pages used by a subtree
+// node: pointer to the root of the subtree
+// used: one flag per page, indexed by page number
+void mark_used_pages(RTreeNode *node, unsigned char *used) {
+    used[node->page] = 1;
+    if (node->is_leaf) return;
+    for (int i = 0; i < node->num_entries; i++) mark_used_pages(node->child[i].node, used);
+}
+
+// Compares two page numbers for sorting in descending order
+// Returns a negative, zero or positive value as for qsort
+int compare_pages_descending(const void *a, const void *b) {
+    uint64_t pa = *(const uint64_t *)a;
+    uint64_t pb = *(const uint64_t *)b;
+    return (pa < pb) - (pa > pb);
+}
+
+// Picks the page for a node being checkpointed: a free page if there is one,
+// otherwise a new page at the end of the file
+// store: pointer to the store
+// Returns the page number
+uint64_t allocate_page(TreeStore *store) {
+    if (store->free_pages.count > 0) return store->free_pages.pages[--store->free_pages.count];
+    return ++store->page_count;
+}
+
+// Writes a dirty subtree to new pages, children before their parent; clean
+// children keep their pages
+// store: pointer to the store
+// node: pointer to a dirty node
+// page: page buffer of the file's page size
+// replaced: receives the pages the subtree's nodes used before
+// last_page: page written last, so runs of consecutive pages skip the seek
+// Returns true if every page was written
+bool checkpoint_node(TreeStore *store, RTreeNode *node, DiskNode *page, PageList *replaced, uint64_t *last_page) {
+    uint64_t refs[MAX_ENTRIES + 1];
+    for (int i = 0; i < node->num_entries; i++) {
+        if (node->is_leaf) {
+            refs[i] = (uint64_t)(uintptr_t)node->child[i].entry->data;
+        } else {
+            RTreeNode *child = node->child[i].node;
+            if (child->dirty && !checkpoint_node(store, child, page, replaced, last_page)) return false;
+            refs[i] = child->page;
+        }
+    }
+    // Never overwrite the node's current page: the last header still uses it
+    if (node->page != 0) page_list_push(replaced, node->page);
+    node->page = allocate_page(store);
+    uint32_t page_size = paged_page_size();
+    paged_fill_node(page, page_size, node, refs);
+    // Seeking flushes the file's buffer, so only seek when the page isn't next
+    if (node->page != *last_page + 1) {
+        long offset = PAGED_HEADER_SIZE + (long)(node->page - 1) * page_size;
+        if (fseek(store->file, offset, SEEK_SET) != 0) return false;
+    }
+    if (fwrite(page, page_size, 1, store->file) != 1) return false;
+    *last_page = node->page;
+    node->dirty = false;
+    store->last_checkpoint_pages++;
+    return true;
+}
+
+// Opens a store, creating the file if it does not exist. The newest
+// checkpoint is loaded, the log replayed on top of it, and if anything was
+// replayed a checkpoint is taken so the log starts out empty.
+// path: name of the paged file; the log is path with ".wal" appended
+// Returns a pointer to the store, or NULL if the file cannot be used
+TreeStore* open_tree_store(const char *path) {
+    TreeStore *store = (TreeStore *)calloc(1, sizeof(TreeStore));
+    store->log_path = (char *)malloc(strlen(path) + 5);
+    sprintf(store->log_path, "%s.wal", path);
+
+    FILE *existing = fopen(path, "rb");
+    bool created = existing == NULL;
+    if (existing) {
+        fclose(existing);
+        MappedTree *mt = map_tree(path);
+        if (!mt) {
+            free(store->log_path);
+            free(store);
+            return NULL;
+        }
+        store->tree = load_mapped_tree(mt, true, NULL);
+        if (!store->tree) {
+            unmap_tree(mt);
+            free(store->log_path);
+            free(store);
+            return NULL;
+        }
+        store->sequence = mt->header->sequence;
+        store->log_position = mt->header->log_position;
+        store->page_count = mt->header->page_count;
+        store->entry_count = mt->header->entry_count;
+        unmap_tree(mt);
+        // Pages the loaded tree doesn't use may belong to the older header's
+        // tree, so they only become free after the next checkpoint
+        unsigned char *used = (unsigned char *)calloc(store->page_count + 1, 1);
+        mark_used_pages(store->tree->root, used);
+        for (uint64_t p = 1; p <= store->page_count; p++) {
+            if (!used[p]) page_list_push(&store->retired_pages, p);
+        }
+        free(used);
+        store->file = fopen(path, "r+b");
+    } else {
+        store->tree = init_tree();
+        store->file = fopen(path, "w+b");
+        if (store->file) {
+            // Reserve the header page; the first checkpoint fills it in
+            unsigned char header_page[PAGED_HEADER_SIZE];
+            memset(header_page, 0, sizeof(header_page));
+            fwrite(header_page, sizeof(header_page), 1, store->file);
+        }
+    }
+    if (!store->file) {
+        fprintf(stderr, "Failed to open file %s for writing\n", path);
+        free_tree(store->tree);
+        free(store->log_path);
+        free(store);
+        return NULL;
+    }
+
+    bool log_found;
+    replay_log(store, &log_found);
+    store->log = fopen(store->log_path, "ab");
+    if (!store->log) {
+        fprintf(stderr, "Failed to open change log %s\n", store->log_path);
+        close_tree_store(store);
+        return NULL;
+    }
+    // The checkpoint empties the log, dropping any partial record at its end
+    if ((created || log_found) && !store_checkpoint(store)) {
+        close_tree_store(store);
+        return NULL;
+    }
+    return store;
+}
+
+// Closes a store without taking a checkpoint; changes since the last one are
+// replayed from the log when the store is opened again
+// store: pointer to the store
+void close_tree_store(TreeStore *store) {
+    if (store->log) fclose(store->log);
+    fclose(store->file);
+    free_tree(store->tree);
+    free(store->free_pages.pages);
+    free(store->retired_pages.pages);
+    free(store->log_path);
+    free(store);
+}
+
+// Inserts an entry, logging it first
+// store: pointer to the store
+// rect: pointer to the rectangle of the entry
+// data: data pointer of the entry; it is stored as an integer, so use ids
+// rather than pointers that will not be valid after a restart
+// Returns true if the entry was inserted
+bool store_insert(TreeStore *store, Rect *rect, void *data) {
+    if (store->tree->read_only) {
+        fprintf(stderr, "Tree is read-only, insert ignored\n");
+        return false;
+    }
+    if (!append_log(store, LOG_INSERT, rect, data)) return false;
+    apply_insert(store, rect, data);
+    return true;
+}
+
+// Deletes the entry with a given rectangle and data pointer, logging it first
+// store: pointer to the store
+// rect: pointer to the rectangle of the entry
+// data: data pointer of the entry
+// Returns true if the entry was found and deleted
+bool store_delete(TreeStore *store, Rect *rect, void *data) {
+    if (store->tree->read_only) {
+        fprintf(stderr, "Tree is read-only, delete ignored\n");
+        return false;
+    }
+    if (find_stored_entry(store->tree->root, rect, data) == NULL) return false;
+    if (!append_log(store, LOG_DELETE, rect, data)) return false;
+    return apply_delete(store, rect, data);
+}
+
+// Writes the nodes changed since the last checkpoint and a new header, then
+// empties the log. Pages are synced before the header is written, and the
+// header goes to the slot of the older header, so a crash at any point
+// leaves either this checkpoint or the previous one intact.
+// store: pointer to the store
+// Returns true if the checkpoint was written
+bool store_checkpoint(TreeStore *store) {
+    if (store->failed) {
+        fprintf(stderr, "A previous checkpoint failed; reopen the store to recover\n");
+        return false;
+    }
+    RTree *tree = store->tree;
+    PageList replaced = {NULL, 0, 0};
+    store->last_checkpoint_pages = 0;
+    bool ok = true;
+    if (tree->root->dirty) {
+        // Hand out free pages lowest first, so nodes written one after another
+        // tend to land on consecutive pages
+        if (store->free_pages.count > 1) {
+            qsort(store->free_pages.pages, store->free_pages.count, sizeof(uint64_t), compare_pages_descending);
+        }
+        DiskNode *page = (DiskNode *)malloc(paged_page_size());
+        // Start at page 1, as if page 0 had just been written
+        uint64_t last_page = 0;
+        ok = fseek(store->file, PAGED_HEADER_SIZE, SEEK_SET) == 0 && checkpoint_node(store, tree->root, page, &replaced, &last_page);
+        free(page);
+    }
+    ok = ok && paged_sync(store->file);
+
+    // Point the header at the new root
+    int height = 0;
+    for (RTreeNode *node = tree->root; !node->is_leaf; node = node->child[0].node) height++;
+    PagedFileHeader header;
+    paged_init_header(&header);
+    header.height = (uint32_t)height;
+    header.root_page = tree->root->page;
+    header.page_count = store->page_count;
+    header.entry_count = store->entry_count;
+    header.sequence = store->sequence + 1;
+    header.log_position = store->log_position;
+    ok = ok && paged_write_header(store->file, &header) && paged_sync(store->file);
+    if (!ok) {
+        fprintf(stderr, "Failed to write checkpoint\n");
+        store->failed = true;
+        free(replaced.pages);
+        return false;
+    }
+    store->sequence = header.sequence;
+
+    // The new header overwrote the one that still used the retired pages
+    for (int i = 0; i < store->retired_pages.count; i++) page_list_push(&store->free_pages, store->retired_pages.pages[i]);
+    store->retired_pages.count = 0;
+    // Pages replaced now, including those of released nodes, retire in turn
+    for (int i = 0; i < tree->released_pages.count; i++) page_list_push(&replaced, tree->released_pages.pages[i]);
+    tree->released_pages.count = 0;
+    free(store->retired_pages.pages);
+    store->retired_pages = replaced;
+
+    // Every logged change is in the file now, so start a new log
+    fclose(store->log);
+    store->log = fopen(store->log_path, "wb");
+    if (!store->log) {
+        fprintf(stderr, "Failed to open change log %s\n", store->log_path);
+        store->failed = true;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,79 @@
+#ifndef TREE_STORE_H
+#define TREE_STORE_H
+
+#include <stdio.h>
+#include "rtree.h"
+
+// A tree kept in a paged file (paged_file.h) together with a change log.
+// Every insert and delete is appended to the log before it is applied, so
+// nothing is lost between checkpoints. A checkpoint writes only the nodes
+// changed since the previous one, to pages no header references, and then a
+// new header; unchanged subtrees keep their pages. Its cost therefore grows
+// with the number of changes rather than with the size of the tree.
+// Opening a store loads the newest checkpoint and replays the log on top.
+//
+//   path        paged tree file
+//   path.wal    change log: LogRecords appended since the last checkpoint
+
+// Define the kinds of change recorded in the log
+typedef enum LogOp {
+    LOG_INSERT = 1,
+    LOG_DELETE = 2
+} LogOp;
+
+// Define one record of the change log
+typedef struct LogRecord {
+    // Checksum of the record after this field
+    uint32_t checksum;
+    // Kind of change (LogOp)
+    uint32_t op;
+    // Position of the record; grows by one per record across checkpoints
+    uint64_t position;
+    // Data value of the entry, stored as in the paged file
+    uint64_t data;
+    // Rectangle of the entry
+    Rect rect;
+} LogRecord;
+
+// Define a tree backed by a paged file and a change log
+typedef struct TreeStore {
+    // The tree; query it directly, but change it only through the store
+    RTree *tree;
+    // Paged file, open for reading and writing
+    FILE *file;
+    // Change log, open for appending
+    FILE *log;
+    // Name of the change log
+    char *log_path;
+    // Sequence number of the last checkpoint
+    uint64_t sequence;
+    // Position of the last record written to the log
+    uint64_t log_position;
+    // Number of pages in the file
+    uint64_t page_count;
+    // Number of entries in the tree
+    uint64_t entry_count;
+    // Pages no header on disk references, reused by the next checkpoint
+    PageList free_pages;
+    // Pages replaced by the last checkpoint; the older header still
+    // references them, so they become free after the next checkpoint
+    PageList retired_pages;
+    // Pages written by the last checkpoint
+    long last_checkpoint_pages;
+    // When set, each log record is synced to the device before the change is
+    // applied; otherwise records survive a crash of the process but may be
+    // lost on power failure
+    bool sync_log;
+    // Set when a checkpoint failed part way; later checkpoints are refused
+    // and the store must be reopened to recover from the file and log
+    bool failed;
+} TreeStore;
+
+// Function declarations
+TreeStore* open_tree_store(const char *path);
+void close_tree_store(TreeStore *store);
+bool store_insert(TreeStore *store, Rect *rect, void *data);
+bool store_delete(TreeStore *store, Rect *rect, void *data);
+bool store_checkpoint(TreeStore *store);
+
+#endif // TREE_STORE_H